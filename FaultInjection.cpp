@@ -0,0 +1,227 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FaultInjection.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Latency and fault injection in front of the Kinesis calls
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "FaultInjection.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+
+const short g_ft_io_error = 4; // FT_IO_ERROR, what a USB hiccup usually reports
+
+// in FaultProfile field order
+const FaultProfile g_FaultProfiles[] = {
+   {"None",               0.0,  0.0,     0.0,   0.0,  0.0,   0.0,   0.0,   g_ft_io_error},
+   {"Slow USB",           2.0,  0.0,     0.0,   20.0, 0.0,   0.0,   0.0,   g_ft_io_error},
+   {"USB stalls",         0.5,  0.01,    500.0, 0.0,  0.0,   0.0,   0.0,   g_ft_io_error},
+   {"Lost completions",   0.0,  0.0,     0.0,   0.0,  0.05,  0.0,   0.0,   g_ft_io_error},
+   {"Duplicate messages", 0.0,  0.0,     0.0,   0.0,  0.0,   0.1,   0.0,   g_ft_io_error},
+   {"Failing calls",      0.0,  0.0,     0.0,   0.0,  0.0,   0.0,   0.02,  g_ft_io_error},
+   {"Mixed",              1.0,  0.005,   300.0, 10.0, 0.02,  0.02,  0.01,  g_ft_io_error}
+};
+const int g_NumFaultProfiles = sizeof(g_FaultProfiles)/sizeof(g_FaultProfiles[0]);
+
+FaultInjectionBackend::FaultInjectionBackend(KinesisBackend* inner, WheelClock* clock) :
+   inner_(inner),
+   clock_(clock),
+   profile_(g_FaultProfiles[0]),
+   active_(false),
+   stalls_(0),
+   dropped_(0),
+   duplicated_(0),
+   failed_(0)
+{
+}
+
+FaultInjectionBackend::~FaultInjectionBackend()
+{
+   delete inner_;
+}
+
+void FaultInjectionBackend::SetProfile(const FaultProfile& profile, unsigned long seed)
+{
+   MMThreadGuard guard(lock_);
+   profile_ = profile;
+   active_ = profile.callLatencyMs > 0.0 || profile.stallProbability > 0.0 || profile.messageDelayMs > 0.0 ||
+      profile.dropProbability > 0.0 || profile.duplicateProbability > 0.0 || profile.failProbability > 0.0;
+   random_.seed(seed);
+   stalls_ = 0;
+   dropped_ = 0;
+   duplicated_ = 0;
+   failed_ = 0;
+   // held-back messages go out straight away rather than being lost
+   for (size_t i = 0; i < pending_.size(); i++)
+      pending_[i].releaseMs = 0.0;
+}
+
+// Caller holds lock_
+double FaultInjectionBackend::Draw(double meanMs)
+{
+   if (meanMs <= 0.0)
+      return 0.0;
+   std::exponential_distribution<double> distribution(1.0/meanMs);
+   return distribution(random_);
+}
+
+// Caller holds lock_
+bool FaultInjectionBackend::Chance(double probability)
+{
+   if (probability <= 0.0)
+      return false;
+   std::uniform_real_distribution<double> distribution(0.0, 1.0);
+   return distribution(random_) < probability;
+}
+
+void FaultInjectionBackend::Delay()
+{
+   double delayMs;
+   {
+      MMThreadGuard guard(lock_);
+      if (!active_)
+         return;
+      delayMs = Draw(profile_.callLatencyMs);
+      if (Chance(profile_.stallProbability))
+      {
+         delayMs += profile_.stallMs;
+         stalls_++;
+      }
+   }
+   if (delayMs > 0.0)
+      clock_->SleepMs(delayMs);
+}
+
+// The Kinesis error the command fails with, 0 when it goes through
+short FaultInjectionBackend::Fail()
+{
+   MMThreadGuard guard(lock_);
+   if (!Chance(profile_.failProbability))
+      return 0;
+   failed_++;
+   return profile_.failError;
+}
+
+// Moves whatever the controller has delivered into the held-back queue,
+// dropping and duplicating as the profile says. Caller holds lock_.
+void FaultInjectionBackend::Pump()
+{
+   const FaultProfile& profile = profile_;
+   while (inner_->MessageQueueSize() > 0)
+   {
+      PendingMessage message;
+      if (!inner_->GetNextMessage(&message.type, &message.id, &message.data))
+         break;
+      if (Chance(profile.dropProbability))
+      {
+         dropped_++;
+         continue;
+      }
+      // delays never reorder messages
+      message.releaseMs = clock_->NowMs() + Draw(profile.messageDelayMs);
+      if (!pending_.empty() && pending_.back().releaseMs > message.releaseMs)
+         message.releaseMs = pending_.back().releaseMs;
+      pending_.push_back(message);
+      if (Chance(profile.duplicateProbability))
+      {
+         pending_.push_back(message);
+         duplicated_++;
+      }
+   }
+}
+
+// Caller holds lock_
+size_t FaultInjectionBackend::Ready()
+{
+   double now = clock_->NowMs();
+   size_t ready = 0;
+   while (ready < pending_.size() && pending_[ready].releaseMs <= now)
+      ready++;
+   return ready;
+}
+
+int FaultInjectionBackend::MessageQueueSize()
+{
+   MMThreadGuard guard(lock_);
+   if (!active_ && pending_.empty())
+      return inner_->MessageQueueSize();
+   Pump();
+   return (int)Ready();
+}
+
+bool FaultInjectionBackend::GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData)
+{
+   MMThreadGuard guard(lock_);
+   if (!active_ && pending_.empty())
+      return inner_->GetNextMessage(messageType, messageId, messageData);
+   Pump();
+   if (Ready() == 0)
+      return false;
+   *messageType = pending_.front().type;
+   *messageId = pending_.front().id;
+   *messageData = pending_.front().data;
+   pending_.pop_front();
+   return true;
+}
+
+short FaultInjectionBackend::ClearMessageQueue()
+{
+   {
+      MMThreadGuard guard(lock_);
+      pending_.clear();
+   }
+   return inner_->ClearMessageQueue();
+}
+
+short FaultInjectionBackend::MoveToPosition(int index)
+{
+   Delay();
+   short error = Fail();
+   return error != 0 ? error : inner_->MoveToPosition(index);
+}
+
+short FaultInjectionBackend::MoveAtVelocity(MOT_TravelDirection direction)
+{
+   Delay();
+   short error = Fail();
+   return error != 0 ? error : inner_->MoveAtVelocity(direction);
+}
+
+short FaultInjectionBackend::Home()
+{
+   Delay();
+   short error = Fail();
+   return error != 0 ? error : inner_->Home();
+}
+
+// stops and output changes are never failed, the recovery paths depend on them.
+// The getters read the DLL's polled copy and never reach USB, so they are not delayed.
+short FaultInjectionBackend::StopProfiled() {Delay(); return inner_->StopProfiled();}
+short FaultInjectionBackend::StopImmediate() {Delay(); return inner_->StopImmediate();}
+short FaultInjectionBackend::SetPositionCounter(long count) {Delay(); return inner_->SetPositionCounter(count);}
+short FaultInjectionBackend::SetDigitalOutputs(byte outputs) {Delay(); return inner_->SetDigitalOutputs(outputs);}
+short FaultInjectionBackend::SetTriggerSwitches(byte switches) {Delay(); return inner_->SetTriggerSwitches(switches);}
+int FaultInjectionBackend::GetPosition() {return inner_->GetPosition();}
+short FaultInjectionBackend::RequestPosition() {Delay(); return inner_->RequestPosition();}
+long FaultInjectionBackend::GetEncoderCounter() {return inner_->GetEncoderCounter();}
+short FaultInjectionBackend::RequestEncoderCounter() {Delay(); return inner_->RequestEncoderCounter();}
+DWORD FaultInjectionBackend::GetStatusBits() {return inner_->GetStatusBits();}
+short FaultInjectionBackend::RequestStatusBits() {Delay(); return inner_->RequestStatusBits();}
+long FaultInjectionBackend::PollingDuration() {return inner_->PollingDuration();}
+byte FaultInjectionBackend::GetTriggerSwitches() {return inner_->GetTriggerSwitches();}
+short FaultInjectionBackend::RequestTriggerSwitches() {Delay(); return inner_->RequestTriggerSwitches();}
+
+// settings traffic is left alone, the profiles model motion and status I/O
+short FaultInjectionBackend::RequestSettings() {return inner_->RequestSettings();}
+short FaultInjectionBackend::GetHardwareInfoBlock(TLI_HardwareInformation* info) {return inner_->GetHardwareInfoBlock(info);}
+short FaultInjectionBackend::RequestVelParams() {return inner_->RequestVelParams();}
+short FaultInjectionBackend::GetVelParamsBlock(MOT_VelocityParameters* params) {return inner_->GetVelParamsBlock(params);}
+short FaultInjectionBackend::SetVelParams(int acceleration, int maxVelocity) {return inner_->SetVelParams(acceleration, maxVelocity);}
+short FaultInjectionBackend::RequestHomingParams() {return inner_->RequestHomingParams();}
+short FaultInjectionBackend::GetHomingParamsBlock(MOT_HomingParameters* params) {return inner_->GetHomingParamsBlock(params);}
+short FaultInjectionBackend::SetHomingParamsBlock(MOT_HomingParameters* params) {return inner_->SetHomingParamsBlock(params);}
+bool FaultInjectionBackend::PersistSettings() {return inner_->PersistSettings();}
+bool FaultInjectionBackend::LoadNamedSettings(const char* name) {return inner_->LoadNamedSettings(name);}
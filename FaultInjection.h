@@ -0,0 +1,117 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FaultInjection.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Latency and fault injection in front of the Kinesis calls
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "KinesisBackend.h"
+
+#include <deque>
+#include <random>
+#include <atomic>
+
+// What goes wrong and how often. Latencies are means of exponential
+// distributions; probabilities are per call or per message. The presets are
+// starting points, every field can be set on its own.
+struct FaultProfile
+{
+   const char* name;
+   double callLatencyMs;      // added to every call
+   double stallProbability;   // chance of a USB stall on a call
+   double stallMs;
+   double messageDelayMs;     // added before a message becomes visible
+   double dropProbability;    // message lost
+   double duplicateProbability; // message delivered twice
+   double failProbability;    // command fails without reaching the controller
+   short failError;           // Kinesis error code it fails with
+};
+
+extern const FaultProfile g_FaultProfiles[];
+extern const int g_NumFaultProfiles; // the first profile injects nothing
+
+// Sits between the wheel (or a trace recorder) and the real or replayed
+// backend, which it takes over. The profile can be switched while the wheel
+// runs and is only read under the lock; every random draw comes from one
+// seeded generator.
+class FaultInjectionBackend : public KinesisBackend
+{
+public:
+   FaultInjectionBackend(KinesisBackend* inner, WheelClock* clock);
+   ~FaultInjectionBackend();
+
+   void SetProfile(const FaultProfile& profile, unsigned long seed);
+
+   int MessageQueueSize();
+   bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData);
+   short ClearMessageQueue();
+   short MoveToPosition(int index);
+   short MoveAtVelocity(MOT_TravelDirection direction);
+   short Home();
+   short StopProfiled();
+   short StopImmediate();
+   short SetPositionCounter(long count);
+   short SetDigitalOutputs(byte outputs);
+   short SetTriggerSwitches(byte switches);
+   int GetPosition();
+   short RequestPosition();
+   long GetEncoderCounter();
+   short RequestEncoderCounter();
+   DWORD GetStatusBits();
+   short RequestStatusBits();
+   long PollingDuration();
+   byte GetTriggerSwitches();
+   short RequestTriggerSwitches();
+   short RequestSettings();
+   short GetHardwareInfoBlock(TLI_HardwareInformation* info);
+   short RequestVelParams();
+   short GetVelParamsBlock(MOT_VelocityParameters* params);
+   short SetVelParams(int acceleration, int maxVelocity);
+   short RequestHomingParams();
+   short GetHomingParamsBlock(MOT_HomingParameters* params);
+   short SetHomingParamsBlock(MOT_HomingParameters* params);
+   bool PersistSettings();
+   bool LoadNamedSettings(const char* name);
+
+   long TraceRecords() const {return inner_->TraceRecords();}
+   long TraceDivergences() const {return inner_->TraceDivergences();}
+
+   long Stalls() const {return stalls_;}
+   long Dropped() const {return dropped_;}
+   long Duplicated() const {return duplicated_;}
+   long Failed() const {return failed_;}
+
+private:
+   struct PendingMessage
+   {
+      WORD type;
+      WORD id;
+      DWORD data;
+      double releaseMs;
+   };
+
+   void Delay();
+   short Fail();
+   void Pump();
+   size_t Ready();
+   double Draw(double meanMs);
+   bool Chance(double probability);
+
+   KinesisBackend* inner_;
+   WheelClock* clock_;
+   MMThreadLock lock_;
+   FaultProfile profile_;
+   bool active_; // false while the profile injects nothing
+   std::mt19937 random_;
+   std::deque<PendingMessage> pending_;
+   std::atomic<long> stalls_;
+   std::atomic<long> dropped_;
+   std::atomic<long> duplicated_;
+   std::atomic<long> failed_;
+};
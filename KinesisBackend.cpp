@@ -0,0 +1,412 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisBackend.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Kinesis channel calls behind an interface, with trace record and replay
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "KinesisBackend.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <string.h>
+#include <algorithm>
+
+const short g_replay_exhausted = -1; // returned by commands the trace has no record of
+
+///////////////////////////////////////////////////////////////////////////////
+// DirectKinesisBackend
+///////////////////////////////////////////////////////////////////////////////
+
+DirectKinesisBackend::DirectKinesisBackend(const std::string& serial, short channel) :
+   serial_(serial),
+   channel_(channel)
+{
+}
+
+int DirectKinesisBackend::MessageQueueSize() {return SBC_MessageQueueSize(serial_.c_str(), channel_);}
+bool DirectKinesisBackend::GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData) {return SBC_GetNextMessage(serial_.c_str(), channel_, messageType, messageId, messageData);}
+short DirectKinesisBackend::ClearMessageQueue() {return SBC_ClearMessageQueue(serial_.c_str(), channel_);}
+short DirectKinesisBackend::MoveToPosition(int index) {return SBC_MoveToPosition(serial_.c_str(), channel_, index);}
+short DirectKinesisBackend::MoveAtVelocity(MOT_TravelDirection direction) {return SBC_MoveAtVelocity(serial_.c_str(), channel_, direction);}
+short DirectKinesisBackend::Home() {return SBC_Home(serial_.c_str(), channel_);}
+short DirectKinesisBackend::StopProfiled() {return SBC_StopProfiled(serial_.c_str(), channel_);}
+short DirectKinesisBackend::StopImmediate() {return SBC_StopImmediate(serial_.c_str(), channel_);}
+short DirectKinesisBackend::SetPositionCounter(long count) {return SBC_SetPositionCounter(serial_.c_str(), channel_, count);}
+short DirectKinesisBackend::SetDigitalOutputs(byte outputs) {return SBC_SetDigitalOutputs(serial_.c_str(), channel_, outputs);}
+short DirectKinesisBackend::SetTriggerSwitches(byte switches) {return SBC_SetTriggerSwitches(serial_.c_str(), channel_, switches);}
+int DirectKinesisBackend::GetPosition() {return SBC_GetPosition(serial_.c_str(), channel_);}
+short DirectKinesisBackend::RequestPosition() {return SBC_RequestPosition(serial_.c_str(), channel_);}
+long DirectKinesisBackend::GetEncoderCounter() {return SBC_GetEncoderCounter(serial_.c_str(), channel_);}
+short DirectKinesisBackend::RequestEncoderCounter() {return SBC_RequestEncoderCounter(serial_.c_str(), channel_);}
+DWORD DirectKinesisBackend::GetStatusBits() {return SBC_GetStatusBits(serial_.c_str(), channel_);}
+short DirectKinesisBackend::RequestStatusBits() {return SBC_RequestStatusBits(serial_.c_str(), channel_);}
+long DirectKinesisBackend::PollingDuration() {return SBC_PollingDuration(serial_.c_str(), channel_);}
+byte DirectKinesisBackend::GetTriggerSwitches() {return SBC_GetTriggerSwitches(serial_.c_str(), channel_);}
+short DirectKinesisBackend::RequestTriggerSwitches() {return SBC_RequestTriggerSwitches(serial_.c_str(), channel_);}
+short DirectKinesisBackend::RequestSettings() {return SBC_RequestSettings(serial_.c_str(), channel_);}
+short DirectKinesisBackend::GetHardwareInfoBlock(TLI_HardwareInformation* info) {return SBC_GetHardwareInfoBlock(serial_.c_str(), channel_, info);}
+short DirectKinesisBackend::RequestVelParams() {return SBC_RequestVelParams(serial_.c_str(), channel_);}
+short DirectKinesisBackend::GetVelParamsBlock(MOT_VelocityParameters* params) {return SBC_GetVelParamsBlock(serial_.c_str(), channel_, params);}
+short DirectKinesisBackend::SetVelParams(int acceleration, int maxVelocity) {return SBC_SetVelParams(serial_.c_str(), channel_, acceleration, maxVelocity);}
+short DirectKinesisBackend::RequestHomingParams() {return SBC_RequestHomingParams(serial_.c_str(), channel_);}
+short DirectKinesisBackend::GetHomingParamsBlock(MOT_HomingParameters* params) {return SBC_GetHomingParamsBlock(serial_.c_str(), channel_, params);}
+short DirectKinesisBackend::SetHomingParamsBlock(MOT_HomingParameters* params) {return SBC_SetHomingParamsBlock(serial_.c_str(), channel_, params);}
+bool DirectKinesisBackend::PersistSettings() {return SBC_PersistSettings(serial_.c_str(), channel_);}
+bool DirectKinesisBackend::LoadNamedSettings(const char* name) {return SBC_LoadNamedSettings(serial_.c_str(), channel_, name);}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisTraceRecorder
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisTraceRecorder::KinesisTraceRecorder(KinesisBackend* inner, WheelClock* clock) :
+   inner_(inner),
+   clock_(clock),
+   startMs_(0.0),
+   records_(0)
+{
+   for (int call = 0; call < TRACE_NUM_CALLS; call++)
+   {
+      sampled_[call] = false;
+      lastResult_[call] = 0;
+   }
+}
+
+KinesisTraceRecorder::~KinesisTraceRecorder()
+{
+   Close();
+   delete inner_;
+}
+
+int KinesisTraceRecorder::Open(const std::string& path, const std::string& serial, long channel)
+{
+   MMThreadGuard guard(lock_);
+   out_.open(path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+   if (!out_)
+      return DEVICE_ERR;
+   KinesisTraceHeader header;
+   memset(&header, 0, sizeof(header));
+   header.magic = g_trace_magic;
+   header.version = g_trace_version;
+   header.channel = channel;
+   strncpy(header.serial, serial.c_str(), sizeof(header.serial) - 1);
+   out_.write((const char*)&header, sizeof(header));
+   startMs_ = clock_->NowMs();
+   return out_ ? DEVICE_OK : DEVICE_ERR;
+}
+
+void KinesisTraceRecorder::Close()
+{
+   MMThreadGuard guard(lock_);
+   if (out_.is_open())
+      out_.close();
+}
+
+// Caller holds lock_
+void KinesisTraceRecorder::Write(KinesisTraceRecord& record, const void* block)
+{
+   if (!out_.is_open())
+      return;
+   record.timeMs = clock_->NowMs() - startMs_;
+   out_.write((const char*)&record, sizeof(record));
+   if (block != 0)
+      out_.write((const char*)block, record.arg);
+   records_++;
+}
+
+long KinesisTraceRecorder::Record(int call, long arg, long result)
+{
+   MMThreadGuard guard(lock_);
+   if (call >= TRACE_GET_POSITION)
+   {
+      if (sampled_[call] && lastResult_[call] == result)
+         return result;
+      sampled_[call] = true;
+      lastResult_[call] = result;
+   }
+   KinesisTraceRecord record;
+   memset(&record, 0, sizeof(record));
+   record.call = (unsigned short)call;
+   record.arg = arg;
+   record.result = result;
+   Write(record);
+   return result;
+}
+
+short KinesisTraceRecorder::RecordBlock(int call, short result, const void* block, long size)
+{
+   MMThreadGuard guard(lock_);
+   KinesisTraceRecord record;
+   memset(&record, 0, sizeof(record));
+   record.call = (unsigned short)call;
+   record.arg = size;
+   record.result = result;
+   Write(record, block);
+   return result;
+}
+
+// the queue size is derived from the message times on replay
+int KinesisTraceRecorder::MessageQueueSize() {return inner_->MessageQueueSize();}
+
+bool KinesisTraceRecorder::GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData)
+{
+   bool ret = inner_->GetNextMessage(messageType, messageId, messageData);
+   if (!ret)
+      return ret;
+   MMThreadGuard guard(lock_);
+   KinesisTraceRecord record;
+   memset(&record, 0, sizeof(record));
+   record.call = TRACE_MESSAGE;
+   record.messageType = *messageType;
+   record.messageId = *messageId;
+   record.messageData = *messageData;
+   record.result = 1;
+   Write(record);
+   return ret;
+}
+
+short KinesisTraceRecorder::ClearMessageQueue() {return (short)Record(TRACE_CLEAR_MESSAGES, 0, inner_->ClearMessageQueue());}
+short KinesisTraceRecorder::MoveToPosition(int index) {return (short)Record(TRACE_MOVE_TO_POSITION, index, inner_->MoveToPosition(index));}
+short KinesisTraceRecorder::MoveAtVelocity(MOT_TravelDirection direction) {return (short)Record(TRACE_MOVE_AT_VELOCITY, (long)direction, inner_->MoveAtVelocity(direction));}
+short KinesisTraceRecorder::Home() {return (short)Record(TRACE_HOME, 0, inner_->Home());}
+short KinesisTraceRecorder::StopProfiled() {return (short)Record(TRACE_STOP_PROFILED, 0, inner_->StopProfiled());}
+short KinesisTraceRecorder::StopImmediate() {return (short)Record(TRACE_STOP_IMMEDIATE, 0, inner_->StopImmediate());}
+short KinesisTraceRecorder::SetPositionCounter(long count) {return (short)Record(TRACE_SET_POSITION_COUNTER, count, inner_->SetPositionCounter(count));}
+short KinesisTraceRecorder::SetDigitalOutputs(byte outputs) {return (short)Record(TRACE_SET_DIGITAL_OUTPUTS, outputs, inner_->SetDigitalOutputs(outputs));}
+short KinesisTraceRecorder::SetTriggerSwitches(byte switches) {return (short)Record(TRACE_SET_TRIGGER_SWITCHES, switches, inner_->SetTriggerSwitches(switches));}
+int KinesisTraceRecorder::GetPosition() {return (int)Record(TRACE_GET_POSITION, 0, inner_->GetPosition());}
+short KinesisTraceRecorder::RequestPosition() {return (short)Record(TRACE_REQUEST_POSITION, 0, inner_->RequestPosition());}
+long KinesisTraceRecorder::GetEncoderCounter() {return Record(TRACE_GET_ENCODER, 0, inner_->GetEncoderCounter());}
+short KinesisTraceRecorder::RequestEncoderCounter() {return (short)Record(TRACE_REQUEST_ENCODER, 0, inner_->RequestEncoderCounter());}
+DWORD KinesisTraceRecorder::GetStatusBits() {return (DWORD)Record(TRACE_GET_STATUS_BITS, 0, (long)inner_->GetStatusBits());}
+short KinesisTraceRecorder::RequestStatusBits() {return (short)Record(TRACE_REQUEST_STATUS_BITS, 0, inner_->RequestStatusBits());}
+long KinesisTraceRecorder::PollingDuration() {return Record(TRACE_POLLING_DURATION, 0, inner_->PollingDuration());}
+byte KinesisTraceRecorder::GetTriggerSwitches() {return (byte)Record(TRACE_GET_TRIGGER_SWITCHES, 0, inner_->GetTriggerSwitches());}
+short KinesisTraceRecorder::RequestTriggerSwitches() {return (short)Record(TRACE_REQUEST_TRIGGER_SWITCHES, 0, inner_->RequestTriggerSwitches());}
+short KinesisTraceRecorder::RequestSettings() {return (short)Record(TRACE_REQUEST_SETTINGS, 0, inner_->RequestSettings());}
+short KinesisTraceRecorder::GetHardwareInfoBlock(TLI_HardwareInformation* info) {return RecordBlock(TRACE_GET_HARDWARE_INFO, inner_->GetHardwareInfoBlock(info), info, sizeof(*info));}
+short KinesisTraceRecorder::RequestVelParams() {return (short)Record(TRACE_REQUEST_VEL_PARAMS, 0, inner_->RequestVelParams());}
+short KinesisTraceRecorder::GetVelParamsBlock(MOT_VelocityParameters* params) {return RecordBlock(TRACE_GET_VEL_PARAMS, inner_->GetVelParamsBlock(params), params, sizeof(*params));}
+// the acceleration only ever comes back from the velocity block, the speed is what gets checked
+short KinesisTraceRecorder::SetVelParams(int acceleration, int maxVelocity) {return (short)Record(TRACE_SET_VEL_PARAMS, maxVelocity, inner_->SetVelParams(acceleration, maxVelocity));}
+short KinesisTraceRecorder::RequestHomingParams() {return (short)Record(TRACE_REQUEST_HOMING_PARAMS, 0, inner_->RequestHomingParams());}
+short KinesisTraceRecorder::GetHomingParamsBlock(MOT_HomingParameters* params) {return RecordBlock(TRACE_GET_HOMING_PARAMS, inner_->GetHomingParamsBlock(params), params, sizeof(*params));}
+short KinesisTraceRecorder::SetHomingParamsBlock(MOT_HomingParameters* params) {return (short)Record(TRACE_SET_HOMING_PARAMS, params->velocity, inner_->SetHomingParamsBlock(params));}
+bool KinesisTraceRecorder::PersistSettings() {return Record(TRACE_PERSIST_SETTINGS, 0, inner_->PersistSettings()) != 0;}
+bool KinesisTraceRecorder::LoadNamedSettings(const char* name) {return Record(TRACE_LOAD_NAMED_SETTINGS, 0, inner_->LoadNamedSettings(name)) != 0;}
+
+///////////////////////////////////////////////////////////////////////////////
+// KinesisReplayBackend
+///////////////////////////////////////////////////////////////////////////////
+
+KinesisReplayBackend::KinesisReplayBackend(bool fast, WheelClock* clock) :
+   clock_(clock),
+   fast_(fast),
+   startMs_(0.0),
+   nowMs_(0.0),
+   replayed_(0),
+   divergences_(0)
+{
+   for (int call = 0; call < TRACE_NUM_CALLS; call++)
+      next_[call] = 0;
+}
+
+int KinesisReplayBackend::Open(const std::string& path, std::string& serial, long& channel)
+{
+   MMThreadGuard guard(lock_);
+   std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+   if (!in)
+      return DEVICE_ERR;
+   KinesisTraceHeader header;
+   in.read((char*)&header, sizeof(header));
+   if (!in || header.magic != g_trace_magic || header.version != g_trace_version)
+      return DEVICE_ERR;
+   header.serial[sizeof(header.serial) - 1] = '\0';
+   serial = header.serial;
+   channel = header.channel;
+
+   KinesisTraceRecord record;
+   while (in.read((char*)&record, sizeof(record)))
+   {
+      if (record.call >= TRACE_NUM_CALLS)
+         continue;
+      if (record.call >= TRACE_GET_HARDWARE_INFO && record.call <= TRACE_GET_HOMING_PARAMS)
+      {
+         if (record.arg < 0)
+            return DEVICE_ERR;
+         std::string block((size_t)record.arg, '\0');
+         if (!in.read(&block[0], record.arg))
+            return DEVICE_ERR;
+         blocks_[record.call].push_back(block);
+      }
+      records_[record.call].push_back(record);
+   }
+   startMs_ = clock_->NowMs();
+   nowMs_ = 0.0;
+   return DEVICE_OK;
+}
+
+// Caller holds lock_
+void KinesisReplayBackend::Advance()
+{
+   if (fast_)
+      return;
+   double elapsed = clock_->NowMs() - startMs_;
+   if (elapsed > nowMs_)
+      nowMs_ = elapsed;
+}
+
+// Caller holds lock_
+size_t KinesisReplayBackend::ReadyMessages()
+{
+   const std::vector<KinesisTraceRecord>& messages = records_[TRACE_MESSAGE];
+   size_t ready = 0;
+   for (size_t i = next_[TRACE_MESSAGE]; i < messages.size() && messages[i].timeMs <= nowMs_; i++)
+      ready++;
+   return ready;
+}
+
+long KinesisReplayBackend::Command(int call, long arg)
+{
+   KinesisTraceRecord record;
+   {
+      MMThreadGuard guard(lock_);
+      std::vector<KinesisTraceRecord>& records = records_[call];
+      if (next_[call] >= records.size())
+      {
+         divergences_++;
+         return g_replay_exhausted;
+      }
+      record = records[next_[call]++];
+      if (record.arg != arg)
+         divergences_++;
+      replayed_++;
+      if (fast_ && record.timeMs > nowMs_)
+         nowMs_ = record.timeMs;
+   }
+   // at original speed the command returns when it did in the trace
+   if (!fast_)
+   {
+      double wait = record.timeMs - (clock_->NowMs() - startMs_);
+      if (wait > 0.0)
+         clock_->SleepMs(wait);
+   }
+   return record.result;
+}
+
+// A block read replays like a command, then hands back the recorded block
+short KinesisReplayBackend::Block(int call, void* block, long size)
+{
+   size_t index;
+   {
+      MMThreadGuard guard(lock_);
+      index = next_[call];
+   }
+   short ret = (short)Command(call, size);
+   if (ret == g_replay_exhausted)
+      return ret;
+   MMThreadGuard guard(lock_);
+   const std::string& recorded = blocks_[call][index];
+   memset(block, 0, size);
+   memcpy(block, recorded.data(), (std::min)((size_t)size, recorded.size()));
+   return ret;
+}
+
+long KinesisReplayBackend::Sample(int call)
+{
+   MMThreadGuard guard(lock_);
+   Advance();
+   std::vector<KinesisTraceRecord>& records = records_[call];
+   if (records.empty())
+   {
+      divergences_++;
+      return 0;
+   }
+   size_t before = next_[call];
+   while (next_[call] < records.size() && records[next_[call]].timeMs <= nowMs_)
+      next_[call]++;
+   // in fast mode a poll that finds nothing new waits for the next sample,
+   // otherwise one recorded after the last command or message is never seen
+   if (fast_ && next_[call] == before && next_[call] < records.size())
+      nowMs_ = records[next_[call]++].timeMs;
+   replayed_++;
+   // before the first sample the first one is the best guess
+   return next_[call] == 0 ? records[0].result : records[next_[call] - 1].result;
+}
+
+int KinesisReplayBackend::MessageQueueSize()
+{
+   MMThreadGuard guard(lock_);
+   Advance();
+   size_t ready = ReadyMessages();
+   // in fast mode waiting for a message costs nothing
+   if (ready == 0 && fast_ && next_[TRACE_MESSAGE] < records_[TRACE_MESSAGE].size())
+   {
+      nowMs_ = records_[TRACE_MESSAGE][next_[TRACE_MESSAGE]].timeMs;
+      ready = ReadyMessages();
+   }
+   return (int)ready;
+}
+
+bool KinesisReplayBackend::GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData)
+{
+   MMThreadGuard guard(lock_);
+   Advance();
+   if (ReadyMessages() == 0)
+      return false;
+   const KinesisTraceRecord& record = records_[TRACE_MESSAGE][next_[TRACE_MESSAGE]++];
+   *messageType = record.messageType;
+   *messageId = record.messageId;
+   *messageData = record.messageData;
+   replayed_++;
+   return true;
+}
+
+short KinesisReplayBackend::ClearMessageQueue()
+{
+   short ret = (short)Command(TRACE_CLEAR_MESSAGES, 0);
+   MMThreadGuard guard(lock_);
+   Advance();
+   next_[TRACE_MESSAGE] += ReadyMessages();
+   return ret;
+}
+
+bool KinesisReplayBackend::NextMoveTarget(long& target)
+{
+   MMThreadGuard guard(lock_);
+   const std::vector<KinesisTraceRecord>& moves = records_[TRACE_MOVE_TO_POSITION];
+   if (next_[TRACE_MOVE_TO_POSITION] >= moves.size())
+      return false;
+   target = moves[next_[TRACE_MOVE_TO_POSITION]].arg;
+   return true;
+}
+
+short KinesisReplayBackend::MoveToPosition(int index) {return (short)Command(TRACE_MOVE_TO_POSITION, index);}
+short KinesisReplayBackend::MoveAtVelocity(MOT_TravelDirection direction) {return (short)Command(TRACE_MOVE_AT_VELOCITY, (long)direction);}
+short KinesisReplayBackend::Home() {return (short)Command(TRACE_HOME, 0);}
+short KinesisReplayBackend::StopProfiled() {return (short)Command(TRACE_STOP_PROFILED, 0);}
+short KinesisReplayBackend::StopImmediate() {return (short)Command(TRACE_STOP_IMMEDIATE, 0);}
+short KinesisReplayBackend::SetPositionCounter(long count) {return (short)Command(TRACE_SET_POSITION_COUNTER, count);}
+short KinesisReplayBackend::SetDigitalOutputs(byte outputs) {return (short)Command(TRACE_SET_DIGITAL_OUTPUTS, outputs);}
+short KinesisReplayBackend::SetTriggerSwitches(byte switches) {return (short)Command(TRACE_SET_TRIGGER_SWITCHES, switches);}
+int KinesisReplayBackend::GetPosition() {return (int)Sample(TRACE_GET_POSITION);}
+short KinesisReplayBackend::RequestPosition() {return (short)Sample(TRACE_REQUEST_POSITION);}
+long KinesisReplayBackend::GetEncoderCounter() {return Sample(TRACE_GET_ENCODER);}
+short KinesisReplayBackend::RequestEncoderCounter() {return (short)Sample(TRACE_REQUEST_ENCODER);}
+DWORD KinesisReplayBackend::GetStatusBits() {return (DWORD)Sample(TRACE_GET_STATUS_BITS);}
+short KinesisReplayBackend::RequestStatusBits() {return (short)Sample(TRACE_REQUEST_STATUS_BITS);}
+long KinesisReplayBackend::PollingDuration() {return Sample(TRACE_POLLING_DURATION);}
+byte KinesisReplayBackend::GetTriggerSwitches() {return (byte)Sample(TRACE_GET_TRIGGER_SWITCHES);}
+short KinesisReplayBackend::RequestTriggerSwitches() {return (short)Sample(TRACE_REQUEST_TRIGGER_SWITCHES);}
+short KinesisReplayBackend::RequestSettings() {return (short)Command(TRACE_REQUEST_SETTINGS, 0);}
+short KinesisReplayBackend::GetHardwareInfoBlock(TLI_HardwareInformation* info) {return Block(TRACE_GET_HARDWARE_INFO, info, sizeof(*info));}
+short KinesisReplayBackend::RequestVelParams() {return (short)Command(TRACE_REQUEST_VEL_PARAMS, 0);}
+short KinesisReplayBackend::GetVelParamsBlock(MOT_VelocityParameters* params) {return Block(TRACE_GET_VEL_PARAMS, params, sizeof(*params));}
+short KinesisReplayBackend::SetVelParams(int acceleration, int maxVelocity) {return (short)Command(TRACE_SET_VEL_PARAMS, maxVelocity);}
+short KinesisReplayBackend::RequestHomingParams() {return (short)Command(TRACE_REQUEST_HOMING_PARAMS, 0);}
+short KinesisReplayBackend::GetHomingParamsBlock(MOT_HomingParameters* params) {return Block(TRACE_GET_HOMING_PARAMS, params, sizeof(*params));}
+short KinesisReplayBackend::SetHomingParamsBlock(MOT_HomingParameters* params) {return (short)Command(TRACE_SET_HOMING_PARAMS, params->velocity);}
+bool KinesisReplayBackend::PersistSettings() {return Command(TRACE_PERSIST_SETTINGS, 0) > 0;}
+bool KinesisReplayBackend::LoadNamedSettings(const char* name) {return Command(TRACE_LOAD_NAMED_SETTINGS, 0) > 0;}
@@ -0,0 +1,302 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisBackend.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Kinesis channel calls behind an interface, with trace record and replay
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "Thorlabs.MotionControl.Benchtop.StepperMotor.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include "WheelClock.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+// The calls the wheel makes on its open channel, including the settings
+// traffic of KinesisSettingsCache. Opening and enumeration stay with
+// KinesisDeviceManager.
+class KinesisBackend
+{
+public:
+   virtual ~KinesisBackend() {}
+
+   virtual int MessageQueueSize() = 0;
+   virtual bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData) = 0;
+   virtual short ClearMessageQueue() = 0;
+   virtual short MoveToPosition(int index) = 0;
+   virtual short MoveAtVelocity(MOT_TravelDirection direction) = 0;
+   virtual short Home() = 0;
+   virtual short StopProfiled() = 0;
+   virtual short StopImmediate() = 0;
+   virtual short SetPositionCounter(long count) = 0;
+   virtual short SetDigitalOutputs(byte outputs) = 0;
+   virtual short SetTriggerSwitches(byte switches) = 0;
+   virtual int GetPosition() = 0;
+   virtual short RequestPosition() = 0;
+   virtual long GetEncoderCounter() = 0;
+   virtual short RequestEncoderCounter() = 0;
+   virtual DWORD GetStatusBits() = 0;
+   virtual short RequestStatusBits() = 0;
+   virtual long PollingDuration() = 0;
+   virtual byte GetTriggerSwitches() = 0;
+   virtual short RequestTriggerSwitches() = 0;
+   virtual short RequestSettings() = 0;
+   virtual short GetHardwareInfoBlock(TLI_HardwareInformation* info) = 0;
+   virtual short RequestVelParams() = 0;
+   virtual short GetVelParamsBlock(MOT_VelocityParameters* params) = 0;
+   virtual short SetVelParams(int acceleration, int maxVelocity) = 0;
+   virtual short RequestHomingParams() = 0;
+   virtual short GetHomingParamsBlock(MOT_HomingParameters* params) = 0;
+   virtual short SetHomingParamsBlock(MOT_HomingParameters* params) = 0;
+   virtual bool PersistSettings() = 0;
+   virtual bool LoadNamedSettings(const char* name) = 0;
+
+   // trace bookkeeping, zero for backends that neither record nor replay
+   virtual long TraceRecords() const {return 0;}
+   virtual long TraceDivergences() const {return 0;}
+};
+
+// Straight to the Kinesis DLL
+class DirectKinesisBackend : public KinesisBackend
+{
+public:
+   DirectKinesisBackend(const std::string& serial, short channel);
+
+   int MessageQueueSize();
+   bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData);
+   short ClearMessageQueue();
+   short MoveToPosition(int index);
+   short MoveAtVelocity(MOT_TravelDirection direction);
+   short Home();
+   short StopProfiled();
+   short StopImmediate();
+   short SetPositionCounter(long count);
+   short SetDigitalOutputs(byte outputs);
+   short SetTriggerSwitches(byte switches);
+   int GetPosition();
+   short RequestPosition();
+   long GetEncoderCounter();
+   short RequestEncoderCounter();
+   DWORD GetStatusBits();
+   short RequestStatusBits();
+   long PollingDuration();
+   byte GetTriggerSwitches();
+   short RequestTriggerSwitches();
+   short RequestSettings();
+   short GetHardwareInfoBlock(TLI_HardwareInformation* info);
+   short RequestVelParams();
+   short GetVelParamsBlock(MOT_VelocityParameters* params);
+   short SetVelParams(int acceleration, int maxVelocity);
+   short RequestHomingParams();
+   short GetHomingParamsBlock(MOT_HomingParameters* params);
+   short SetHomingParamsBlock(MOT_HomingParameters* params);
+   bool PersistSettings();
+   bool LoadNamedSettings(const char* name);
+
+private:
+   std::string serial_;
+   short channel_;
+};
+
+// Trace record kinds. Messages and commands are kept one record per call;
+// queries and requests are state samples and only recorded when their result
+// changes, so the controller polling in Busy() does not swamp the file.
+// Settings traffic counts as commands; the block reads carry the block.
+enum KinesisTraceCall
+{
+   TRACE_MESSAGE,
+   TRACE_CLEAR_MESSAGES,
+   TRACE_MOVE_TO_POSITION,
+   TRACE_MOVE_AT_VELOCITY,
+   TRACE_HOME,
+   TRACE_STOP_PROFILED,
+   TRACE_STOP_IMMEDIATE,
+   TRACE_SET_POSITION_COUNTER,
+   TRACE_SET_DIGITAL_OUTPUTS,
+   TRACE_SET_TRIGGER_SWITCHES,
+   TRACE_REQUEST_SETTINGS,
+   TRACE_GET_HARDWARE_INFO, // first block kind
+   TRACE_GET_VEL_PARAMS,
+   TRACE_GET_HOMING_PARAMS, // last block kind
+   TRACE_REQUEST_VEL_PARAMS,
+   TRACE_SET_VEL_PARAMS,
+   TRACE_REQUEST_HOMING_PARAMS,
+   TRACE_SET_HOMING_PARAMS,
+   TRACE_PERSIST_SETTINGS,
+   TRACE_LOAD_NAMED_SETTINGS,
+   TRACE_GET_POSITION, // first sampled kind
+   TRACE_REQUEST_POSITION,
+   TRACE_GET_ENCODER,
+   TRACE_REQUEST_ENCODER,
+   TRACE_GET_STATUS_BITS,
+   TRACE_REQUEST_STATUS_BITS,
+   TRACE_POLLING_DURATION,
+   TRACE_GET_TRIGGER_SWITCHES,
+   TRACE_REQUEST_TRIGGER_SWITCHES,
+   TRACE_NUM_CALLS
+};
+
+const unsigned long g_trace_magic = 0x52545746; // "FWTR"
+const unsigned long g_trace_version = 2;
+
+// File layout: one KinesisTraceHeader followed by KinesisTraceRecords in time
+// order. A block kind record is followed by the block itself, arg bytes long.
+#pragma pack(push, 1)
+struct KinesisTraceHeader
+{
+   unsigned long magic;
+   unsigned long version;
+   long channel;
+   char serial[16];
+};
+
+struct KinesisTraceRecord
+{
+   double timeMs;             // since the trace was opened
+   unsigned short call;       // KinesisTraceCall
+   unsigned short messageType;
+   unsigned short messageId;
+   unsigned short reserved;
+   long arg;                  // target, direction, count, output bits, velocity or block size
+   long result;               // return value of the call
+   unsigned long messageData;
+};
+#pragma pack(pop)
+
+// Passes every call to another backend, which it takes over, and appends it
+// to a trace file
+class KinesisTraceRecorder : public KinesisBackend
+{
+public:
+   KinesisTraceRecorder(KinesisBackend* inner, WheelClock* clock);
+   ~KinesisTraceRecorder();
+
+   int Open(const std::string& path, const std::string& serial, long channel);
+   void Close();
+
+   int MessageQueueSize();
+   bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData);
+   short ClearMessageQueue();
+   short MoveToPosition(int index);
+   short MoveAtVelocity(MOT_TravelDirection direction);
+   short Home();
+   short StopProfiled();
+   short StopImmediate();
+   short SetPositionCounter(long count);
+   short SetDigitalOutputs(byte outputs);
+   short SetTriggerSwitches(byte switches);
+   int GetPosition();
+   short RequestPosition();
+   long GetEncoderCounter();
+   short RequestEncoderCounter();
+   DWORD GetStatusBits();
+   short RequestStatusBits();
+   long PollingDuration();
+   byte GetTriggerSwitches();
+   short RequestTriggerSwitches();
+   short RequestSettings();
+   short GetHardwareInfoBlock(TLI_HardwareInformation* info);
+   short RequestVelParams();
+   short GetVelParamsBlock(MOT_VelocityParameters* params);
+   short SetVelParams(int acceleration, int maxVelocity);
+   short RequestHomingParams();
+   short GetHomingParamsBlock(MOT_HomingParameters* params);
+   short SetHomingParamsBlock(MOT_HomingParameters* params);
+   bool PersistSettings();
+   bool LoadNamedSettings(const char* name);
+
+   long TraceRecords() const {return records_;}
+
+private:
+   long Record(int call, long arg, long result);
+   short RecordBlock(int call, short result, const void* block, long size);
+   void Write(KinesisTraceRecord& record, const void* block = 0);
+
+   KinesisBackend* inner_;
+   WheelClock* clock_;
+   MMThreadLock lock_;
+   std::ofstream out_;
+   double startMs_;
+   long records_;
+   bool sampled_[TRACE_NUM_CALLS];
+   long lastResult_[TRACE_NUM_CALLS];
+};
+
+// Plays a trace back in place of the controller. Commands return their
+// recorded results in order, messages become available at their recorded
+// time, and state queries answer with the latest sample at the replay time.
+// Settings block reads hand back the block that was recorded.
+// Replay time follows the wheel's clock, or in fast mode jumps straight to the
+// next command, message or polled sample so nothing waits on the controller.
+class KinesisReplayBackend : public KinesisBackend
+{
+public:
+   KinesisReplayBackend(bool fast, WheelClock* clock);
+
+   int Open(const std::string& path, std::string& serial, long& channel);
+
+   int MessageQueueSize();
+   bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData);
+   short ClearMessageQueue();
+   short MoveToPosition(int index);
+   short MoveAtVelocity(MOT_TravelDirection direction);
+   short Home();
+   short StopProfiled();
+   short StopImmediate();
+   short SetPositionCounter(long count);
+   short SetDigitalOutputs(byte outputs);
+   short SetTriggerSwitches(byte switches);
+   int GetPosition();
+   short RequestPosition();
+   long GetEncoderCounter();
+   short RequestEncoderCounter();
+   DWORD GetStatusBits();
+   short RequestStatusBits();
+   long PollingDuration();
+   byte GetTriggerSwitches();
+   short RequestTriggerSwitches();
+   short RequestSettings();
+   short GetHardwareInfoBlock(TLI_HardwareInformation* info);
+   short RequestVelParams();
+   short GetVelParamsBlock(MOT_VelocityParameters* params);
+   short SetVelParams(int acceleration, int maxVelocity);
+   short RequestHomingParams();
+   short GetHomingParamsBlock(MOT_HomingParameters* params);
+   short SetHomingParamsBlock(MOT_HomingParameters* params);
+   bool PersistSettings();
+   bool LoadNamedSettings(const char* name);
+
+   long TraceRecords() const {return replayed_;}
+   long TraceDivergences() const {return divergences_;}
+   // target of the next move command still to be replayed, false once there is none
+   bool NextMoveTarget(long& target);
+
+private:
+   void Advance();
+   size_t ReadyMessages();
+   long Command(int call, long arg);
+   short Block(int call, void* block, long size);
+   long Sample(int call);
+
+   WheelClock* clock_;
+   MMThreadLock lock_;
+   bool fast_;
+   double startMs_;
+   double nowMs_;
+   std::vector<KinesisTraceRecord> records_[TRACE_NUM_CALLS];
+   std::vector<std::string> blocks_[TRACE_NUM_CALLS]; // alongside records_ for the block kinds
+   size_t next_[TRACE_NUM_CALLS];
+   long replayed_;
+   long divergences_;
+};
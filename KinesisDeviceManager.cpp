@@ -0,0 +1,406 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisDeviceManager.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Process-wide owner of Kinesis benchtop controller connections
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "Thorlabs.MotionControl.Benchtop.StepperMotor.h"
+#include "KinesisDeviceManager.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+const int g_benchtop_stepper_type = 40; // Kinesis type ID of the benchtop stepper controllers
+const int g_open_settle_ms = 3000; // the controller needs this long after enabling before it accepts a move
+const int g_reap_interval_ms = 100;
+
+KinesisChannel::KinesisChannel(const std::string& serial, short channel, ChannelState* state) :
+   serial_(serial),
+   channel_(channel),
+   state_(state)
+{
+}
+
+KinesisDeviceManager& KinesisDeviceManager::Instance()
+{
+   static KinesisDeviceManager instance;
+   return instance;
+}
+
+KinesisDeviceManager::KinesisDeviceManager() :
+   discovered_(false),
+   lastEnumerateMs_(0.0),
+   reaper_(0),
+   reaperActive_(false),
+   users_(0)
+{
+   reaper_ = new KeepAliveThread(this);
+}
+
+KinesisDeviceManager::~KinesisDeviceManager()
+{
+   // This runs at DLL unload, possibly under the loader lock, so it neither
+   // calls into Kinesis nor waits on a thread. The last RemoveUser has closed
+   // every channel and joined the reaper; anything still here belongs to a
+   // device that was never deleted and is only freed.
+   for (std::map<std::string, ControllerEntry>::iterator it = controllers_.begin(); it != controllers_.end(); ++it)
+   {
+      for (std::map<short, ChannelState*>::iterator ch = it->second.channels.begin(); ch != it->second.channels.end(); ++ch)
+         delete ch->second;
+   }
+   if (!reaper_->IsRunning())
+      delete reaper_;
+}
+
+// Placeholder entries go in under lock_ and are held through the channel's
+// reference count, so neither can go away while it is being opened. Opening,
+// enabling and the settle wait then happen outside lock_, under the entry's
+// own lock, so other controllers and channels are not held up meanwhile.
+int KinesisDeviceManager::Acquire(const std::string& serial, short channel, int polltime, KinesisChannel*& handle)
+{
+   handle = 0;
+   ControllerEntry* controller;
+   ChannelState* state;
+   {
+      MMThreadGuard guard(lock_);
+      controller = &controllers_[serial];
+      std::map<short, ChannelState*>::iterator ch = controller->channels.find(channel);
+      if (ch == controller->channels.end())
+      {
+         state = new ChannelState();
+         state->refCount = 0;
+         state->open = false;
+         state->polltime = polltime;
+         state->homed = false;
+         state->speed = 0;
+         state->position = 0;
+         state->idle = false;
+         state->idleSince = 0;
+         state->keepAliveMs = 0;
+         controller->channels[channel] = state;
+      }
+      else
+      {
+         state = ch->second;
+         if (state->idle)
+            printf("Reusing kept-alive channel %d of %s\n", channel, serial.c_str());
+         state->idle = false;
+         if (state->polltime != polltime)
+            printf("Channel %d of %s already polling at %d ms\n", channel, serial.c_str(), state->polltime);
+      }
+      state->refCount++;
+   }
+
+   int ret = OpenChannel(serial, channel, *controller, *state);
+   if (ret != DEVICE_OK)
+   {
+      // a failed open leaves nothing behind unless someone else is waiting on it
+      MMThreadGuard guard(lock_);
+      if (--state->refCount == 0)
+         CloseChannel(serial, channel);
+      return ret;
+   }
+   handle = new KinesisChannel(serial, channel, state);
+   return DEVICE_OK;
+}
+
+// The first user of a controller opens it; the first user of a channel checks
+// it exists, starts polling and enables the motor. Later users wait on the
+// entry's lock until that is done. Called without lock_.
+int KinesisDeviceManager::OpenChannel(const std::string& serial, short channel, ControllerEntry& controller, ChannelState& state)
+{
+   {
+      MMThreadGuard open(controller.openLock);
+      if (!controller.open)
+      {
+         int ret = OpenController(serial);
+         if (ret != DEVICE_OK)
+            return ret;
+         MMThreadGuard guard(lock_);
+         controller.open = true;
+      }
+   }
+
+   MMThreadGuard open(state.openLock);
+   if (state.open)
+      return DEVICE_OK;
+   // an invalid channel is turned away before anything is started on it
+   if (!SBC_IsChannelValid(serial.c_str(), channel))
+   {
+      printf("Device %s has %d channels, channel %d requested\n", serial.c_str(), SBC_GetNumChannels(serial.c_str()), channel);
+      return DEVICE_INVALID_INPUT_PARAM;
+   }
+   SBC_StartPolling(serial.c_str(), channel, state.polltime);
+   SBC_EnableChannel(serial.c_str(), channel);
+   Sleep(g_open_settle_ms);
+   MMThreadGuard guard(lock_);
+   state.open = true;
+   return DEVICE_OK;
+}
+
+void KinesisDeviceManager::Release(KinesisChannel* handle, int keepAliveMs)
+{
+   if (handle == 0)
+      return;
+   bool startReaper = false;
+   {
+      MMThreadGuard guard(lock_);
+      std::map<std::string, ControllerEntry>::iterator it = controllers_.find(handle->Serial());
+      if (it != controllers_.end())
+      {
+         std::map<short, ChannelState*>::iterator ch = it->second.channels.find(handle->Channel());
+         if (ch != it->second.channels.end() && --ch->second->refCount == 0)
+         {
+            if (keepAliveMs > 0)
+            {
+               ch->second->idle = true;
+               ch->second->idleSince = GetTickCount();
+               ch->second->keepAliveMs = keepAliveMs;
+               startReaper = !reaperActive_;
+               reaperActive_ = true;
+            }
+            else
+            {
+               CloseChannel(handle->Serial(), handle->Channel());
+            }
+         }
+      }
+   }
+   if (startReaper)
+      reaper_->Start();
+   delete handle;
+}
+
+void KinesisDeviceManager::AddUser()
+{
+   MMThreadGuard guard(lock_);
+   users_++;
+}
+
+void KinesisDeviceManager::RemoveUser()
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (--users_ > 0)
+         return;
+      // no device is left to come back for a kept-alive channel
+      CloseIdle(true);
+   }
+   // finds nothing idle on its next pass and exits
+   reaper_->Stop();
+   MMThreadGuard guard(lock_);
+   reaperActive_ = false;
+}
+
+int KinesisDeviceManager::ReapIdle()
+{
+   MMThreadGuard guard(lock_);
+   int idle = CloseIdle(false);
+   if (idle == 0)
+      reaperActive_ = false;
+   return idle;
+}
+
+// Closes idle channels whose keep-alive has run out, or every idle channel,
+// and returns how many are still idle. Caller holds lock_.
+int KinesisDeviceManager::CloseIdle(bool all)
+{
+   int idle = 0;
+   unsigned long now = GetTickCount();
+   // collect first, closing erases from the maps being walked
+   std::vector<std::pair<std::string, short> > expired;
+   for (std::map<std::string, ControllerEntry>::iterator it = controllers_.begin(); it != controllers_.end(); ++it)
+   {
+      for (std::map<short, ChannelState*>::iterator ch = it->second.channels.begin(); ch != it->second.channels.end(); ++ch)
+      {
+         if (!ch->second->idle)
+            continue;
+         if (all || now - ch->second->idleSince >= (unsigned long)ch->second->keepAliveMs)
+            expired.push_back(std::make_pair(it->first, ch->first));
+         else
+            idle++;
+      }
+   }
+   for (size_t i = 0; i < expired.size(); i++)
+   {
+      printf("Closing idle channel %d of %s\n", expired[i].second, expired[i].first.c_str());
+      CloseChannel(expired[i].first, expired[i].second);
+   }
+   return idle;
+}
+
+// Stops polling on a channel and closes the controller when it was the last
+// one. Entries that never finished opening are just dropped. Caller holds lock_.
+void KinesisDeviceManager::CloseChannel(const std::string& serial, short channel)
+{
+   std::map<std::string, ControllerEntry>::iterator it = controllers_.find(serial);
+   if (it == controllers_.end())
+      return;
+   std::map<short, ChannelState*>::iterator ch = it->second.channels.find(channel);
+   if (ch != it->second.channels.end())
+   {
+      if (ch->second->open)
+         SBC_StopPolling(serial.c_str(), channel);
+      delete ch->second;
+      it->second.channels.erase(ch);
+   }
+   if (it->second.channels.empty())
+   {
+      if (it->second.open)
+         SBC_Close(serial.c_str());
+      controllers_.erase(it);
+   }
+}
+
+bool KinesisDeviceManager::GetDiscoveryRecord(const std::string& serial, DiscoveryRecord& record)
+{
+   MMThreadGuard guard(lock_);
+   std::map<std::string, DiscoveryRecord>::iterator it = discoveryIndex_.find(serial);
+   if (it == discoveryIndex_.end())
+      return false;
+   record = it->second;
+   return true;
+}
+
+// Builds the Kinesis device list and remembers the benchtop stepper serials.
+// Caller holds discoverLock_.
+int KinesisDeviceManager::Discover()
+{
+   ULONGLONG start = GetTickCount64();
+   int built = TLI_BuildDeviceList();
+   lastEnumerateMs_ = (double)(GetTickCount64() - start);
+   printf("Device enumeration took %.0f ms\n", lastEnumerateMs_);
+   if (built != 0)
+      return DEVICE_NOT_CONNECTED;
+
+   char serialNos[100];
+   TLI_GetDeviceListByTypeExt(serialNos, 100, g_benchtop_stepper_type);
+   char *searchContext = nullptr;
+   // split devices into tokens by comma
+   char *p = strtok_s(serialNos, ",", &searchContext);
+   while (p != nullptr)
+   {
+      TLI_DeviceInfo deviceInfo;
+      TLI_GetDeviceInfo(p, &deviceInfo);
+      char serialNo[9];
+      strncpy_s(serialNo, deviceInfo.serialNo, 8);
+      serialNo[8] = '\0';
+      printf("Found device %s\r\n", serialNo);
+      {
+         MMThreadGuard guard(lock_);
+         serials_.insert(serialNo);
+      }
+      p = strtok_s(nullptr, ",", &searchContext);
+   }
+   MMThreadGuard guard(lock_);
+   discovered_ = true;
+   return DEVICE_OK;
+}
+
+bool KinesisDeviceManager::IsKnown(const std::string& serial)
+{
+   MMThreadGuard guard(lock_);
+   return discovered_ && serials_.find(serial) != serials_.end();
+}
+
+// Serial numbers are fixed, so the configured serial is tried directly and the
+// (slow) device list is only built when that open fails. Called without lock_,
+// under the controller's open lock.
+int KinesisDeviceManager::OpenController(const std::string& serial)
+{
+   ULONGLONG start = GetTickCount64();
+   DiscoveryRecord record;
+   record.enumerated = false;
+   record.enumerateMs = 0.0;
+
+   if (SBC_Open(serial.c_str()) != 0)
+   {
+      {
+         // enumerate once per process, and again only if the serial is new since then
+         MMThreadGuard discover(discoverLock_);
+         if (!IsKnown(serial))
+         {
+            int ret = Discover();
+            if (ret != DEVICE_OK)
+               return ret;
+            record.enumerated = true;
+            record.enumerateMs = lastEnumerateMs_;
+         }
+      }
+      if (!IsKnown(serial))
+      {
+         printf("Device %s not found\n", serial.c_str());
+         return DEVICE_NOT_CONNECTED;
+      }
+      if (SBC_Open(serial.c_str()) != 0)
+      {
+         printf("Device %s failed to open\n", serial.c_str());
+         return DEVICE_NOT_CONNECTED;
+      }
+   }
+
+   record.openMs = (double)(GetTickCount64() - start);
+   if (record.enumerated)
+      printf("Opened %s after enumeration in %.0f ms\n", serial.c_str(), record.openMs);
+   else
+      printf("Opened %s directly in %.0f ms\n", serial.c_str(), record.openMs);
+   MMThreadGuard guard(lock_);
+   serials_.insert(serial);
+   discoveryIndex_[serial] = record;
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// KeepAliveThread
+///////////////////////////////////////////////////////////////////////////////
+
+KeepAliveThread::KeepAliveThread(KinesisDeviceManager* manager) :
+   manager_(manager),
+   stop_(true),
+   running_(false),
+   exited_(false)
+{
+}
+
+// Only called once the previous run has decided to exit, so the join is short
+void KeepAliveThread::Start()
+{
+   if (running_)
+      wait();
+   stop_ = false;
+   exited_ = false;
+   running_ = true;
+   activate();
+}
+
+// Never called at DLL unload, so the join is safe
+void KeepAliveThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int KeepAliveThread::svc()
+{
+   while (!stop_)
+   {
+      Sleep(g_reap_interval_ms);
+      if (!stop_ && manager_->ReapIdle() == 0)
+         break;
+   }
+   exited_ = true;
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisDeviceManager.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Process-wide owner of Kinesis benchtop controller connections
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "../../MMDevice/DeviceThreads.h"
+#include "KinesisSettingsCache.h"
+
+#include <string>
+#include <map>
+#include <set>
+
+// Shared state of one open controller channel. Every device instance using the
+// channel holds a KinesisChannel handle pointing at the same ChannelState.
+struct ChannelState
+{
+   int refCount;
+   // set under lock_ once polling has started and the motor is enabled; the
+   // first user opens the channel under openLock, the others wait there
+   bool open;
+   MMThreadLock openLock;
+   int polltime;
+   // held around a command and the wait for its completion message, so two
+   // users of a channel cannot consume each other's messages
+   MMThreadLock ioLock;
+   // settings snapshot, taken by the first wheel through its backend
+   KinesisSettingsCache settings;
+
+   // what a device instance leaves behind for the next one (keep-alive)
+   bool homed;
+   long speed;
+   long position;
+
+   // set while nobody holds the channel but it is kept open
+   bool idle;
+   unsigned long idleSince;
+   int keepAliveMs;
+};
+
+// Lightweight handle handed out to device instances
+class KinesisChannel
+{
+public:
+   KinesisChannel(const std::string& serial, short channel, ChannelState* state);
+
+   const char* Serial() const {return serial_.c_str();}
+   short Channel() const {return channel_;}
+   MMThreadLock& IoLock() {return state_->ioLock;}
+   KinesisSettingsCache& Settings() {return state_->settings;}
+   ChannelState& State() {return *state_;}
+
+private:
+   std::string serial_;
+   short channel_;
+   ChannelState* state_;
+};
+
+// What discovery cost when a controller was last opened
+struct DiscoveryRecord
+{
+   bool enumerated;     // false when the direct open on the serial succeeded
+   double enumerateMs;  // time spent building the device list, 0 when skipped
+   double openMs;       // total time to get the controller open
+};
+
+class KeepAliveThread;
+
+// Runs device discovery once per process, opens each controller once and
+// starts polling once per channel, reference counting both so the controller
+// is only closed when its last user releases it. Channels released with a
+// keep-alive time stay open (and homed) until they have been idle that long,
+// or until the last device using the manager is deleted.
+class KinesisDeviceManager
+{
+public:
+   static KinesisDeviceManager& Instance();
+
+   // DEVICE_INVALID_INPUT_PARAM when the controller has no such channel
+   int Acquire(const std::string& serial, short channel, int polltime, KinesisChannel*& handle);
+   void Release(KinesisChannel* handle, int keepAliveMs = 0);
+
+   // every device that may acquire a channel registers for its lifetime; the
+   // last one to go closes the kept-alive channels and joins the reaper, so
+   // nothing is left for DLL unload
+   void AddUser();
+   void RemoveUser();
+
+   // closes idle channels whose keep-alive has run out, returns how many are still idle
+   int ReapIdle();
+
+   // how the controller with this serial was last opened, false if never
+   bool GetDiscoveryRecord(const std::string& serial, DiscoveryRecord& record);
+
+private:
+   KinesisDeviceManager();
+   ~KinesisDeviceManager();
+
+   // kept alive by its channels, placeholders included
+   struct ControllerEntry
+   {
+      ControllerEntry() : open(false) {}
+      bool open; // set under lock_ once SBC_Open has succeeded
+      MMThreadLock openLock;
+      std::map<short, ChannelState*> channels;
+   };
+
+   int Discover();
+   bool IsKnown(const std::string& serial);
+   int OpenController(const std::string& serial);
+   int OpenChannel(const std::string& serial, short channel, ControllerEntry& controller, ChannelState& state);
+   void CloseChannel(const std::string& serial, short channel);
+   int CloseIdle(bool all);
+
+   MMThreadLock lock_;
+   MMThreadLock discoverLock_; // one device enumeration at a time
+   bool discovered_;
+   double lastEnumerateMs_;
+   std::set<std::string> serials_;
+   std::map<std::string, DiscoveryRecord> discoveryIndex_;
+   std::map<std::string, ControllerEntry> controllers_;
+   KeepAliveThread* reaper_;
+   bool reaperActive_; // decided under lock_ so a release never misses a reaper on its way out
+   int users_;
+};
+
+// Closes kept-alive channels once their idle time runs out. It only runs while
+// there are idle channels and is joined when the last device goes away.
+class KeepAliveThread : public MMDeviceThreadBase
+{
+public:
+   KeepAliveThread(KinesisDeviceManager* manager);
+   int svc();
+   void Start();
+   void Stop();
+   bool IsRunning() const {return running_ && !exited_;}
+
+private:
+   KinesisDeviceManager* manager_;
+   volatile bool stop_;
+   volatile bool running_;
+   volatile bool exited_;
+};
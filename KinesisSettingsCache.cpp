@@ -0,0 +1,142 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisSettingsCache.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-memory snapshot of a Kinesis channel's settings
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "KinesisSettingsCache.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <string.h>
+
+KinesisSettingsCache::KinesisSettingsCache() :
+   waitMs_(0),
+   velValid_(false),
+   homingValid_(false),
+   loaded_(false)
+{
+   memset(&velParams_, 0, sizeof(velParams_));
+   memset(&homingParams_, 0, sizeof(homingParams_));
+   memset(&hardwareInfo_, 0, sizeof(hardwareInfo_));
+}
+
+// One settings request for the whole channel, then every block is copied out of the DLL.
+// waitMs is how long the controller needs to answer; it is also used for later refreshes.
+int KinesisSettingsCache::Load(KinesisBackend& backend, WheelClock* clock, int waitMs)
+{
+   MMThreadGuard guard(lock_);
+   waitMs_ = waitMs;
+   int ret = backend.RequestSettings();
+   if (ret != 0)
+      return ret;
+   clock->SleepMs(waitMs_);
+
+   ret = backend.GetHardwareInfoBlock(&hardwareInfo_);
+   if (ret != 0)
+      return ret;
+   velValid_ = (backend.GetVelParamsBlock(&velParams_) == 0);
+   homingValid_ = (backend.GetHomingParamsBlock(&homingParams_) == 0);
+   loaded_ = true;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::GetVelParams(KinesisBackend& backend, WheelClock* clock, int& acceleration, int& maxVelocity)
+{
+   MMThreadGuard guard(lock_);
+   if (!velValid_)
+   {
+      int ret = RefreshVelParams(backend, clock);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   acceleration = velParams_.acceleration;
+   maxVelocity = velParams_.maxVelocity;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::SetVelParams(KinesisBackend& backend, int acceleration, int maxVelocity)
+{
+   MMThreadGuard guard(lock_);
+   int ret = backend.SetVelParams(acceleration, maxVelocity);
+   if (ret != 0)
+   {
+      velValid_ = false;
+      return ret;
+   }
+   velParams_.acceleration = acceleration;
+   velParams_.maxVelocity = maxVelocity;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::GetHomingParams(KinesisBackend& backend, WheelClock* clock, MOT_HomingParameters& params)
+{
+   MMThreadGuard guard(lock_);
+   if (!homingValid_)
+   {
+      int ret = RefreshHomingParams(backend, clock);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+   params = homingParams_;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::SetHomingParams(KinesisBackend& backend, MOT_HomingParameters& params)
+{
+   MMThreadGuard guard(lock_);
+   int ret = backend.SetHomingParamsBlock(&params);
+   if (ret != 0)
+   {
+      homingValid_ = false;
+      return ret;
+   }
+   homingParams_ = params;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::Persist(KinesisBackend& backend)
+{
+   MMThreadGuard guard(lock_);
+   return backend.PersistSettings() ? DEVICE_OK : DEVICE_ERR;
+}
+
+int KinesisSettingsCache::LoadNamed(KinesisBackend& backend, WheelClock* clock, const char* name, int waitMs)
+{
+   {
+      MMThreadGuard guard(lock_);
+      if (!backend.LoadNamedSettings(name))
+         return DEVICE_ERR;
+   }
+   // the controller now holds different settings, take a fresh snapshot
+   return Load(backend, clock, waitMs);
+}
+
+int KinesisSettingsCache::RefreshVelParams(KinesisBackend& backend, WheelClock* clock)
+{
+   int ret = backend.RequestVelParams();
+   if (ret != 0)
+      return ret;
+   clock->SleepMs(waitMs_);
+   ret = backend.GetVelParamsBlock(&velParams_);
+   if (ret != 0)
+      return ret;
+   velValid_ = true;
+   return DEVICE_OK;
+}
+
+int KinesisSettingsCache::RefreshHomingParams(KinesisBackend& backend, WheelClock* clock)
+{
+   int ret = backend.RequestHomingParams();
+   if (ret != 0)
+      return ret;
+   clock->SleepMs(waitMs_);
+   ret = backend.GetHomingParamsBlock(&homingParams_);
+   if (ret != 0)
+      return ret;
+   homingValid_ = true;
+   return DEVICE_OK;
+}
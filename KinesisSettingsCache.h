@@ -0,0 +1,59 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisSettingsCache.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   In-memory snapshot of a Kinesis channel's settings
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "Thorlabs.MotionControl.Benchtop.StepperMotor.h"
+#include "../../MMDevice/DeviceThreads.h"
+#include "KinesisBackend.h"
+#include "WheelClock.h"
+
+// Reads the velocity, homing and hardware settings of a channel in one batch
+// when it is opened and answers later reads from memory. Writes go straight
+// to the controller and update the snapshot only if the controller accepted
+// them; a failed write invalidates that block so the next read fetches it again.
+// All traffic goes through the wheel's backend so traces record and replay it,
+// and waits for the controller's answer go on the wheel's clock.
+class KinesisSettingsCache
+{
+public:
+   KinesisSettingsCache();
+
+   int Load(KinesisBackend& backend, WheelClock* clock, int waitMs);
+   bool Loaded() const {return loaded_;}
+
+   int GetVelParams(KinesisBackend& backend, WheelClock* clock, int& acceleration, int& maxVelocity);
+   int SetVelParams(KinesisBackend& backend, int acceleration, int maxVelocity);
+   int GetHomingParams(KinesisBackend& backend, WheelClock* clock, MOT_HomingParameters& params);
+   int SetHomingParams(KinesisBackend& backend, MOT_HomingParameters& params);
+   const TLI_HardwareInformation& HardwareInfo() const {return hardwareInfo_;}
+
+   // store the current settings on the controller / apply a named set from the Kinesis settings file
+   int Persist(KinesisBackend& backend);
+   int LoadNamed(KinesisBackend& backend, WheelClock* clock, const char* name, int waitMs);
+
+private:
+   int RefreshVelParams(KinesisBackend& backend, WheelClock* clock);
+   int RefreshHomingParams(KinesisBackend& backend, WheelClock* clock);
+
+   MMThreadLock lock_;
+   int waitMs_;
+   MOT_VelocityParameters velParams_;
+   MOT_HomingParameters homingParams_;
+   TLI_HardwareInformation hardwareInfo_;
+   bool velValid_;
+   bool homingValid_;
+   bool loaded_;
+};
@@ -0,0 +1,313 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisSimulator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Kinesis channel with a simple motion model
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "KinesisSimulator.h"
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+// motion notifications and status bits as the controller reports them
+const WORD g_sim_msg_generic_motor = 2;
+const WORD g_sim_msg_homed = 0;
+const WORD g_sim_msg_moved = 1;
+const WORD g_sim_msg_stopped = 2;
+const DWORD g_sim_status_moving_cw = 0x00000010;
+const DWORD g_sim_status_moving_ccw = 0x00000020;
+const DWORD g_sim_status_connected = 0x00000100;
+const DWORD g_sim_status_homing = 0x00000200;
+const DWORD g_sim_status_homed = 0x00000400;
+const DWORD g_sim_status_enabled = 0x80000000;
+
+KinesisSimulatedBackend::KinesisSimulatedBackend(WheelClock* clock, double countsPerVelocityUnit, int maxVelocity, unsigned int homingVelocity, long pollMs) :
+   clock_(clock),
+   countsPerVelocityUnit_(countsPerVelocityUnit),
+   pollMs_(pollMs),
+   moving_(false),
+   continuous_(false),
+   homing_(false),
+   homed_(false),
+   startMs_(0.0),
+   startCounts_(0.0),
+   targetCounts_(0.0),
+   countsPerMs_(0.0),
+   direction_(1),
+   acceleration_(0),
+   maxVelocity_(maxVelocity),
+   triggerSwitches_(0),
+   digitalOutputs_(0)
+{
+   memset(&homingParams_, 0, sizeof(homingParams_));
+   homingParams_.direction = MOT_Reverse;
+   homingParams_.limitSwitch = MOT_ReverseLimitSwitch;
+   homingParams_.velocity = homingVelocity;
+}
+
+// Caller holds lock_
+double KinesisSimulatedBackend::PositionAt(double nowMs) const
+{
+   if (!moving_)
+      return startCounts_;
+   double travelled = (nowMs - startMs_)*countsPerMs_;
+   if (!continuous_)
+      travelled = (std::min)(travelled, fabs(targetCounts_ - startCounts_));
+   return startCounts_ + direction_*travelled;
+}
+
+// Caller holds lock_. Ends a move that has arrived by now.
+void KinesisSimulatedBackend::Update(double nowMs)
+{
+   if (!moving_ || continuous_)
+      return;
+   if ((nowMs - startMs_)*countsPerMs_ < fabs(targetCounts_ - startCounts_))
+      return;
+   startCounts_ = targetCounts_;
+   moving_ = false;
+   if (homing_)
+   {
+      homing_ = false;
+      homed_ = true;
+   }
+}
+
+// Caller holds lock_. A new command replaces the motion in progress, and its
+// completion, if not yet visible, with it.
+void KinesisSimulatedBackend::StartMotion(double nowMs, double velocity)
+{
+   Update(nowMs);
+   startCounts_ = PositionAt(nowMs);
+   while (!messages_.empty() && messages_.back().releaseMs > nowMs)
+      messages_.pop_back();
+   startMs_ = nowMs;
+   targetCounts_ = startCounts_;
+   countsPerMs_ = (std::max)(velocity, 1.0)*countsPerVelocityUnit_/1000.0;
+   continuous_ = false;
+   homing_ = false;
+   moving_ = true;
+}
+
+// Caller holds lock_. Sends the motion on to targetCounts and posts its
+// completion for when it arrives.
+void KinesisSimulatedBackend::MoveTo(double nowMs, double targetCounts, WORD completionId)
+{
+   targetCounts_ = targetCounts;
+   direction_ = targetCounts >= startCounts_ ? 1 : -1;
+   Post(completionId, nowMs + fabs(targetCounts - startCounts_)/countsPerMs_);
+}
+
+// Caller holds lock_
+void KinesisSimulatedBackend::Post(WORD id, double releaseMs)
+{
+   PendingMessage message;
+   message.id = id;
+   message.releaseMs = releaseMs;
+   messages_.push_back(message);
+}
+
+// Caller holds lock_
+void KinesisSimulatedBackend::Halt(double nowMs)
+{
+   Update(nowMs);
+   if (!moving_)
+      return;
+   StartMotion(nowMs, 0.0);
+   moving_ = false;
+   Post(g_sim_msg_stopped, nowMs);
+}
+
+// Caller holds lock_
+size_t KinesisSimulatedBackend::Ready(double nowMs) const
+{
+   size_t ready = 0;
+   while (ready < messages_.size() && messages_[ready].releaseMs <= nowMs)
+      ready++;
+   return ready;
+}
+
+int KinesisSimulatedBackend::MessageQueueSize()
+{
+   MMThreadGuard guard(lock_);
+   return (int)Ready(clock_->NowMs());
+}
+
+bool KinesisSimulatedBackend::GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData)
+{
+   MMThreadGuard guard(lock_);
+   if (Ready(clock_->NowMs()) == 0)
+      return false;
+   *messageType = g_sim_msg_generic_motor;
+   *messageId = messages_.front().id;
+   *messageData = 0;
+   messages_.pop_front();
+   return true;
+}
+
+short KinesisSimulatedBackend::ClearMessageQueue()
+{
+   MMThreadGuard guard(lock_);
+   size_t ready = Ready(clock_->NowMs());
+   messages_.erase(messages_.begin(), messages_.begin() + ready);
+   return 0;
+}
+
+short KinesisSimulatedBackend::MoveToPosition(int index)
+{
+   MMThreadGuard guard(lock_);
+   double now = clock_->NowMs();
+   StartMotion(now, maxVelocity_);
+   MoveTo(now, index, g_sim_msg_moved);
+   return 0;
+}
+
+short KinesisSimulatedBackend::MoveAtVelocity(MOT_TravelDirection direction)
+{
+   MMThreadGuard guard(lock_);
+   // no end, so no completion either
+   StartMotion(clock_->NowMs(), maxVelocity_);
+   direction_ = direction == MOT_Reverse ? -1 : 1;
+   continuous_ = true;
+   return 0;
+}
+
+short KinesisSimulatedBackend::Home()
+{
+   MMThreadGuard guard(lock_);
+   double now = clock_->NowMs();
+   StartMotion(now, homingParams_.velocity);
+   MoveTo(now, 0.0, g_sim_msg_homed);
+   homing_ = true;
+   homed_ = false;
+   return 0;
+}
+
+short KinesisSimulatedBackend::StopProfiled()
+{
+   MMThreadGuard guard(lock_);
+   Halt(clock_->NowMs());
+   return 0;
+}
+
+short KinesisSimulatedBackend::StopImmediate()
+{
+   MMThreadGuard guard(lock_);
+   Halt(clock_->NowMs());
+   return 0;
+}
+
+short KinesisSimulatedBackend::SetPositionCounter(long count)
+{
+   MMThreadGuard guard(lock_);
+   double now = clock_->NowMs();
+   Update(now);
+   // shifts the motion in progress with the counter
+   double offset = count - PositionAt(now);
+   startCounts_ += offset;
+   targetCounts_ += offset;
+   return 0;
+}
+
+short KinesisSimulatedBackend::SetDigitalOutputs(byte outputs)
+{
+   MMThreadGuard guard(lock_);
+   digitalOutputs_ = outputs;
+   return 0;
+}
+
+short KinesisSimulatedBackend::SetTriggerSwitches(byte switches)
+{
+   MMThreadGuard guard(lock_);
+   triggerSwitches_ = switches;
+   return 0;
+}
+
+int KinesisSimulatedBackend::GetPosition()
+{
+   MMThreadGuard guard(lock_);
+   double now = clock_->NowMs();
+   Update(now);
+   return (int)floor(PositionAt(now) + 0.5);
+}
+
+long KinesisSimulatedBackend::GetEncoderCounter()
+{
+   return GetPosition();
+}
+
+DWORD KinesisSimulatedBackend::GetStatusBits()
+{
+   MMThreadGuard guard(lock_);
+   Update(clock_->NowMs());
+   DWORD bits = g_sim_status_connected | g_sim_status_enabled;
+   if (moving_)
+      bits |= direction_ > 0 ? g_sim_status_moving_cw : g_sim_status_moving_ccw;
+   if (homing_)
+      bits |= g_sim_status_homing;
+   if (homed_)
+      bits |= g_sim_status_homed;
+   return bits;
+}
+
+byte KinesisSimulatedBackend::GetTriggerSwitches()
+{
+   MMThreadGuard guard(lock_);
+   return triggerSwitches_;
+}
+
+short KinesisSimulatedBackend::GetHardwareInfoBlock(TLI_HardwareInformation* info)
+{
+   memset(info, 0, sizeof(*info));
+   strncpy(info->modelNumber, "BSC201", sizeof(info->modelNumber) - 1);
+   strncpy(info->notes, "Simulated", sizeof(info->notes) - 1);
+   info->numChannels = 1;
+   return 0;
+}
+
+short KinesisSimulatedBackend::GetVelParamsBlock(MOT_VelocityParameters* params)
+{
+   MMThreadGuard guard(lock_);
+   params->minVelocity = 0;
+   params->acceleration = acceleration_;
+   params->maxVelocity = maxVelocity_;
+   return 0;
+}
+
+short KinesisSimulatedBackend::SetVelParams(int acceleration, int maxVelocity)
+{
+   MMThreadGuard guard(lock_);
+   acceleration_ = acceleration;
+   maxVelocity_ = maxVelocity;
+   return 0;
+}
+
+short KinesisSimulatedBackend::GetHomingParamsBlock(MOT_HomingParameters* params)
+{
+   MMThreadGuard guard(lock_);
+   *params = homingParams_;
+   return 0;
+}
+
+short KinesisSimulatedBackend::SetHomingParamsBlock(MOT_HomingParameters* params)
+{
+   MMThreadGuard guard(lock_);
+   homingParams_ = *params;
+   return 0;
+}
+
+// the model is always current, so requests have nothing to fetch
+short KinesisSimulatedBackend::RequestPosition() {return 0;}
+short KinesisSimulatedBackend::RequestEncoderCounter() {return 0;}
+short KinesisSimulatedBackend::RequestStatusBits() {return 0;}
+short KinesisSimulatedBackend::RequestTriggerSwitches() {return 0;}
+short KinesisSimulatedBackend::RequestSettings() {return 0;}
+short KinesisSimulatedBackend::RequestVelParams() {return 0;}
+short KinesisSimulatedBackend::RequestHomingParams() {return 0;}
+long KinesisSimulatedBackend::PollingDuration() {return pollMs_;}
+bool KinesisSimulatedBackend::PersistSettings() {return true;}
+bool KinesisSimulatedBackend::LoadNamedSettings(const char* name) {return true;}
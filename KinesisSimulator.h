@@ -0,0 +1,98 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          KinesisSimulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Simulated Kinesis channel with a simple motion model
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "KinesisBackend.h"
+
+#include <deque>
+
+// Stands in for a controller so soak and fault runs need no hardware. The
+// wheel moves at constant velocity from where it is to where it was sent,
+// measured on the wheel's clock, and the completion message becomes visible
+// when it gets there; acceleration is not modelled. On the virtual clock a
+// move then takes no real time at all. The encoder counts one to one with
+// the position counter.
+class KinesisSimulatedBackend : public KinesisBackend
+{
+public:
+   // countsPerVelocityUnit converts the controller's velocity units to
+   // position counts per second
+   KinesisSimulatedBackend(WheelClock* clock, double countsPerVelocityUnit, int maxVelocity, unsigned int homingVelocity, long pollMs);
+
+   int MessageQueueSize();
+   bool GetNextMessage(WORD* messageType, WORD* messageId, DWORD* messageData);
+   short ClearMessageQueue();
+   short MoveToPosition(int index);
+   short MoveAtVelocity(MOT_TravelDirection direction);
+   short Home();
+   short StopProfiled();
+   short StopImmediate();
+   short SetPositionCounter(long count);
+   short SetDigitalOutputs(byte outputs);
+   short SetTriggerSwitches(byte switches);
+   int GetPosition();
+   short RequestPosition();
+   long GetEncoderCounter();
+   short RequestEncoderCounter();
+   DWORD GetStatusBits();
+   short RequestStatusBits();
+   long PollingDuration();
+   byte GetTriggerSwitches();
+   short RequestTriggerSwitches();
+   short RequestSettings();
+   short GetHardwareInfoBlock(TLI_HardwareInformation* info);
+   short RequestVelParams();
+   short GetVelParamsBlock(MOT_VelocityParameters* params);
+   short SetVelParams(int acceleration, int maxVelocity);
+   short RequestHomingParams();
+   short GetHomingParamsBlock(MOT_HomingParameters* params);
+   short SetHomingParamsBlock(MOT_HomingParameters* params);
+   bool PersistSettings();
+   bool LoadNamedSettings(const char* name);
+
+private:
+   struct PendingMessage
+   {
+      WORD id;
+      double releaseMs;
+   };
+
+   void Update(double nowMs);
+   double PositionAt(double nowMs) const;
+   void StartMotion(double nowMs, double velocity);
+   void MoveTo(double nowMs, double targetCounts, WORD completionId);
+   void Post(WORD id, double releaseMs);
+   void Halt(double nowMs);
+   size_t Ready(double nowMs) const;
+
+   WheelClock* clock_;
+   MMThreadLock lock_;
+   double countsPerVelocityUnit_;
+   long pollMs_;
+   // the current motion: from startCounts_ at startMs_ towards targetCounts_,
+   // or without end when continuous_
+   bool moving_;
+   bool continuous_;
+   bool homing_;
+   bool homed_;
+   double startMs_;
+   double startCounts_;
+   double targetCounts_;
+   double countsPerMs_;
+   int direction_;
+   int acceleration_;
+   int maxVelocity_;
+   MOT_HomingParameters homingParams_;
+   byte triggerSwitches_;
+   byte digitalOutputs_;
+   std::deque<PendingMessage> messages_;
+};
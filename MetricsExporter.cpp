@@ -0,0 +1,91 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MetricsExporter.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Periodic Prometheus text export of the wheel metrics
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "MetricsExporter.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <fstream>
+#include <stdio.h>
+
+const int g_export_wait_ms = 100; // keeps the exporter responsive to a stop request
+
+MetricsExportThread::MetricsExportThread(const WheelMetrics* metrics) :
+   metrics_(metrics),
+   intervalMs_(0),
+   stop_(true),
+   running_(false)
+{
+}
+
+MetricsExportThread::~MetricsExportThread()
+{
+   Stop();
+}
+
+void MetricsExportThread::Start(const std::string& path, const std::string& labels, int intervalMs)
+{
+   if (running_)
+      return;
+   path_ = path;
+   labels_ = labels;
+   intervalMs_ = intervalMs;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void MetricsExportThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int MetricsExportThread::svc()
+{
+   int waited = intervalMs_; // first export straight away
+   while (!stop_)
+   {
+      if (waited >= intervalMs_)
+      {
+         waited = 0;
+         if (WriteFile() != DEVICE_OK)
+            printf("Could not write metrics to %s\n", path_.c_str());
+      }
+      Sleep(g_export_wait_ms);
+      waited += g_export_wait_ms;
+   }
+   // leave the final counts behind
+   WriteFile();
+   return 0;
+}
+
+int MetricsExportThread::WriteFile()
+{
+   std::string temp = path_ + ".tmp";
+   {
+      std::ofstream out(temp.c_str(), std::ios::out | std::ios::trunc);
+      if (!out)
+         return DEVICE_ERR;
+      metrics_->WriteExposition(out, labels_);
+      out.flush();
+      if (!out)
+         return DEVICE_ERR;
+   }
+   if (!MoveFileExA(temp.c_str(), path_.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+      return DEVICE_ERR;
+   return DEVICE_OK;
+}
@@ -0,0 +1,42 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MetricsExporter.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Periodic Prometheus text export of the wheel metrics
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "../../MMDevice/DeviceThreads.h"
+#include "WheelMetrics.h"
+
+#include <string>
+
+// Writes the metrics to a file every interval for a node exporter textfile
+// collector or similar to pick up. The file is written next to the target and
+// moved over it, so a reader never sees half a file. Only reads the metrics'
+// atomics, so it never waits on or delays a move.
+class MetricsExportThread : public MMDeviceThreadBase
+{
+public:
+   MetricsExportThread(const WheelMetrics* metrics);
+   ~MetricsExportThread();
+   int svc();
+   void Start(const std::string& path, const std::string& labels, int intervalMs);
+   void Stop();
+   bool IsRunning() const {return running_;}
+
+private:
+   int WriteFile();
+
+   const WheelMetrics* metrics_;
+   std::string path_;
+   std::string labels_;
+   int intervalMs_;
+   volatile bool stop_;
+   volatile bool running_;
+};
@@ -0,0 +1,110 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MoveTelemetry.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ring buffer of position samples taken during moves
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "MoveTelemetry.h"
+#include <stdio.h>
+
+TelemetryRecorder::TelemetryRecorder(size_t sampleCapacity, size_t moveCapacity) :
+   samples_(sampleCapacity),
+   moves_(moveCapacity),
+   sampleCount_(0),
+   moveCount_(0),
+   active_(false),
+   stopAtMs_(0.0)
+{
+}
+
+void TelemetryRecorder::BeginMove(long from, long to, double timeMs)
+{
+   MMThreadGuard guard(lock_);
+   Move& move = moves_[moveCount_ % moves_.size()];
+   move.from = from;
+   move.to = to;
+   move.startMs = timeMs;
+   move.endMs = timeMs;
+   move.result = 0;
+   move.firstSample = sampleCount_;
+   move.endSample = sampleCount_;
+   moveCount_++;
+   active_ = true;
+   stopAtMs_ = 0.0;
+}
+
+void TelemetryRecorder::EndMove(double timeMs, int result, double tailMs)
+{
+   MMThreadGuard guard(lock_);
+   if (moveCount_ == 0)
+      return;
+   Move& move = moves_[(moveCount_ - 1) % moves_.size()];
+   move.endMs = timeMs;
+   move.result = result;
+   stopAtMs_ = timeMs + tailMs;
+}
+
+bool TelemetryRecorder::Recording(double timeMs)
+{
+   MMThreadGuard guard(lock_);
+   if (active_ && stopAtMs_ > 0.0 && timeMs > stopAtMs_)
+      active_ = false;
+   return active_;
+}
+
+void TelemetryRecorder::AddSample(double timeMs, int position, unsigned long status)
+{
+   MMThreadGuard guard(lock_);
+   if (!active_ || moveCount_ == 0)
+      return;
+   Sample& sample = samples_[sampleCount_ % samples_.size()];
+   sample.timeMs = timeMs;
+   sample.position = position;
+   sample.status = status;
+   sampleCount_++;
+   moves_[(moveCount_ - 1) % moves_.size()].endSample = sampleCount_;
+}
+
+int TelemetryRecorder::WriteCsv(std::ostream& out, int lastMoves, double countsPerDegree)
+{
+   MMThreadGuard guard(lock_);
+   out << "move,from_slot,to_slot,result,end_ms,t_ms,position_counts,position_deg,status\n";
+   unsigned long long oldestSample = sampleCount_ > samples_.size() ? sampleCount_ - samples_.size() : 0;
+   unsigned long long oldestMove = moveCount_ > moves_.size() ? moveCount_ - moves_.size() : 0;
+   unsigned long long first = moveCount_ > (unsigned long long)lastMoves ? moveCount_ - lastMoves : 0;
+   if (first < oldestMove)
+      first = oldestMove;
+   int written = 0;
+   for (unsigned long long m = first; m < moveCount_; m++)
+   {
+      const Move& move = moves_[m % moves_.size()];
+      // skip moves whose samples have been partly overwritten
+      if (move.firstSample < oldestSample)
+         continue;
+      for (unsigned long long s = move.firstSample; s < move.endSample; s++)
+      {
+         const Sample& sample = samples_[s % samples_.size()];
+         char status[11];
+         sprintf(status, "0x%08lX", sample.status);
+         out << m << "," << move.from << "," << move.to << "," << move.result << ","
+            << (move.endMs - move.startMs) << "," << (sample.timeMs - move.startMs) << ","
+            << sample.position << "," << sample.position/countsPerDegree << "," << status << "\n";
+      }
+      written++;
+   }
+   return written;
+}
+
+void TelemetryRecorder::Clear()
+{
+   MMThreadGuard guard(lock_);
+   sampleCount_ = 0;
+   moveCount_ = 0;
+   active_ = false;
+   stopAtMs_ = 0.0;
+}
@@ -0,0 +1,64 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          MoveTelemetry.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ring buffer of position samples taken during moves
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "../../MMDevice/DeviceThreads.h"
+
+#include <vector>
+#include <ostream>
+
+// Keeps the trajectory of recent moves: timestamped position counter and
+// status bit samples, grouped by move. Both rings are allocated up front and
+// overwritten oldest first, so recording never allocates.
+class TelemetryRecorder
+{
+public:
+   TelemetryRecorder(size_t sampleCapacity, size_t moveCapacity);
+
+   // a move's samples run from BeginMove until tailMs after EndMove, so that
+   // overshoot and settling after the completion message are captured too
+   void BeginMove(long from, long to, double timeMs);
+   void EndMove(double timeMs, int result, double tailMs);
+   bool Recording(double timeMs);
+   void AddSample(double timeMs, int position, unsigned long status);
+
+   // CSV of the last moves whose samples are still in the buffer; returns how many were written
+   int WriteCsv(std::ostream& out, int lastMoves, double countsPerDegree);
+   void Clear();
+
+private:
+   struct Sample
+   {
+      double timeMs;
+      int position;
+      unsigned long status;
+   };
+
+   struct Move
+   {
+      long from;
+      long to;
+      double startMs;
+      double endMs;
+      int result;
+      unsigned long long firstSample;
+      unsigned long long endSample; // one past the last
+   };
+
+   MMThreadLock lock_;
+   std::vector<Sample> samples_;
+   std::vector<Move> moves_;
+   unsigned long long sampleCount_;
+   unsigned long long moveCount_;
+   bool active_;
+   double stopAtMs_;
+};
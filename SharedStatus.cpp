@@ -0,0 +1,111 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SharedStatus.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Wheel status published in shared memory for local readers
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "SharedStatus.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <stdio.h>
+#include <string.h>
+
+const int g_shared_status_read_attempts = 100;
+
+SharedStatusPublisher::SharedStatusPublisher() :
+   mapping_(0),
+   status_(0)
+{
+}
+
+SharedStatusPublisher::~SharedStatusPublisher()
+{
+   Close();
+}
+
+int SharedStatusPublisher::Open(const std::string& serial, long channel, long numPositions)
+{
+   MMThreadGuard guard(lock_);
+   if (status_ != 0)
+      return DEVICE_OK;
+   char name[64];
+   sprintf(name, "Local\\FW103H_%s_%ld", serial.c_str(), channel);
+   mapping_ = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(SharedWheelStatus), name);
+   if (mapping_ == 0)
+      return DEVICE_ERR;
+   status_ = (SharedWheelStatus*)MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedWheelStatus));
+   if (status_ == 0)
+   {
+      CloseHandle(mapping_);
+      mapping_ = 0;
+      return DEVICE_ERR;
+   }
+   name_ = name;
+
+   // a segment left by an earlier instance keeps its sequence so that readers
+   // holding it mapped do not see the counter go backwards
+   InterlockedIncrement(&status_->sequence);
+   if ((status_->sequence & 1) == 0)
+      InterlockedIncrement(&status_->sequence);
+   status_->magic = g_shared_status_magic;
+   status_->version = g_shared_status_version;
+   status_->numPositions = numPositions;
+   status_->channel = channel;
+   strncpy(status_->serial, serial.c_str(), sizeof(status_->serial) - 1);
+   status_->serial[sizeof(status_->serial) - 1] = '\0';
+   InterlockedIncrement(&status_->sequence);
+   return DEVICE_OK;
+}
+
+void SharedStatusPublisher::Close()
+{
+   MMThreadGuard guard(lock_);
+   if (status_ != 0)
+      UnmapViewOfFile(status_);
+   if (mapping_ != 0)
+      CloseHandle(mapping_);
+   status_ = 0;
+   mapping_ = 0;
+}
+
+void SharedStatusPublisher::Publish(long position, long motionState, bool moving, bool faulted, unsigned long statusBits, double lastMoveMs)
+{
+   MMThreadGuard guard(lock_);
+   if (status_ == 0)
+      return;
+   // the interlocked increments are full barriers, so the field writes
+   // cannot move outside the odd window
+   InterlockedIncrement(&status_->sequence);
+   status_->position = position;
+   status_->motionState = motionState;
+   status_->moving = moving ? 1 : 0;
+   status_->faulted = faulted ? 1 : 0;
+   status_->statusBits = statusBits;
+   status_->lastMoveMs = lastMoveMs;
+   status_->updatedTick = GetTickCount64();
+   status_->updates++;
+   InterlockedIncrement(&status_->sequence);
+}
+
+bool SharedStatusPublisher::Read(const SharedWheelStatus* segment, SharedWheelStatus& copy)
+{
+   for (int attempt = 0; attempt < g_shared_status_read_attempts; attempt++)
+   {
+      LONG before = segment->sequence;
+      if (before & 1)
+      {
+         Sleep(0);
+         continue;
+      }
+      MemoryBarrier();
+      memcpy(&copy, (const void*)segment, sizeof(copy));
+      MemoryBarrier();
+      if (segment->sequence == before)
+         return true;
+   }
+   return false;
+}
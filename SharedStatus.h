@@ -0,0 +1,73 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SharedStatus.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Wheel status published in shared memory for local readers
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "../../MMDevice/DeviceThreads.h"
+
+#include <string>
+
+const unsigned long g_shared_status_magic = 0x48333031; // "103H"
+const unsigned long g_shared_status_version = 1;
+
+// Layout of the named mapping "Local\FW103H_<serial>_<channel>". Fixed-size
+// fields only, so scripts in any language can map it. The writer makes
+// sequence odd while it updates the fields and even again afterwards; a reader
+// copies the struct and accepts the copy only if sequence was the same even
+// value before and after (see SharedStatusPublisher::Read).
+#pragma pack(push, 8)
+struct SharedWheelStatus
+{
+   unsigned long magic;
+   unsigned long version;
+   volatile LONG sequence;
+   long position;       // slot, 0-based
+   long numPositions;
+   long motionState;    // index into the "Motion state" names
+   long moving;         // 1 while homing, moving or verifying
+   long faulted;        // 1 in the Fault state
+   unsigned long statusBits;
+   double lastMoveMs;
+   unsigned long long updatedTick; // GetTickCount64() of the last update
+   unsigned long long updates;
+   long channel;
+   char serial[16];
+};
+#pragma pack(pop)
+
+// Owns the mapping and is the only writer. Updates are serialized with a lock
+// so the seqlock keeps a single writer; readers never take it.
+class SharedStatusPublisher
+{
+public:
+   SharedStatusPublisher();
+   ~SharedStatusPublisher();
+
+   int Open(const std::string& serial, long channel, long numPositions);
+   void Close();
+   bool IsOpen() const {return status_ != 0;}
+   const std::string& Name() const {return name_;}
+
+   void Publish(long position, long motionState, bool moving, bool faulted, unsigned long statusBits, double lastMoveMs);
+
+   // consistent copy of a mapped segment, false if the writer kept it busy
+   static bool Read(const SharedWheelStatus* segment, SharedWheelStatus& copy);
+
+private:
+   MMThreadLock lock_;
+   HANDLE mapping_;
+   SharedWheelStatus* status_;
+   std::string name_;
+};
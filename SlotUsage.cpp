@@ -0,0 +1,188 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SlotUsage.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Slot-to-slot transition counts and the filter placement they favour
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "SlotUsage.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+const long g_max_exhaustive_slots = 8; // 8! assignments
+
+///////////////////////////////////////////////////////////////////////////////
+// SlotUsage
+///////////////////////////////////////////////////////////////////////////////
+
+SlotUsage::SlotUsage() :
+   slots_(0),
+   total_(0)
+{
+}
+
+void SlotUsage::Reset(long slots)
+{
+   MMThreadGuard guard(lock_);
+   slots_ = slots;
+   counts_.assign(slots * slots, 0);
+   total_ = 0;
+}
+
+long SlotUsage::Record(long from, long to)
+{
+   MMThreadGuard guard(lock_);
+   if (from == to || from < 0 || to < 0 || from >= slots_ || to >= slots_)
+      return total_;
+   counts_[from * slots_ + to]++;
+   return ++total_;
+}
+
+long SlotUsage::Transitions() const
+{
+   MMThreadGuard guard(lock_);
+   return total_;
+}
+
+long SlotUsage::Slots() const
+{
+   MMThreadGuard guard(lock_);
+   return slots_;
+}
+
+std::vector<long> SlotUsage::Counts() const
+{
+   MMThreadGuard guard(lock_);
+   return counts_;
+}
+
+// File format: a "slots,<n>" line, then n lines of n comma-separated counts
+bool SlotUsage::Load(const std::string& path, long slots)
+{
+   std::ifstream in(path.c_str());
+   if (!in)
+      return false;
+   std::string line;
+   if (!std::getline(in, line) || line.compare(0, 6, "slots,") != 0 || atol(line.c_str() + 6) != slots)
+      return false;
+   std::vector<long> counts(slots * slots, 0);
+   long total = 0;
+   for (long from = 0; from < slots; from++)
+   {
+      if (!std::getline(in, line))
+         return false;
+      std::istringstream row(line);
+      std::string cell;
+      for (long to = 0; to < slots; to++)
+      {
+         if (!std::getline(row, cell, ','))
+            return false;
+         counts[from * slots + to] = atol(cell.c_str());
+         total += counts[from * slots + to];
+      }
+   }
+   MMThreadGuard guard(lock_);
+   slots_ = slots;
+   counts_.swap(counts);
+   total_ = total;
+   return true;
+}
+
+bool SlotUsage::Save(const std::string& path) const
+{
+   std::ostringstream text;
+   {
+      MMThreadGuard guard(lock_);
+      text << "slots," << slots_ << "\n";
+      for (long from = 0; from < slots_; from++)
+      {
+         for (long to = 0; to < slots_; to++)
+            text << (to > 0 ? "," : "") << counts_[from * slots_ + to];
+         text << "\n";
+      }
+   }
+   std::ofstream out(path.c_str(), std::ios::out | std::ios::trunc);
+   if (!out)
+      return false;
+   out << text.str();
+   return (bool)out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Placement
+///////////////////////////////////////////////////////////////////////////////
+
+static double TravelCost(const std::vector<long>& counts, long slots, const std::vector<double>& travelMs, const std::vector<long>& slotOf)
+{
+   double cost = 0.0;
+   for (long from = 0; from < slots; from++)
+      for (long to = 0; to < slots; to++)
+         if (counts[from * slots + to] > 0)
+            cost += counts[from * slots + to] * travelMs[labs(slotOf[from] - slotOf[to])];
+   return cost;
+}
+
+SlotPlacement PlanSlotPlacement(const std::vector<long>& counts, long slots, const std::vector<double>& travelMs)
+{
+   SlotPlacement placement;
+   placement.slotOf.resize(slots);
+   for (long i = 0; i < slots; i++)
+      placement.slotOf[i] = i;
+   long total = 0;
+   for (size_t i = 0; i < counts.size(); i++)
+      total += counts[i];
+   placement.currentMs = 0.0;
+   placement.bestMs = 0.0;
+   if (total == 0)
+      return placement;
+
+   double current = TravelCost(counts, slots, travelMs, placement.slotOf);
+   double best = current;
+   std::vector<long> trial(placement.slotOf);
+   if (slots <= g_max_exhaustive_slots)
+   {
+      while (std::next_permutation(trial.begin(), trial.end()))
+      {
+         double cost = TravelCost(counts, slots, travelMs, trial);
+         if (cost < best)
+         {
+            best = cost;
+            placement.slotOf = trial;
+         }
+      }
+   }
+   else
+   {
+      // swap pairs of filters while that still helps
+      bool improved = true;
+      while (improved)
+      {
+         improved = false;
+         for (long a = 0; a < slots; a++)
+         {
+            for (long b = a + 1; b < slots; b++)
+            {
+               std::swap(trial[a], trial[b]);
+               double cost = TravelCost(counts, slots, travelMs, trial);
+               if (cost < best)
+               {
+                  best = cost;
+                  placement.slotOf = trial;
+                  improved = true;
+               }
+               else
+                  std::swap(trial[a], trial[b]);
+            }
+         }
+      }
+   }
+   placement.currentMs = current / total;
+   placement.bestMs = best / total;
+   return placement;
+}
@@ -0,0 +1,57 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SlotUsage.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Slot-to-slot transition counts and the filter placement they favour
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "../../MMDevice/DeviceThreads.h"
+
+#include <string>
+#include <vector>
+
+// Counts of moves from each slot to each other slot, kept in a small text
+// file so they add up over sessions. Counts are by physical slot; after the
+// filters are rearranged the old counts no longer apply and should be reset.
+class SlotUsage
+{
+public:
+   SlotUsage();
+
+   void Reset(long slots);
+   // returns the number of transitions counted so far
+   long Record(long from, long to);
+   long Transitions() const;
+   long Slots() const;
+   // row-major, from slot by to slot
+   std::vector<long> Counts() const;
+
+   // Load keeps the current counts if the file is missing or is for another
+   // number of slots
+   bool Load(const std::string& path, long slots);
+   bool Save(const std::string& path) const;
+
+private:
+   mutable MMThreadLock lock_;
+   long slots_;
+   std::vector<long> counts_;
+   long total_;
+};
+
+// Filter-to-slot assignment with the least expected travel time per move
+struct SlotPlacement
+{
+   std::vector<long> slotOf; // new slot for the filter now in each slot
+   double currentMs;         // expected time per move as placed now
+   double bestMs;            // expected time per move with slotOf
+};
+
+// travelMs[d] is the expected time of a move over d slots. Every assignment
+// is tried for small wheels, larger ones are improved by pairwise swaps.
+SlotPlacement PlanSlotPlacement(const std::vector<long>& counts, long slots, const std::vector<double>& travelMs);
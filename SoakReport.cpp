@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoakReport.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Windowed latency and position error statistics of a soak run
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "SoakReport.h"
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <math.h>
+#include <string.h>
+
+static double Quantile(const std::vector<double>& sorted, double q)
+{
+   if (sorted.empty())
+      return 0.0;
+   size_t index = (size_t)ceil(q * sorted.size());
+   return sorted[index > 0 ? index - 1 : 0];
+}
+
+SoakCounters ReadSoakCounters(const WheelMetrics& metrics)
+{
+   SoakCounters totals;
+   for (int phase = 0; phase < NUM_PHASES; phase++)
+   {
+      totals.phaseMs[phase] = metrics.PhaseTotalMs((MovePhase)phase);
+      totals.phaseCount[phase] = metrics.PhaseCount((MovePhase)phase);
+   }
+   totals.timeouts = metrics.Timeouts();
+   totals.retries = metrics.Retries();
+   totals.resyncs = metrics.Resyncs();
+   totals.rehomes = metrics.Rehomes();
+   return totals;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SoakRecorder
+///////////////////////////////////////////////////////////////////////////////
+
+SoakRecorder::SoakRecorder() :
+   failed_(0),
+   errorSum_(0.0),
+   maxError_(0.0)
+{
+   memset(&start_, 0, sizeof(start_));
+}
+
+void SoakRecorder::Begin(const SoakCounters& totals)
+{
+   MMThreadGuard guard(lock_);
+   start_ = totals;
+   windows_.clear();
+   times_.clear();
+   failed_ = 0;
+   errorSum_ = 0.0;
+   maxError_ = 0.0;
+}
+
+void SoakRecorder::AddMove(double ms, bool ok, double errorDeg)
+{
+   MMThreadGuard guard(lock_);
+   if (!ok)
+   {
+      failed_++;
+      return;
+   }
+   times_.push_back(ms);
+   errorSum_ += errorDeg;
+   if (errorDeg > maxError_)
+      maxError_ = errorDeg;
+}
+
+bool SoakRecorder::WindowHasMoves() const
+{
+   MMThreadGuard guard(lock_);
+   return !times_.empty() || failed_ > 0;
+}
+
+void SoakRecorder::CloseWindow(double startHours, const SoakCounters& totals)
+{
+   MMThreadGuard guard(lock_);
+   std::sort(times_.begin(), times_.end());
+   SoakWindow window;
+   window.startHours = startHours;
+   window.moves = (long)times_.size() + failed_;
+   window.failed = failed_;
+   window.p50Ms = Quantile(times_, 0.50);
+   window.p95Ms = Quantile(times_, 0.95);
+   window.p99Ms = Quantile(times_, 0.99);
+   window.maxMs = times_.empty() ? 0.0 : times_.back();
+   window.meanErrorDeg = times_.empty() ? 0.0 : errorSum_ / times_.size();
+   window.maxErrorDeg = maxError_;
+   for (int phase = 0; phase < NUM_PHASES; phase++)
+   {
+      long count = totals.phaseCount[phase] - start_.phaseCount[phase];
+      window.phaseMs[phase] = count > 0 ? (totals.phaseMs[phase] - start_.phaseMs[phase]) / count : 0.0;
+   }
+   window.timeouts = totals.timeouts - start_.timeouts;
+   window.retries = totals.retries - start_.retries;
+   window.resyncs = totals.resyncs - start_.resyncs;
+   window.rehomes = totals.rehomes - start_.rehomes;
+   windows_.push_back(window);
+   start_ = totals;
+   times_.clear();
+   failed_ = 0;
+   errorSum_ = 0.0;
+   maxError_ = 0.0;
+}
+
+size_t SoakRecorder::Windows() const
+{
+   MMThreadGuard guard(lock_);
+   return windows_.size();
+}
+
+std::string SoakRecorder::Summary() const
+{
+   MMThreadGuard guard(lock_);
+   return SummaryLocked();
+}
+
+// Caller holds lock_
+std::string SoakRecorder::SummaryLocked() const
+{
+   if (windows_.empty())
+      return "";
+   const SoakWindow& first = windows_.front();
+   const SoakWindow& last = windows_.back();
+
+   // least-squares slope of the median over the run
+   double slope = 0.0;
+   size_t n = windows_.size();
+   if (n > 1)
+   {
+      double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+      for (size_t i = 0; i < n; i++)
+      {
+         sx += windows_[i].startHours;
+         sy += windows_[i].p50Ms;
+         sxx += windows_[i].startHours * windows_[i].startHours;
+         sxy += windows_[i].startHours * windows_[i].p50Ms;
+      }
+      double d = n * sxx - sx * sx;
+      if (d > 0.0)
+         slope = (n * sxy - sx * sy) / d;
+   }
+
+   long moves = 0, failed = 0, timeouts = 0, recoveries = 0;
+   double maxError = 0.0;
+   for (size_t i = 0; i < n; i++)
+   {
+      moves += windows_[i].moves;
+      failed += windows_[i].failed;
+      timeouts += windows_[i].timeouts;
+      recoveries += windows_[i].retries + windows_[i].resyncs + windows_[i].rehomes;
+      maxError = (std::max)(maxError, windows_[i].maxErrorDeg);
+   }
+
+   // the mechanism only shows in the wait for completion, the rest is host and USB
+   double mechanical = last.phaseMs[PHASE_COMPLETION] - first.phaseMs[PHASE_COMPLETION];
+   double software = (last.phaseMs[PHASE_COMMAND] + last.phaseMs[PHASE_VERIFY]) - (first.phaseMs[PHASE_COMMAND] + first.phaseMs[PHASE_VERIFY]);
+   const char* cause = "no drift";
+   if (fabs(mechanical) > 1.0 || fabs(software) > 1.0)
+      cause = fabs(mechanical) >= fabs(software) ? "mostly mechanical" : "mostly software/USB";
+
+   std::ostringstream summary;
+   summary << std::fixed << std::setprecision(1);
+   summary << n << " windows, " << moves << " moves, " << failed << " failed, " << timeouts << " timeouts, " << recoveries << " recoveries";
+   summary << "; p50 " << first.p50Ms << " -> " << last.p50Ms << " ms (" << slope << " ms/h)";
+   summary << ", p99 " << first.p99Ms << " -> " << last.p99Ms << " ms";
+   summary << "; completion " << (mechanical >= 0.0 ? "+" : "") << mechanical << " ms, command+verify " << (software >= 0.0 ? "+" : "") << software << " ms, " << cause;
+   summary << std::setprecision(3) << "; max position error " << maxError << " deg";
+   return summary.str();
+}
+
+void SoakRecorder::WriteReport(std::ostream& out) const
+{
+   MMThreadGuard guard(lock_);
+   out << "window_start_h,moves,failed,p50_ms,p95_ms,p99_ms,max_ms,command_ms,completion_ms,verify_ms,"
+      "mean_error_deg,max_error_deg,timeouts,retries,resyncs,rehomes\n";
+   for (size_t i = 0; i < windows_.size(); i++)
+   {
+      const SoakWindow& w = windows_[i];
+      out << w.startHours << "," << w.moves << "," << w.failed << "," << w.p50Ms << "," << w.p95Ms << "," << w.p99Ms << "," << w.maxMs << ","
+         << w.phaseMs[PHASE_COMMAND] << "," << w.phaseMs[PHASE_COMPLETION] << "," << w.phaseMs[PHASE_VERIFY] << ","
+         << w.meanErrorDeg << "," << w.maxErrorDeg << "," << w.timeouts << "," << w.retries << ","
+         << w.resyncs << "," << w.rehomes << "\n";
+   }
+   out << "# " << SummaryLocked() << "\n";
+}
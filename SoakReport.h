@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SoakReport.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Windowed latency and position error statistics of a soak run
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include "../../MMDevice/DeviceThreads.h"
+#include "WheelMetrics.h"
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+// Running totals from the wheel metrics; windows hold the difference
+struct SoakCounters
+{
+   double phaseMs[NUM_PHASES];
+   long phaseCount[NUM_PHASES];
+   long timeouts;
+   long retries;
+   long resyncs;
+   long rehomes;
+};
+
+SoakCounters ReadSoakCounters(const WheelMetrics& metrics);
+
+// One window of the run
+struct SoakWindow
+{
+   double startHours;
+   long moves;
+   long failed;
+   double p50Ms;
+   double p95Ms;
+   double p99Ms;
+   double maxMs;
+   double meanErrorDeg;
+   double maxErrorDeg;
+   double phaseMs[NUM_PHASES]; // mean time per move in each phase
+   long timeouts;
+   long retries;
+   long resyncs;
+   long rehomes;
+};
+
+// Collects move times and position errors, closes them into windows, and
+// reports how the windows drift over the run. The phase split tells the two
+// kinds of slowdown apart: a wearing mechanism shows up in the completion
+// phase, a software or USB slowdown in the command and verify phases.
+class SoakRecorder
+{
+public:
+   SoakRecorder();
+
+   void Begin(const SoakCounters& totals);
+   void AddMove(double ms, bool ok, double errorDeg);
+   bool WindowHasMoves() const;
+   void CloseWindow(double startHours, const SoakCounters& totals);
+
+   size_t Windows() const;
+   std::string Summary() const;
+   // one CSV row per window, then the summary as a comment line
+   void WriteReport(std::ostream& out) const;
+
+private:
+   std::string SummaryLocked() const;
+
+   mutable MMThreadLock lock_;
+   std::vector<SoakWindow> windows_;
+   // current window
+   SoakCounters start_;
+   std::vector<double> times_;
+   long failed_;
+   double errorSum_;
+   double maxError_;
+};
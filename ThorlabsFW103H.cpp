@@ -18,16 +18,135 @@
 
 #include "Thorlabs.MotionControl.Benchtop.StepperMotor.h"
 #include "ThorlabsFW103H.h"
+#include "KinesisDeviceManager.h"
+#include "MetricsExporter.h"
+#include "WheelServer.h"
+#include "KinesisBackend.h"
+#include "FaultInjection.h"
+#include "KinesisSimulator.h"
+#include "SoakReport.h"
+#include "SlotUsage.h"
+#include <fstream>
 #include <string>
 #include <math.h>
 #include "../../MMDevice/ModuleInterface.h"
 #include <sstream>
 #include <stdlib.h>
 #include <time.h>
+#include <algorithm>
+#include <random>
+#include <iomanip>
 
 const char* g_FilterWheelDeviceName = "FW103H Filter Wheel";
 const char* g_SerialNumberProp = "Serial Number";
 const char* g_PollProp = "Polling time (ms)";
+const char* g_ChannelProp = "Channel";
+const char* g_AsyncMovesProp = "Asynchronous moves";
+const char* g_KeepAliveProp = "Keep connection alive";
+const char* g_KeepAliveTimeoutProp = "Keep-alive timeout (s)";
+const char* g_NamedSettingsProp = "Named settings";
+const char* g_PersistSettingsProp = "Persist settings";
+const char* g_ModelProp = "Controller model";
+const char* g_FirmwareProp = "Controller firmware";
+const char* g_Persist = "Persist";
+const char* g_DiscoveryProp = "Discovery";
+const char* g_EnumerationTimeProp = "Discovery enumeration time (ms)";
+const char* g_OpenTimeProp = "Controller open time (ms)";
+const char* g_DirectOpen = "Direct open";
+const char* g_Enumerated = "Enumerated";
+const char* g_ContinuousProp = "Continuous rotation";
+const char* g_RotationRateProp = "Rotation rate (deg/s)";
+const char* g_DwellWindowProp = "Slot dwell window (deg)";
+const char* g_TriggerLineProp = "Trigger output line";
+const char* g_InPositionTriggerProp = "In-position trigger";
+const char* g_SequenceProp = "Sequence";
+const char* g_SequenceScheduleProp = "Sequence schedule";
+const char* g_SequenceTimebaseProp = "Sequence timebase";
+const char* g_SequenceFrameIntervalProp = "Sequence frame interval (ms)";
+const char* g_SequenceStepsProp = "Sequence steps completed";
+const char* g_SequenceJitterMeanProp = "Sequence jitter mean (ms)";
+const char* g_SequenceJitterStdProp = "Sequence jitter std dev (ms)";
+const char* g_SequenceJitterMaxProp = "Sequence jitter max (ms)";
+const char* g_SettleCalibrationProp = "Settle calibration";
+const char* g_AutoSettleProp = "Auto settle delay";
+const char* g_SettleMarginProp = "Settle margin (ms)";
+const char* g_SettleTableProp = "Settle table (ms)";
+const char* g_ArrivalVerificationProp = "Arrival verification";
+const char* g_VerifyPoll = "Position poll";
+const char* g_VerifyStatus = "Status bits";
+const char* g_VerifyEncoder = "Encoder";
+const char* g_Idle = "Idle";
+const char* g_Running = "Running";
+const char* g_TimebaseMs = "Time (ms)";
+const char* g_TimebaseFrames = "Frame index";
+const char* g_MotionStateProp = "Motion state";
+const char* g_StatusBitsProp = "Status bits";
+const char* g_MoveRetriesProp = "Move retry attempts";
+const char* g_RehomeRecoveryProp = "Re-home on move failure";
+const char* g_RetryCountProp = "Recovery retried moves";
+const char* g_ResyncCountProp = "Recovery resynchronized moves";
+const char* g_RehomeCountProp = "Recovery re-homes";
+const char* g_UnrecoveredCountProp = "Recovery failed moves";
+const char* g_HomingVelocityProp = "Homing velocity (deg/s)";
+const char* g_IdleRehomeProp = "Idle re-home on drift";
+const char* g_DriftThresholdProp = "Idle re-home drift threshold (deg)";
+const char* g_IdleQuietTimeProp = "Idle re-home quiet time (s)";
+const char* g_LastDriftProp = "Idle re-home last drift (deg)";
+const char* g_IdleRehomeCountProp = "Idle re-homes";
+const char* g_MetricsResetProp = "Metrics reset";
+const char* g_MetricsExportFileProp = "Metrics export file";
+const char* g_MetricsExportIntervalProp = "Metrics export interval (s)";
+const char* g_TelemetryProp = "Telemetry";
+const char* g_TelemetryIntervalProp = "Telemetry sample interval (ms)";
+const char* g_TelemetryDumpFileProp = "Telemetry dump file";
+const char* g_TelemetryDumpMovesProp = "Telemetry moves to dump";
+const char* g_TelemetryDumpProp = "Telemetry dump";
+const char* g_Dump = "Dump";
+const char* g_PublishStatusProp = "Publish shared status";
+const char* g_SharedStatusNameProp = "Shared status name";
+const char* g_ConnectionModeProp = "Connection mode";
+const char* g_ServerPipeProp = "Server pipe";
+const char* g_ServerRequestsProp = "Server requests served";
+const char* g_Direct = "Direct";
+const char* g_Server = "Server";
+const char* g_Client = "Client";
+const char* g_KinesisTraceProp = "Kinesis trace";
+const char* g_KinesisTraceFileProp = "Kinesis trace file";
+const char* g_ReplayTimingProp = "Kinesis replay timing";
+const char* g_SimulationProp = "Kinesis simulation";
+const char* g_TraceRecordsProp = "Kinesis trace records";
+const char* g_TraceDivergencesProp = "Kinesis replay divergences";
+const char* g_ReplayCheckProp = "Kinesis replay check";
+const char* g_ReplayCheckResultProp = "Kinesis replay check result";
+const char* g_Record = "Record";
+const char* g_Replay = "Replay";
+const char* g_Original = "Original";
+const char* g_Fast = "Fast";
+const char* g_FaultProfileProp = "Fault profile";
+const char* g_FaultSeedProp = "Fault seed";
+const char* g_Custom = "Custom";
+const char* g_StressMovesProp = "Fault stress moves";
+const char* g_StressTestProp = "Fault stress test";
+const char* g_StressReportProp = "Fault stress report";
+const char* g_StressP99LimitProp = "Fault stress p99 limit (ms)";
+const char* g_Run = "Run";
+const char* g_SoakProp = "Soak test";
+const char* g_SoakDurationProp = "Soak duration (h)";
+const char* g_SoakWindowProp = "Soak window (min)";
+const char* g_SoakReportFileProp = "Soak report file";
+const char* g_SoakWindowsProp = "Soak windows completed";
+const char* g_SoakSummaryProp = "Soak summary";
+const char* g_UsageFileProp = "Usage statistics file";
+const char* g_TransitionsProp = "Transitions recorded";
+const char* g_SlotPlacementProp = "Slot placement";
+const char* g_SlotPlacementReportProp = "Slot placement report";
+const char* g_Analyze = "Analyze";
+const char* g_ClockProp = "Clock";
+const char* g_System = "System";
+const char* g_Virtual = "Virtual";
+const char* g_Reset = "Reset";
+const char* g_Off = "Off";
+const char* g_On = "On";
 
 const int g_default_maxSpeed = 8000;
 const int g_move_timeout = 5000;  // timeout in ms for moving wheel positions
@@ -35,6 +154,198 @@ const double g_real_to_device_units = 7.0/9.0 + 1137;
 const double g_real_to_device_speed_units = 61083.979375;
 const int g_default_poll = 100; // device poll time in ms
 const int g_general_timeout = 10000;
+const double g_default_rotation_rate = 360.0; // continuous rotation rate in deg/s
+const double g_default_dwell_window = 5.0; // width of the trigger window around each slot centre in degrees
+const int g_continuous_sample_ms = 2; // how often the continuous worker samples the position
+const int g_num_digital_outputs = 4;
+const int g_max_channels = 3; // the largest benchtop stepper controller (BSC203) has three channels
+const double g_default_keep_alive_timeout = 300.0; // s an unused connection stays open in keep-alive mode
+// trigger switch bits: output trigger enabled (bit 1) and output high while moving (bit 3),
+// so the falling edge on Trig Out marks the moment the wheel settles in position
+const unsigned char g_in_position_trigger_bits = 0x02 | 0x08;
+const double g_default_frame_interval = 100.0; // ms per frame for frame-indexed schedules
+const int g_sequence_spin_ms = 2; // the sequence worker spins rather than sleeps this close to a step
+const int g_sequence_max_sleep_ms = 50; // keeps the worker responsive to a stop request
+const int g_settle_sample_ms = 2; // spacing of position samples while measuring settling
+const int g_settle_stable_samples = 5; // consecutive quiet samples that count as settled
+const long g_settle_tolerance = 2; // counts of movement still treated as quiet
+const int g_settle_repeats = 3; // moves per transition distance, the worst case is kept
+const double g_encoder_tolerance_deg = 0.5; // encoder agreement needed to accept an arrival
+
+enum VerifyMode
+{
+   VERIFY_POLL,
+   VERIFY_STATUS,
+   VERIFY_ENCODER
+};
+
+// Every operation on the wheel moves through these states; Fault is left by the next command
+enum MotionState
+{
+   MOTION_DISCONNECTED,
+   MOTION_IDLE,
+   MOTION_HOMING,
+   MOTION_MOVING,
+   MOTION_VERIFYING,
+   MOTION_SETTLING,
+   MOTION_FAULT
+};
+const char* g_MotionStateNames[] = {"Disconnected", "Idle", "Homing", "Moving", "Verifying", "Settling", "Fault"};
+
+// Kinesis message decoding
+const unsigned short g_msg_generic_motor = 2; // message type of motion notifications
+const unsigned short g_msg_homed = 0;
+const unsigned short g_msg_moved = 1;
+const unsigned short g_msg_stopped = 2;
+const int g_message_wait_ms = 10; // how often the message queue is checked while waiting
+const long g_default_move_retries = 2;
+const long g_max_move_retries = 10;
+const double g_max_homing_velocity = 360.0; // deg/s
+const double g_default_drift_threshold = 0.5; // deg between position counter and encoder
+const double g_default_idle_quiet_time = 10.0; // s without a move before the wheel counts as idle
+const int g_drift_check_ms = 1000;
+const int g_drift_wait_ms = 100; // keeps the drift worker responsive to a stop request
+const double g_default_metrics_export_interval = 15.0; // s, a typical scrape interval
+const size_t g_telemetry_samples = 65536; // about 5 min of moving at the default interval
+const size_t g_telemetry_moves = 1024;
+const long g_default_telemetry_interval = 5; // ms, a USB round trip to the controller takes a few ms
+const long g_max_telemetry_interval = 100;
+const double g_telemetry_tail_ms = 250.0; // keeps sampling after arrival to catch overshoot and settling
+const long g_default_telemetry_dump_moves = 10;
+const char* g_default_telemetry_file = "FW103H_telemetry.csv";
+const int g_client_connect_timeout = 5000; // ms to wait for a free server pipe instance
+const char* g_default_trace_file = "FW103H_trace.bin";
+const double g_sim_homing_rate = 10.0; // deg/s the simulated controller homes at unless set
+
+// Record passes calls to the controller and logs them; Replay plays a log back
+// without opening the controller
+enum KinesisTraceMode
+{
+   KINESIS_TRACE_OFF,
+   KINESIS_TRACE_RECORD,
+   KINESIS_TRACE_REPLAY
+};
+
+enum TraceStat
+{
+   TRACE_STAT_RECORDS,
+   TRACE_STAT_DIVERGENCES
+};
+
+const long g_default_stress_moves = 200;
+const long g_max_stress_moves = 100000;
+const double g_default_stress_p99_limit = 2000.0; // ms
+const double g_max_stress_p99_limit = 60000.0;
+const double g_default_soak_hours = 1.0;
+const double g_max_soak_hours = 1000.0;
+const double g_default_soak_window = 10.0; // min
+const double g_min_soak_window = 0.1;
+const double g_max_soak_window = 1440.0;
+const long g_usage_save_interval = 100; // transitions between saves of the usage file
+const char* g_default_soak_file = "FW103H_soak.csv";
+
+enum FaultStat
+{
+   FAULT_STALLS,
+   FAULT_DROPPED,
+   FAULT_DUPLICATED,
+   FAULT_FAILED,
+   NUM_FAULT_STATS
+};
+const char* g_FaultStatProps[] = {"Fault stalls injected", "Fault messages dropped", "Fault messages duplicated", "Fault calls failed"};
+
+// the FaultProfile fields, editable on their own
+enum FaultParam
+{
+   FAULT_CALL_LATENCY,
+   FAULT_STALL_PROBABILITY,
+   FAULT_STALL_MS,
+   FAULT_MESSAGE_DELAY,
+   FAULT_DROP_PROBABILITY,
+   FAULT_DUPLICATE_PROBABILITY,
+   FAULT_FAIL_PROBABILITY,
+   FAULT_FAIL_ERROR,
+   NUM_FAULT_PARAMS
+};
+const char* g_FaultParamProps[] = {"Fault call latency mean (ms)", "Fault stall probability", "Fault stall (ms)", "Fault message delay mean (ms)",
+   "Fault drop probability", "Fault duplicate probability", "Fault fail probability", "Fault fail error"};
+const double g_max_fault_ms = 60000.0;
+const long g_max_fault_error = 32767; // Kinesis error codes are shorts; 0 would not fail
+
+// Direct owns the controller alone; Server owns it and also serves other processes
+// over a named pipe; Client leaves the controller to a server and forwards to it
+enum ConnectionMode
+{
+   CONNECTION_DIRECT,
+   CONNECTION_SERVER,
+   CONNECTION_CLIENT
+};
+
+// Status word of the benchtop stepper controllers
+const unsigned long g_status_limit_cw = 0x00000001;
+const unsigned long g_status_limit_ccw = 0x00000002;
+const unsigned long g_status_moving_cw = 0x00000010;
+const unsigned long g_status_moving_ccw = 0x00000020;
+const unsigned long g_status_connected = 0x00000100;
+const unsigned long g_status_homing = 0x00000200;
+const unsigned long g_status_homed = 0x00000400;
+const unsigned long g_status_enabled = 0x80000000;
+
+enum RecoveryStat
+{
+   RECOVERY_RETRIES,
+   RECOVERY_RESYNCS,
+   RECOVERY_REHOMES,
+   RECOVERY_FAILURES
+};
+
+enum DriftStat
+{
+   DRIFT_LAST,
+   DRIFT_REHOMES
+};
+
+enum MetricField
+{
+   METRIC_MOVES,
+   METRIC_TIMEOUTS,
+   METRIC_LAST_MOVE,
+   METRIC_MEAN_MOVE,
+   METRIC_P99_MOVE,
+   METRIC_COMMAND_PHASE,
+   METRIC_COMPLETION_PHASE,
+   METRIC_VERIFY_PHASE,
+   METRIC_HOMING,
+   METRIC_MESSAGES,
+   NUM_METRICS
+};
+const char* g_MetricProps[] = {"Metrics moves", "Metrics timeouts", "Metrics move latency last (ms)",
+   "Metrics move latency mean (ms)", "Metrics move latency p99 (ms)", "Metrics command phase mean (ms)",
+   "Metrics completion phase mean (ms)", "Metrics verify phase mean (ms)", "Metrics time homing (ms)",
+   "Metrics messages processed"};
+
+enum StatusField
+{
+   STATUS_MOVING_CW,
+   STATUS_MOVING_CCW,
+   STATUS_HOMING,
+   STATUS_HOMED,
+   STATUS_LIMIT_CW,
+   STATUS_LIMIT_CCW,
+   STATUS_CONNECTED,
+   STATUS_ENABLED,
+   STATUS_NUM_FIELDS
+};
+const char* g_StatusFieldProps[] = {"Status moving CW", "Status moving CCW", "Status homing", "Status homed",
+   "Status CW limit", "Status CCW limit", "Status motor connected", "Status enabled"};
+
+enum SequenceStat
+{
+   SEQ_STEPS,
+   SEQ_JITTER_MEAN,
+   SEQ_JITTER_STD,
+   SEQ_JITTER_MAX
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 // Exported MMDevice API
@@ -79,7 +390,74 @@ ThorlabsFilterWheel::ThorlabsFilterWheel() ://char* SerialNumber) :
    position_(0),
    homed_(false),
 	polltime_(g_default_poll),
-   maxSpeed_(g_default_maxSpeed)
+   maxSpeed_(g_default_maxSpeed),
+   speed_(g_default_maxSpeed),
+   continuous_(false),
+   rotationRate_(g_default_rotation_rate),
+   dwellWindow_(g_default_dwell_window),
+   triggerLine_(1),
+   triggerHigh_(false),
+   anchorAngle_(0.0),
+   anchorMs_(0.0),
+   anchorRate_(0.0),
+   positionRequestMs_(0.0),
+   positionRequested_(false),
+   continuousThread_(0),
+   inPositionTrigger_(false),
+   savedTriggerSwitches_(0),
+   sequenceFrames_(false),
+   sequenceFrameInterval_(g_default_frame_interval),
+   sequenceStepsDone_(0),
+   sequenceThread_(0),
+   autoSettle_(false),
+   settleMargin_(0.0),
+   lastDistance_(0),
+   arrivedTime_(0.0),
+   verifyMode_(VERIFY_STATUS),
+   encoderRatio_(0.0),
+   encoderAvailable_(true),
+   clock_(&systemClock_),
+   channel_(0),
+   channelNumber_(1),
+   backend_(0),
+   traceMode_(KINESIS_TRACE_OFF),
+   traceFile_(g_default_trace_file),
+   replayFast_(false),
+   simulate_(false),
+   replay_(0),
+   faults_(0),
+   faultProfile_(g_FaultProfiles[0]),
+   faultSeed_(1),
+   stressMoves_(g_default_stress_moves),
+   stressP99LimitMs_(g_default_stress_p99_limit),
+   soakHours_(g_default_soak_hours),
+   soakWindowMin_(g_default_soak_window),
+   soakReportFile_(g_default_soak_file),
+   soakThread_(0),
+   keepAlive_(false),
+   keepAliveTimeout_(g_default_keep_alive_timeout),
+   motionState_(MOTION_DISCONNECTED),
+   moveRetries_(g_default_move_retries),
+   rehomeRecovery_(true),
+   homingVelocity_(0.0),
+   idleRehome_(false),
+   driftThreshold_(g_default_drift_threshold),
+   idleQuietTime_(g_default_idle_quiet_time),
+   lastDrift_(0.0),
+   idleRehomeThread_(0),
+   metricsExportInterval_(g_default_metrics_export_interval),
+   metricsExportThread_(0),
+   telemetry_(g_telemetry_samples, g_telemetry_moves),
+   telemetryEnabled_(false),
+   telemetryInterval_(g_default_telemetry_interval),
+   telemetryDumpFile_(g_default_telemetry_file),
+   telemetryDumpMoves_(g_default_telemetry_dump_moves),
+   telemetryThread_(0),
+   publishStatus_(false),
+   connectionMode_(CONNECTION_DIRECT),
+   serverThread_(0),
+   asyncMoves_(false),
+   moveThread_(0)
 {
    InitializeDefaultErrorMessages();
    // set device specific error messages
@@ -90,6 +468,18 @@ ThorlabsFilterWheel::ThorlabsFilterWheel() ://char* SerialNumber) :
    SetErrorText(ERR_MOVE_MSG_TIMEOUT, "Timed out waiting for message response after issuing move command.");
 	SetErrorText(ERR_HOME_TIMEOUT, "Timed out during home command.");
 	SetErrorText(ERR_POLL_CHANGE_FORBIDDEN, "Poll time change forbidden");
+   SetErrorText(ERR_CONTINUOUS_ACTIVE, "Operation not allowed while the wheel is in continuous rotation.");
+   SetErrorText(ERR_CONTINUOUS_FAILED, "Timed out waiting for the wheel to stop after continuous rotation.");
+   SetErrorText(ERR_INVALID_SEQUENCE, "Invalid sequence schedule: expected entries of the form slot@time separated by ';' with non-decreasing times.");
+   SetErrorText(ERR_SEQUENCE_RUNNING, "Operation not allowed while a sequence is running.");
+   SetErrorText(ERR_SETTLE_TIMEOUT, "Timed out waiting for the wheel to settle during calibration.");
+   SetErrorText(ERR_INVALID_CHANNEL, "The controller does not have the requested channel.");
+   SetErrorText(ERR_MOTION_STOPPED, "The wheel stopped before reaching its target.");
+   SetErrorText(ERR_SERVER_UNAVAILABLE, "Could not reach the process serving this wheel.");
+   SetErrorText(ERR_TRACE_FILE, "Could not read the Kinesis trace file to replay.");
+   SetErrorText(ERR_SOAK_RUNNING, "Command not possible while a soak, stress test or settle calibration is running.");
+   SetErrorText(ERR_VIRTUAL_CLOCK, "The virtual clock can only be used to replay a Kinesis trace or with the simulated controller.");
+   SetErrorText(ERR_MOVE_REJECTED, "The controller did not accept the move command.");
 
    // Serial Number
    CPropertyAction* pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSerialNumber);
@@ -99,12 +489,103 @@ ThorlabsFilterWheel::ThorlabsFilterWheel() ://char* SerialNumber) :
 	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnPollTime);
    CreateProperty(g_PollProp, CDeviceUtils::ConvertToString(polltime_), MM::Integer, false, pAct, true);
 
+	// Controller channel, several wheels can share one benchtop controller
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnChannel);
+   CreateProperty(g_ChannelProp, CDeviceUtils::ConvertToString(channelNumber_), MM::Integer, false, pAct, true);
+   SetPropertyLimits(g_ChannelProp, 1, g_max_channels);
+
+	// Keep-alive: a later Initialize, of this or another wheel on the controller,
+	// reuses the open, homed connection while any wheel device still exists
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnKeepAlive);
+   CreateProperty(g_KeepAliveProp, g_Off, MM::String, false, pAct, true);
+   AddAllowedValue(g_KeepAliveProp, g_Off);
+   AddAllowedValue(g_KeepAliveProp, g_On);
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnKeepAliveTimeout);
+   CreateProperty(g_KeepAliveTimeoutProp, CDeviceUtils::ConvertToString(keepAliveTimeout_), MM::Float, false, pAct, true);
+
+	// Named settings from the Kinesis settings file, applied when the device opens
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnNamedSettings);
+   CreateProperty(g_NamedSettingsProp, "", MM::String, false, pAct, true);
+
+	// Homing velocity, applied before every home including the one at startup
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnHomingVelocity);
+   CreateProperty(g_HomingVelocityProp, CDeviceUtils::ConvertToString(homingVelocity_), MM::Float, false, pAct, true);
+   SetPropertyLimits(g_HomingVelocityProp, 0.0, g_max_homing_velocity);
+
+	// Metrics export in Prometheus text format, off unless a file is given
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMetricsExportFile);
+   CreateProperty(g_MetricsExportFileProp, "", MM::String, false, pAct, true);
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMetricsExportInterval);
+   CreateProperty(g_MetricsExportIntervalProp, CDeviceUtils::ConvertToString(metricsExportInterval_), MM::Float, false, pAct, true);
+
+	// Transition counts, kept across sessions when a file is given
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnUsageFile);
+   CreateProperty(g_UsageFileProp, "", MM::String, false, pAct, true);
+
+	// Status published in shared memory for scripts and dashboards
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnPublishStatus);
+   CreateProperty(g_PublishStatusProp, g_Off, MM::String, false, pAct, true);
+   AddAllowedValue(g_PublishStatusProp, g_Off);
+   AddAllowedValue(g_PublishStatusProp, g_On);
+
+	// Sharing the wheel: SBC_Open is exclusive, so one process serves the others
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnConnectionMode);
+   CreateProperty(g_ConnectionModeProp, g_Direct, MM::String, false, pAct, true);
+   AddAllowedValue(g_ConnectionModeProp, g_Direct, CONNECTION_DIRECT);
+   AddAllowedValue(g_ConnectionModeProp, g_Server, CONNECTION_SERVER);
+   AddAllowedValue(g_ConnectionModeProp, g_Client, CONNECTION_CLIENT);
+
+	// Virtual time runs timeouts without waiting them out, for replay and simulated runs
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnClock);
+   CreateProperty(g_ClockProp, g_System, MM::String, false, pAct, true);
+   AddAllowedValue(g_ClockProp, g_System);
+   AddAllowedValue(g_ClockProp, g_Virtual);
+
+	// Kinesis call trace, for reproducing timing problems offline
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnKinesisTrace);
+   CreateProperty(g_KinesisTraceProp, g_Off, MM::String, false, pAct, true);
+   AddAllowedValue(g_KinesisTraceProp, g_Off, KINESIS_TRACE_OFF);
+   AddAllowedValue(g_KinesisTraceProp, g_Record, KINESIS_TRACE_RECORD);
+   AddAllowedValue(g_KinesisTraceProp, g_Replay, KINESIS_TRACE_REPLAY);
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnKinesisTraceFile);
+   CreateProperty(g_KinesisTraceFileProp, traceFile_.c_str(), MM::String, false, pAct, true);
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnReplayTiming);
+   CreateProperty(g_ReplayTimingProp, g_Original, MM::String, false, pAct, true);
+   AddAllowedValue(g_ReplayTimingProp, g_Original);
+   AddAllowedValue(g_ReplayTimingProp, g_Fast);
+
+	// Simulated controller, for soak and fault runs without hardware
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSimulation);
+   CreateProperty(g_SimulationProp, g_Off, MM::String, false, pAct, true);
+   AddAllowedValue(g_SimulationProp, g_Off);
+   AddAllowedValue(g_SimulationProp, g_On);
+
    EnableDelay(); // signals that the dealy setting will be used
+
+   continuousThread_ = new ContinuousRotationThread(this);
+   sequenceThread_ = new SequenceThread(this);
+   soakThread_ = new SoakThread(this);
+   moveThread_ = new MoveThread(this);
+   idleRehomeThread_ = new IdleRehomeThread(this);
+   metricsExportThread_ = new MetricsExportThread(&metrics_);
+   telemetryThread_ = new TelemetryThread(this);
+   serverThread_ = new WheelServerThread(this);
+   KinesisDeviceManager::Instance().AddUser();
 }
 
 ThorlabsFilterWheel::~ThorlabsFilterWheel()
 {
    Shutdown();
+   delete continuousThread_;
+   delete sequenceThread_;
+   delete soakThread_;
+   delete moveThread_;
+   delete idleRehomeThread_;
+   delete metricsExportThread_;
+   delete telemetryThread_;
+   delete serverThread_;
+   // the last wheel closes any kept-alive channel rather than leaving it to unload
+   KinesisDeviceManager::Instance().RemoveUser();
 }
 
 void ThorlabsFilterWheel::GetName(char* Name) const
@@ -117,6 +598,9 @@ int ThorlabsFilterWheel::Initialize()
 {
    if (initialized_)
       return DEVICE_OK;
+   // virtual time only moves when the adapter sleeps, a real controller would time out
+   if (clock_ == &virtualClock_ && traceMode_ != KINESIS_TRACE_REPLAY && !simulate_)
+      return ERR_VIRTUAL_CLOCK;
 
 	// define error text
 	SetErrorText(ERR_HOME_TIMEOUT, "Device timed-out: no response received within expected time interval after homing.");
@@ -136,7 +620,7 @@ int ThorlabsFilterWheel::Initialize()
 		return ret;
 
 	// Set timer for the Busy signal, or we'll get a time-out the first time we check the state of the shutter, for good measure, go back 'delay' time into the past
-	changedTime_ = GetCurrentMMTime();   
+	changedTime_ = GetClockTime().getUsec();   
 
 	// create default positions and labels
 	const int bufSize = 1024;
@@ -155,13 +639,16 @@ int ThorlabsFilterWheel::Initialize()
 	if (ret != DEVICE_OK)
 		return ret;
 
-	// Speed
+	// Speed, a controller setting and so left to the server in client mode
 	// -----
-	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSpeed);
-	ret = CreateProperty(MM::g_Keyword_Speed, CDeviceUtils::ConvertToString(maxSpeed_), MM::Integer, false, pAct);
-	if (ret != DEVICE_OK)
-		return ret;
-	SetPropertyLimits(MM::g_Keyword_Speed, 1, maxSpeed_);
+	if (connectionMode_ != CONNECTION_CLIENT)
+	{
+		pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSpeed);
+		ret = CreateProperty(MM::g_Keyword_Speed, CDeviceUtils::ConvertToString(maxSpeed_), MM::Integer, false, pAct);
+		if (ret != DEVICE_OK)
+			return ret;
+		SetPropertyLimits(MM::g_Keyword_Speed, 1, maxSpeed_);
+	}
 
 	// Label
 	// -----
@@ -170,6 +657,289 @@ int ThorlabsFilterWheel::Initialize()
 	if (ret != DEVICE_OK)
 		return ret;
 
+	// Asynchronous moves
+	// ------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnAsyncMoves);
+	ret = CreateProperty(g_AsyncMovesProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_AsyncMovesProp, g_Off);
+	AddAllowedValue(g_AsyncMovesProp, g_On);
+
+	// Thin client: moves and status go to the process that owns the controller,
+	// everything that configures the controller stays with that process
+	if (connectionMode_ == CONNECTION_CLIENT)
+	{
+		std::string pipeName = WheelPipeName(serialNumber_, channelNumber_);
+		WheelResponse status;
+		if (client_.Connect(pipeName, g_client_connect_timeout) != DEVICE_OK || client_.Status(status) != DEVICE_OK)
+		{
+			LogMessage("No server for this wheel on " + pipeName);
+			client_.Close();
+			return ERR_SERVER_UNAVAILABLE;
+		}
+		position_ = status.position;
+		motionState_ = MOTION_IDLE;
+		pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMotionState);
+		ret = CreateProperty(g_MotionStateProp, g_MotionStateNames[motionState_], MM::String, true, pAct);
+		if (ret != DEVICE_OK)
+			return ret;
+		ret = CreateProperty(g_ServerPipeProp, pipeName.c_str(), MM::String, true);
+		if (ret != DEVICE_OK)
+			return ret;
+		ret = UpdateStatus();
+		if (ret != DEVICE_OK)
+			return ret;
+		initialized_ = true;
+		return DEVICE_OK;
+	}
+
+	// Continuous rotation
+	// -------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnContinuous);
+	ret = CreateProperty(g_ContinuousProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_ContinuousProp, g_Off);
+	AddAllowedValue(g_ContinuousProp, g_On);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnRotationRate);
+	ret = CreateProperty(g_RotationRateProp, CDeviceUtils::ConvertToString(rotationRate_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_RotationRateProp, 1, maxSpeed_);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnDwellWindow);
+	ret = CreateProperty(g_DwellWindowProp, CDeviceUtils::ConvertToString(dwellWindow_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_DwellWindowProp, 0, stepAngle_);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTriggerLine);
+	ret = CreateProperty(g_TriggerLineProp, CDeviceUtils::ConvertToString(triggerLine_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_TriggerLineProp, 1, g_num_digital_outputs);
+
+	// In-position trigger
+	// -------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnInPositionTrigger);
+	ret = CreateProperty(g_InPositionTriggerProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_InPositionTriggerProp, g_Off);
+	AddAllowedValue(g_InPositionTriggerProp, g_On);
+
+	// Sequence engine
+	// ---------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSequence);
+	ret = CreateProperty(g_SequenceProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SequenceProp, g_Idle);
+	AddAllowedValue(g_SequenceProp, g_Running);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSequenceSchedule);
+	ret = CreateProperty(g_SequenceScheduleProp, sequenceSchedule_.c_str(), MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSequenceTimebase);
+	ret = CreateProperty(g_SequenceTimebaseProp, g_TimebaseMs, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SequenceTimebaseProp, g_TimebaseMs);
+	AddAllowedValue(g_SequenceTimebaseProp, g_TimebaseFrames);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSequenceFrameInterval);
+	ret = CreateProperty(g_SequenceFrameIntervalProp, CDeviceUtils::ConvertToString(sequenceFrameInterval_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	CPropertyActionEx* pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnSequenceStat, SEQ_STEPS);
+	ret = CreateProperty(g_SequenceStepsProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnSequenceStat, SEQ_JITTER_MEAN);
+	ret = CreateProperty(g_SequenceJitterMeanProp, "0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnSequenceStat, SEQ_JITTER_STD);
+	ret = CreateProperty(g_SequenceJitterStdProp, "0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnSequenceStat, SEQ_JITTER_MAX);
+	ret = CreateProperty(g_SequenceJitterMaxProp, "0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Settle delay
+	// ------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSettleCalibration);
+	ret = CreateProperty(g_SettleCalibrationProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SettleCalibrationProp, g_Idle);
+	AddAllowedValue(g_SettleCalibrationProp, g_Run);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnAutoSettle);
+	ret = CreateProperty(g_AutoSettleProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_AutoSettleProp, g_Off);
+	AddAllowedValue(g_AutoSettleProp, g_On);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSettleMargin);
+	ret = CreateProperty(g_SettleMarginProp, CDeviceUtils::ConvertToString(settleMargin_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSettleTable);
+	ret = CreateProperty(g_SettleTableProp, "", MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Arrival verification
+	// --------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnArrivalVerification);
+	ret = CreateProperty(g_ArrivalVerificationProp, g_VerifyStatus, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_ArrivalVerificationProp, g_VerifyPoll, VERIFY_POLL);
+	AddAllowedValue(g_ArrivalVerificationProp, g_VerifyStatus, VERIFY_STATUS);
+	AddAllowedValue(g_ArrivalVerificationProp, g_VerifyEncoder, VERIFY_ENCODER);
+
+	// Motion state
+	// ------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMotionState);
+	ret = CreateProperty(g_MotionStateProp, g_MotionStateNames[MOTION_DISCONNECTED], MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Status bits
+	// -----------
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnStatusField, -1);
+	ret = CreateProperty(g_StatusBitsProp, "0x00000000", MM::String, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	for (long field = 0; field < STATUS_NUM_FIELDS; field++)
+	{
+		pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnStatusField, field);
+		ret = CreateProperty(g_StatusFieldProps[field], "0", MM::Integer, true, pActEx);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	// Move recovery
+	// -------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMoveRetries);
+	ret = CreateProperty(g_MoveRetriesProp, CDeviceUtils::ConvertToString(moveRetries_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_MoveRetriesProp, 0, g_max_move_retries);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnRehomeRecovery);
+	ret = CreateProperty(g_RehomeRecoveryProp, g_On, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_RehomeRecoveryProp, g_Off);
+	AddAllowedValue(g_RehomeRecoveryProp, g_On);
+
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnRecoveryStat, RECOVERY_RETRIES);
+	ret = CreateProperty(g_RetryCountProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnRecoveryStat, RECOVERY_RESYNCS);
+	ret = CreateProperty(g_ResyncCountProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnRecoveryStat, RECOVERY_REHOMES);
+	ret = CreateProperty(g_RehomeCountProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnRecoveryStat, RECOVERY_FAILURES);
+	ret = CreateProperty(g_UnrecoveredCountProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Metrics
+	// -------
+	for (long metric = 0; metric < NUM_METRICS; metric++)
+	{
+		bool count = (metric == METRIC_MOVES || metric == METRIC_TIMEOUTS || metric == METRIC_MESSAGES);
+		pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnMetric, metric);
+		ret = CreateProperty(g_MetricProps[metric], "0", count ? MM::Integer : MM::Float, true, pActEx);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnMetricsReset);
+	ret = CreateProperty(g_MetricsResetProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_MetricsResetProp, g_Idle);
+	AddAllowedValue(g_MetricsResetProp, g_Reset);
+
+	// Telemetry
+	// ---------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTelemetry);
+	ret = CreateProperty(g_TelemetryProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_TelemetryProp, g_Off);
+	AddAllowedValue(g_TelemetryProp, g_On);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTelemetryInterval);
+	ret = CreateProperty(g_TelemetryIntervalProp, CDeviceUtils::ConvertToString(telemetryInterval_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_TelemetryIntervalProp, 1, g_max_telemetry_interval);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTelemetryDumpFile);
+	ret = CreateProperty(g_TelemetryDumpFileProp, telemetryDumpFile_.c_str(), MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTelemetryDumpMoves);
+	ret = CreateProperty(g_TelemetryDumpMovesProp, CDeviceUtils::ConvertToString(telemetryDumpMoves_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_TelemetryDumpMovesProp, 1, (long)g_telemetry_moves);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTelemetryDump);
+	ret = CreateProperty(g_TelemetryDumpProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_TelemetryDumpProp, g_Idle);
+	AddAllowedValue(g_TelemetryDumpProp, g_Dump);
+
+	// Idle re-homing
+	// --------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnIdleRehome);
+	ret = CreateProperty(g_IdleRehomeProp, g_Off, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_IdleRehomeProp, g_Off);
+	AddAllowedValue(g_IdleRehomeProp, g_On);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnDriftThreshold);
+	ret = CreateProperty(g_DriftThresholdProp, CDeviceUtils::ConvertToString(driftThreshold_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnIdleQuietTime);
+	ret = CreateProperty(g_IdleQuietTimeProp, CDeviceUtils::ConvertToString(idleQuietTime_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnDriftStat, DRIFT_LAST);
+	ret = CreateProperty(g_LastDriftProp, "0", MM::Float, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+	pActEx = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnDriftStat, DRIFT_REHOMES);
+	ret = CreateProperty(g_IdleRehomeCountProp, "0", MM::Integer, true, pActEx);
+	if (ret != DEVICE_OK)
+		return ret;
+
 	// DEBUGGING serial number list //
 	/* TLI_BuildDeviceList();
 	short n = TLI_GetDeviceListSize();
@@ -188,20 +958,225 @@ int ThorlabsFilterWheel::Initialize()
 	// initialise hardware
 	int init_ret = Kinesis_Initialize(g_move_timeout);
 	if (init_ret != DEVICE_OK){
-		printf("Failed to initialise FW103H device %s\n", serialNumber_.c_str());
+		LogMessage("Failed to initialise FW103H device " + serialNumber_, true);
 		return init_ret;
 	}
 	// Now get the current speed of the wheel
 	double init_speed = Kinesis_GetSpeed();
 	LogMessage("Initial speed (and max speed in real units?) is " + std::to_string((long double)init_speed));
-	printf("speed: %.2f \n", init_speed);
+	char speedMsg[40];
+	sprintf(speedMsg, "speed: %.2f", init_speed);
+	LogMessage(speedMsg, true);
 
 	// bother setting speed? meh
 
+	if (traceMode_ != KINESIS_TRACE_OFF)
+	{
+		CPropertyActionEx* pActTrace = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnTraceStat, TRACE_STAT_RECORDS);
+		ret = CreateProperty(g_TraceRecordsProp, "0", MM::Integer, true, pActTrace);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (traceMode_ == KINESIS_TRACE_REPLAY)
+		{
+			pActTrace = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnTraceStat, TRACE_STAT_DIVERGENCES);
+			ret = CreateProperty(g_TraceDivergencesProp, "0", MM::Integer, true, pActTrace);
+			if (ret != DEVICE_OK)
+				return ret;
+			pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnReplayCheck);
+			ret = CreateProperty(g_ReplayCheckProp, g_Idle, MM::String, false, pAct);
+			if (ret != DEVICE_OK)
+				return ret;
+			AddAllowedValue(g_ReplayCheckProp, g_Idle);
+			AddAllowedValue(g_ReplayCheckProp, g_Run);
+			pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnReplayCheckResult);
+			ret = CreateProperty(g_ReplayCheckResultProp, "", MM::String, true, pAct);
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+	}
+
+	// Fault injection and stress test
+	// -------------------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnFaultProfile);
+	ret = CreateProperty(g_FaultProfileProp, faultProfile_.name, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	for (long profile = 0; profile < g_NumFaultProfiles; profile++)
+		AddAllowedValue(g_FaultProfileProp, g_FaultProfiles[profile].name, profile);
+	AddAllowedValue(g_FaultProfileProp, g_Custom, g_NumFaultProfiles);
+
+	// the profile sets these, changing one makes the profile Custom
+	for (long param = 0; param < NUM_FAULT_PARAMS; param++)
+	{
+		CPropertyActionEx* pActParam = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnFaultParam, param);
+		bool isError = (param == FAULT_FAIL_ERROR);
+		ret = CreateProperty(g_FaultParamProps[param], isError ? CDeviceUtils::ConvertToString((long)faultProfile_.failError) : "0", isError ? MM::Integer : MM::Float, false, pActParam);
+		if (ret != DEVICE_OK)
+			return ret;
+		if (isError)
+			SetPropertyLimits(g_FaultParamProps[param], 1, g_max_fault_error);
+		else if (param == FAULT_CALL_LATENCY || param == FAULT_STALL_MS || param == FAULT_MESSAGE_DELAY)
+			SetPropertyLimits(g_FaultParamProps[param], 0.0, g_max_fault_ms);
+		else
+			SetPropertyLimits(g_FaultParamProps[param], 0.0, 1.0);
+	}
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnFaultSeed);
+	ret = CreateProperty(g_FaultSeedProp, CDeviceUtils::ConvertToString(faultSeed_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	for (long stat = 0; stat < NUM_FAULT_STATS; stat++)
+	{
+		CPropertyActionEx* pActFault = new CPropertyActionEx (this, &ThorlabsFilterWheel::OnFaultStat, stat);
+		ret = CreateProperty(g_FaultStatProps[stat], "0", MM::Integer, true, pActFault);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnStressMoves);
+	ret = CreateProperty(g_StressMovesProp, CDeviceUtils::ConvertToString(stressMoves_), MM::Integer, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_StressMovesProp, 1, g_max_stress_moves);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnStressP99Limit);
+	ret = CreateProperty(g_StressP99LimitProp, CDeviceUtils::ConvertToString(stressP99LimitMs_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_StressP99LimitProp, 1.0, g_max_stress_p99_limit);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnStressTest);
+	ret = CreateProperty(g_StressTestProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_StressTestProp, g_Idle);
+	AddAllowedValue(g_StressTestProp, g_Run);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnStressReport);
+	ret = CreateProperty(g_StressReportProp, "", MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Soak test: hours of back-to-back moves, reported per window
+	// ------------------------------------------------------------
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoak);
+	ret = CreateProperty(g_SoakProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SoakProp, g_Idle);
+	AddAllowedValue(g_SoakProp, g_Running);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoakDuration);
+	ret = CreateProperty(g_SoakDurationProp, CDeviceUtils::ConvertToString(soakHours_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_SoakDurationProp, 0.0, g_max_soak_hours);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoakWindow);
+	ret = CreateProperty(g_SoakWindowProp, CDeviceUtils::ConvertToString(soakWindowMin_), MM::Float, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	SetPropertyLimits(g_SoakWindowProp, g_min_soak_window, g_max_soak_window);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoakReportFile);
+	ret = CreateProperty(g_SoakReportFileProp, soakReportFile_.c_str(), MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoakWindows);
+	ret = CreateProperty(g_SoakWindowsProp, "0", MM::Integer, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSoakSummary);
+	ret = CreateProperty(g_SoakSummaryProp, "", MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Slot placement advice from the recorded transitions
+	// ---------------------------------------------------
+	usage_.Reset(numPos_);
+	if (!usageFile_.empty() && !usage_.Load(usageFile_, numPos_))
+		LogMessage("No usage statistics for this wheel in " + usageFile_ + ", starting from zero");
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnTransitions);
+	ret = CreateProperty(g_TransitionsProp, "0", MM::Integer, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSlotPlacement);
+	ret = CreateProperty(g_SlotPlacementProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_SlotPlacementProp, g_Idle);
+	AddAllowedValue(g_SlotPlacementProp, g_Analyze);
+	AddAllowedValue(g_SlotPlacementProp, g_Reset);
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnSlotPlacementReport);
+	ret = CreateProperty(g_SlotPlacementReportProp, "", MM::String, true, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// Controller settings
+	// -------------------
+	const TLI_HardwareInformation& hardwareInfo = channel_->Settings().HardwareInfo();
+	char model[9];
+	strncpy_s(model, hardwareInfo.modelNumber, 8);
+	model[8] = '\0';
+	ret = CreateProperty(g_ModelProp, model, MM::String, true);
+	if (ret != DEVICE_OK)
+		return ret;
+	std::ostringstream firmware;
+	firmware << ((hardwareInfo.firmwareVersion >> 16) & 0xFF) << "." << ((hardwareInfo.firmwareVersion >> 8) & 0xFF) << "." << (hardwareInfo.firmwareVersion & 0xFF);
+	ret = CreateProperty(g_FirmwareProp, firmware.str().c_str(), MM::String, true);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnPersistSettings);
+	ret = CreateProperty(g_PersistSettingsProp, g_Idle, MM::String, false, pAct);
+	if (ret != DEVICE_OK)
+		return ret;
+	AddAllowedValue(g_PersistSettingsProp, g_Idle);
+	AddAllowedValue(g_PersistSettingsProp, g_Persist);
+
+	// Discovery cost of the open that created this connection
+	DiscoveryRecord discovery;
+	if (KinesisDeviceManager::Instance().GetDiscoveryRecord(serialNumber_, discovery))
+	{
+		CreateProperty(g_DiscoveryProp, discovery.enumerated ? g_Enumerated : g_DirectOpen, MM::String, true);
+		CreateProperty(g_EnumerationTimeProp, CDeviceUtils::ConvertToString(discovery.enumerateMs), MM::Float, true);
+		CreateProperty(g_OpenTimeProp, CDeviceUtils::ConvertToString(discovery.openMs), MM::Float, true);
+	}
+
 	ret = UpdateStatus();
 	if (ret != DEVICE_OK)
 		return ret;
 
+	if (publishStatus_)
+	{
+		ret = sharedStatus_.Open(serialNumber_, channelNumber_, numPos_);
+		if (ret != DEVICE_OK)
+			LogMessage("Could not create the shared status segment");
+		CreateProperty(g_SharedStatusNameProp, sharedStatus_.Name().c_str(), MM::String, true);
+		PublishStatus();
+	}
+
+	if (!metricsExportFile_.empty())
+	{
+		std::ostringstream labels;
+		labels << "serial=\"" << serialNumber_ << "\",channel=\"" << channelNumber_ << "\"";
+		metricsExportThread_->Start(metricsExportFile_, labels.str(), (int)(metricsExportInterval_*1000.0));
+	}
+
+	if (connectionMode_ == CONNECTION_SERVER)
+	{
+		serverThread_->Start(WheelPipeName(serialNumber_, channelNumber_));
+		CreateProperty(g_ServerPipeProp, serverThread_->PipeName().c_str(), MM::String, true);
+		pAct = new CPropertyAction (this, &ThorlabsFilterWheel::OnServerRequests);
+		CreateProperty(g_ServerRequestsProp, "0", MM::Integer, true, pAct);
+	}
+
 	initialized_ = true;
 
 	return DEVICE_OK;
@@ -209,23 +1184,70 @@ int ThorlabsFilterWheel::Initialize()
 
 bool ThorlabsFilterWheel::Busy()
 {
-   MM::MMTime interval = GetCurrentMMTime() - changedTime_;
-   MM::MMTime delay(GetDelayMs()*1000.0);
-   if (interval < delay)
+   if (moveThread_->IsActive())
       return true;
-   else
-      return false;
+   // also covers moves started outside a property change, e.g. homing;
+   // continuous rotation never stops moving, so it is not reported
+   if (!continuous_ && IsMoving())
+      return true;
+   // calibrated delays run from arrival, the manual delay from the move command
+   MM::MMTime since(autoSettle_ ? arrivedTime_.load() : changedTime_.load());
+   MM::MMTime interval = GetClockTime() - since;
+   MM::MMTime delay(GetSettleDelayMs()*1000.0);
+   if (interval < delay)
+   {
+      // nothing else moves virtual time while the core polls; let the delay pass
+      if (clock_ != &virtualClock_)
+         return true;
+      clock_->SleepMs((delay - interval).getMsec());
+   }
+   if (motionState_ == MOTION_SETTLING)
+      SetMotionState(MOTION_IDLE);
+   return false;
 }
 
 
 int ThorlabsFilterWheel::Shutdown()
 {
-   if (initialized_)
+   // an Initialize that failed after opening the channel still holds it
+   bool wasInitialized = initialized_;
+   if (wasInitialized || channel_ != 0)
    {
       initialized_ = false;
-      // shutdown comms to device
-	  Kinesis_Shutdown();
-   }
+      // clients first, a request being served finishes through the queue as usual
+      serverThread_->Stop();
+      client_.Close();
+      // let the current step finish, then abandon the rest of the schedule
+      sequenceThread_->Stop();
+      soakThread_->Stop();
+      // the property reads Off until it is switched on again
+      idleRehomeThread_->Stop();
+      idleRehome_ = false;
+      metricsExportThread_->Stop();
+      telemetryThread_->Stop();
+      telemetryEnabled_ = false;
+      moveThread_->Join();
+      // workers are done, anything still queued finishes before the wheel is parked
+      CommandGuard command(commandQueue_);
+      // leave the wheel parked on a slot rather than spinning
+      if (continuous_)
+      {
+         Kinesis_StopContinuous();
+         continuous_ = false;
+      }
+      // hand the trigger output back in the state we found it
+      if (inPositionTrigger_)
+      {
+         Kinesis_SetInPositionTrigger(false);
+         inPositionTrigger_ = false;
+      }
+      // shutdown comms to device
+	  Kinesis_Shutdown();
+      // counts from a half-made Initialize would overwrite the saved ones
+      if (wasInitialized)
+         SaveUsage();
+      sharedStatus_.Close();
+   }
    return DEVICE_OK;
 }
 
@@ -237,33 +1259,70 @@ int ThorlabsFilterWheel::OnState(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
    if (eAct == MM::BeforeGet)
    {
-      printf("Getting position of Wheel device\n");
+      LogMessage("Getting position of Wheel device", true);
       // listen for input for pos?
+      // other clients of the server may have moved the wheel; skip the query
+      // while our own move holds the pipe
+      WheelResponse status;
+      if (connectionMode_ == CONNECTION_CLIENT && !moveThread_->IsActive() && client_.Status(status) == DEVICE_OK)
+         position_ = status.position;
       pProp->Set(position_);
       // nothing to do, let the caller to use cached property
    }
    else if (eAct == MM::AfterSet)
    {
-      // Set timer for the Busy signal
-      changedTime_ = GetCurrentMMTime();
+      if (continuous_)
+      {
+         pProp->Set(position_); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      if (sequenceThread_->IsActive())
+      {
+         pProp->Set(position_); // revert
+         return ERR_SEQUENCE_RUNNING;
+      }
+      if (soakThread_->IsActive())
+      {
+         pProp->Set(position_); // revert
+         return ERR_SOAK_RUNNING;
+      }
 
       long pos;
   
       pProp->Get(pos);
       //char* deviceName;
       //GetName(deviceName);
-      printf("Moving to position %ld\n", position_);
+      LogMessage("Moving to position " + std::to_string((long long)pos), true);
       if (pos >= numPos_ || pos < 0)
       {
          pProp->Set(position_); // revert
          return ERR_UNKNOWN_POSITION;
       }
+
+      // one move at a time per wheel; report a failed background move now
+      moveThread_->Join();
+      if (moveThread_->GetResult() != DEVICE_OK)
+         LogMessage("Previous move failed with error code " + std::to_string((long long)moveThread_->GetResult()));
+      if (IsFaulted())
+      {
+         char msg[64];
+         sprintf(msg, "Controller reports a fault, status 0x%08lX", GetMotorStatus().bits);
+         LogMessage(msg);
+      }
+
+      // Set timer for the Busy signal
+      changedTime_ = GetClockTime().getUsec();
+
+      if (asyncMoves_)
+      {
+         moveThread_->Start(pos);
+         return DEVICE_OK;
+      }
       // do actual moving
-		int ret = Kinesis_SetPosition(pos * stepAngle_, g_move_timeout);
+		int ret = MoveToSlot(pos);
       if (ret != 0){
 			return ret;
       }
-		position_ = pos;
    }
 
    return DEVICE_OK;
@@ -286,6 +1345,7 @@ int ThorlabsFilterWheel::OnSpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
       }
       // do actual speed change here!
       //
+		CommandGuard command(commandQueue_);
 		int ret = Kinesis_SetSpeed(speed);
 		if (ret != 0){ // error handling for speed change not implemented yet
 			LogMessage("Failed to set speed with error code " + std::to_string((long long)ret));
@@ -321,241 +1381,2975 @@ int ThorlabsFilterWheel::OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType
    return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::OnPollTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+int ThorlabsFilterWheel::OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	if (eAct == MM::BeforeGet)
-	{
-	// int polltime = SBC_PollingDuration(serialNumber_.c_str(), 1); // <- implement soon?
-		pProp->Set(polltime_);
-	}
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(channelNumber_);
+   }
    else if (eAct == MM::AfterSet)
    {
       if (initialized_)
       {
-         pProp->Set(polltime_);
-         return ERR_POLL_CHANGE_FORBIDDEN;
+         pProp->Set(channelNumber_); // revert
+         return DEVICE_CAN_NOT_SET_PROPERTY;
       }
-		// revert
-      pProp->Get(polltime_);
+      pProp->Get(channelNumber_);
    }
 
    return DEVICE_OK;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Kinesis API commands
-///////////////////////////////////////////////////////////////////////////////
+int ThorlabsFilterWheel::OnKeepAlive(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(keepAlive_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      keepAlive_ = (mode == g_On);
+   }
 
-int ThorlabsFilterWheel::Kinesis_Initialize(int timeout){
-// find device with serial number
-// Build list of connected device
-	bool deviceFound = 0;
-	if (TLI_BuildDeviceList() == 0)
-	{
-	// get device list size 
-		short n = TLI_GetDeviceListSize();
-		// get BBD serial numbers
-		char serialNos[100];
-		TLI_GetDeviceListByTypeExt(serialNos, 100, 40);
-		// output list of matching devices
-		char *searchContext = nullptr;
-		// split devices into tokens by comma
-		char *p = strtok_s(serialNos, ",", &searchContext);
-		int i = 0;
-		while (p != nullptr)
-		{
-			TLI_DeviceInfo deviceInfo;
-			// get device info from device
-			TLI_GetDeviceInfo(p, &deviceInfo);
-			// get strings from device info structure
-			char desc[65];
-			strncpy_s(desc, deviceInfo.description, 64);
-			desc[64] = '\0';
-			char serialNo[9];
-			strncpy_s(serialNo, deviceInfo.serialNo, 8);
-			serialNo[8] = '\0';
-			printf("serialNo %s\n", serialNo);
-			printf("serialNumber %s\n", serialNumber_.c_str());
-         // safer to use strncmp? Think about str lengths
-         if(strncmp(serialNo, serialNumber_.c_str(), 8) == 0){
-				printf("Found Device %s! : %s\r\n", serialNo, desc);
-				deviceFound = 1;
-         }
-         // next token in list
-         p = strtok_s(nullptr, ",", &searchContext);
-		}
-	}
-	// replace these with LogMessage sometime
-	printf("bool %d\n", deviceFound);
-	if (deviceFound) {
-		printf("device bool is true\n");
-	}
-    if(!(deviceFound)){
-		printf("Device not found\n");
-		return DEVICE_NOT_CONNECTED;
-    }
-   // open device
-   if(SBC_Open(serialNumber_.c_str()) == 0)
-   {
-		// start the device polling at [polltime_]ms intervals
-		SBC_StartPolling(serialNumber_.c_str(), 1, polltime_);
-
-		// enable device so that it can move
-		SBC_EnableChannel(serialNumber_.c_str(), 1);
-
-		Sleep(3000);
-		// Home device
-		Kinesis_Home();
-
-		// wait for completion
-			bool complete = 0;
-			int timeoutCounter = 0;
-			while(!complete)
-	  {
-		// wait for a message to arrive
-		while(SBC_MessageQueueSize(serialNumber_.c_str(), 1) == 0)
-		{
-			if (timeoutCounter * 100 > timeout){
-				return ERR_HOME_TIMEOUT;
-			}
-			Sleep(100);
-			timeoutCounter++;
-			
-		}
-		WORD messageType;
-		WORD messageId;
-		DWORD messageData;
-		SBC_GetNextMessage(serialNumber_.c_str(), 1, &messageType, &messageId, &messageData);
-		complete = (messageType == 2 || messageId == 1);
-	  }
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnKeepAliveTimeout(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(keepAliveTimeout_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double timeout;
+      pProp->Get(timeout);
+      if (timeout < 0)
+      {
+         pProp->Set(keepAliveTimeout_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      keepAliveTimeout_ = timeout;
    }
 
    return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::Kinesis_Home(){
-   // Home device
-   SBC_ClearMessageQueue(serialNumber_.c_str(), 1);
-   SBC_Home(serialNumber_.c_str(), 1);
-   printf("Device %s homing\r\n", serialNumber_.c_str());
-   return 0;
+int ThorlabsFilterWheel::OnNamedSettings(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(namedSettings_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(namedSettings_);
+   }
+
+   return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::Kinesis_SetPosition(double position, int timeout){
-   // move to position  (degrees) (channel 1)
-   double pos_start = SBC_GetPosition(serialNumber_.c_str(), 1);
-   // estimate how long we should give the wheel to move to the correct pos
-   int move_dist = Round(pos_start/g_real_to_device_units);
-   int expected_time_ms = 1000*Round((double)move_dist/(double)speed_);
-   int calculated_move_timeout = 2*expected_time_ms + polltime_;  // a bit arbitrary
-   printf("Move timeout %d\n", calculated_move_timeout);
-   
-   SBC_ClearMessageQueue(serialNumber_.c_str(), 1);
+int ThorlabsFilterWheel::OnPersistSettings(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      pProp->Set(g_Idle);
+      if (mode != g_Persist)
+         return DEVICE_OK;
+      // stores the current velocity and homing settings on the controller
+      CommandGuard command(commandQueue_);
+      int ret = channel_->Settings().Persist(*backend_);
+      if (ret != DEVICE_OK)
+      {
+         LogMessage("Failed to persist controller settings");
+         return ret;
+      }
+   }
 
-   int move_ret = SBC_MoveToPosition(serialNumber_.c_str(), 1, position*g_real_to_device_units);
-   if (move_ret != 0){
-	   printf("Device %s failed to move\r\n", serialNumber_.c_str());
-	   return move_ret;
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnAsyncMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(asyncMoves_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      asyncMoves_ = (mode == g_On);
    }
 
-   
-   printf("Device %s moving\r\n", serialNumber_.c_str());
+   return DEVICE_OK;
+}
 
-   // wait for completion
-   bool complete = 0;
-   int timeoutCounter = 0;
-   while(!complete)
-   {
-      // wait for a message to arrive
-      while(SBC_MessageQueueSize(serialNumber_.c_str(), 1) == 0)
-      {
-		   // time counter * 10ms
-		   if (timeoutCounter * 10 > timeout){
-            printf("Error responding in time\n");
-			   return ERR_MOVE_MSG_TIMEOUT;
-		   }
-		   Sleep(10);
-		   timeoutCounter++;
-			
-      }
-      WORD messageType;
-      WORD messageId;
-      DWORD messageData;
-      SBC_GetNextMessage(serialNumber_.c_str(), 1, &messageType, &messageId, &messageData);
-      complete = (messageType == 2 || messageId == 1);
-      // printf("Message data: %lu \n", messageData);
-      // printf("after getting message queue is %d msg long \n", SBC_MessageQueueSize(serialNumber_.c_str(), 1));
-   }
-   int moveTimeoutCounter = 0;
-   SBC_RequestPosition(serialNumber_.c_str(), 1);
-	Sleep(polltime_); //
-   double pos = SBC_GetPosition(serialNumber_.c_str(), 1);
-   while(Round((double)(pos/g_real_to_device_units)) != Round(position)){
-      SBC_RequestPosition(serialNumber_.c_str(), 1);
-      Sleep(polltime_);
-      moveTimeoutCounter++;
-      pos = SBC_GetPosition(serialNumber_.c_str(), 1);
-
-      // use calculated time as timeout
-      if (moveTimeoutCounter * 10 > g_general_timeout || moveTimeoutCounter * 10 > calculated_move_timeout){
-         printf("Error moving in time\n");
-	      return ERR_MOVE_TIMEOUT;
-		}
+int ThorlabsFilterWheel::OnMoveRetries(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(moveRetries_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(moveRetries_);
    }
 
-   printf("Time taken to move: %d\r\n", (timeoutCounter + moveTimeoutCounter) * 10); 
-   printf("Device %s moved to %d ", serialNumber_.c_str(), Round((double)(pos/g_real_to_device_units)) );
-   printf("at poll speed of %d ms\r\n", SBC_PollingDuration(serialNumber_.c_str(), 1));
-   
    return DEVICE_OK;
 }
 
+int ThorlabsFilterWheel::OnRehomeRecovery(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rehomeRecovery_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      rehomeRecovery_ = (mode == g_On);
+   }
 
-double ThorlabsFilterWheel::Kinesis_GetSpeed(){
-   int currentVelocity, currentAcceleration;
-   int ret;
-   ret = SBC_GetVelParams(serialNumber_.c_str(), 1, &currentAcceleration, &currentVelocity);
-   if (ret != 0){
-	   return ret;
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnRecoveryStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      switch (stat)
+      {
+         case RECOVERY_RETRIES: pProp->Set(metrics_.Retries()); break;
+         case RECOVERY_RESYNCS: pProp->Set(metrics_.Resyncs()); break;
+         case RECOVERY_REHOMES: pProp->Set(metrics_.Rehomes()); break;
+         case RECOVERY_FAILURES: pProp->Set(metrics_.FailedMoves()); break;
+      }
    }
-   //return currentVelocity;
-   return currentVelocity/g_real_to_device_speed_units;
+
+   return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::Kinesis_SetSpeed(int speed){
-   // value handling done at higher level (Thorlabs State Device)
-   if(speed > 0)
+int ThorlabsFilterWheel::OnHomingVelocity(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
    {
-		speed *= g_real_to_device_speed_units;
-		int currentVelocity, currentAcceleration;
-		int ret, retset;
-		ret = SBC_GetVelParams(serialNumber_.c_str(), 1, &currentAcceleration, &currentVelocity);
-		retset = SBC_SetVelParams(serialNumber_.c_str(), 1, currentAcceleration, speed);
-		if (ret){
-			return ret;
-		}
-      else if (retset != 0){
-			return retset;
+      pProp->Set(homingVelocity_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(homingVelocity_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnIdleRehome(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(idleRehome_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      idleRehome_ = (mode == g_On);
+      if (idleRehome_)
+         idleRehomeThread_->Start();
+      else
+         idleRehomeThread_->Stop();
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnDriftThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(driftThreshold_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double threshold;
+      pProp->Get(threshold);
+      if (threshold <= 0)
+      {
+         pProp->Set(driftThreshold_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
       }
+      driftThreshold_ = threshold;
    }
+
    return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::Kinesis_SendCmd(){
-   return ERROR_CALL_NOT_IMPLEMENTED;
+int ThorlabsFilterWheel::OnIdleQuietTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(idleQuietTime_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double quiet;
+      pProp->Get(quiet);
+      if (quiet < 0)
+      {
+         pProp->Set(idleQuietTime_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      idleQuietTime_ = quiet;
+   }
+
+   return DEVICE_OK;
 }
 
-int ThorlabsFilterWheel::Kinesis_Shutdown(){
-	// set back to max speed (default)
-   Kinesis_SetSpeed(maxSpeed_);
-	// stop polling
-   SBC_StopPolling(serialNumber_.c_str(), 1);
-   // close device
-   SBC_Close(serialNumber_.c_str());
+int ThorlabsFilterWheel::OnDriftStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      if (stat == DRIFT_LAST)
+         pProp->Set(lastDrift_);
+      else
+         pProp->Set(metrics_.IdleRehomes());
+   }
+
    return DEVICE_OK;
 }
 
-// Utils
-int ThorlabsFilterWheel::Round(double number){
-   return (int)floor(number + 0.5);
-}
\ No newline at end of file
+int ThorlabsFilterWheel::OnMetric(MM::PropertyBase* pProp, MM::ActionType eAct, long metric)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      switch (metric)
+      {
+         case METRIC_MOVES: pProp->Set(metrics_.Moves()); break;
+         case METRIC_TIMEOUTS: pProp->Set(metrics_.Timeouts()); break;
+         case METRIC_LAST_MOVE: pProp->Set(metrics_.LastMoveMs()); break;
+         case METRIC_MEAN_MOVE: pProp->Set(metrics_.MeanMoveMs()); break;
+         case METRIC_P99_MOVE: pProp->Set(metrics_.MoveQuantileMs(0.99)); break;
+         case METRIC_COMMAND_PHASE: pProp->Set(metrics_.MeanPhaseMs(PHASE_COMMAND)); break;
+         case METRIC_COMPLETION_PHASE: pProp->Set(metrics_.MeanPhaseMs(PHASE_COMPLETION)); break;
+         case METRIC_VERIFY_PHASE: pProp->Set(metrics_.MeanPhaseMs(PHASE_VERIFY)); break;
+         case METRIC_HOMING: pProp->Set(metrics_.HomingMs()); break;
+         case METRIC_MESSAGES: pProp->Set(metrics_.Messages()); break;
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnMetricsReset(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      pProp->Set(g_Idle);
+      if (mode == g_Reset)
+         metrics_.Reset();
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnMetricsExportFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(metricsExportFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(metricsExportFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnMetricsExportInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(metricsExportInterval_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double interval;
+      pProp->Get(interval);
+      if (interval <= 0)
+      {
+         pProp->Set(metricsExportInterval_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      metricsExportInterval_ = interval;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(telemetryEnabled_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      telemetryEnabled_ = (mode == g_On);
+      if (telemetryEnabled_)
+         telemetryThread_->Start(telemetryInterval_);
+      else
+         telemetryThread_->Stop();
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTelemetryInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(telemetryInterval_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(telemetryInterval_);
+      // the sampler picks up the new interval on restart
+      if (telemetryEnabled_)
+      {
+         telemetryThread_->Stop();
+         telemetryThread_->Start(telemetryInterval_);
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTelemetryDumpFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(telemetryDumpFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(telemetryDumpFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTelemetryDumpMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(telemetryDumpMoves_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(telemetryDumpMoves_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTelemetryDump(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      pProp->Set(g_Idle);
+      if (mode != g_Dump)
+         return DEVICE_OK;
+      std::ofstream out(telemetryDumpFile_.c_str(), std::ios::out | std::ios::trunc);
+      if (!out)
+      {
+         LogMessage("Could not open telemetry dump file " + telemetryDumpFile_);
+         return DEVICE_ERR;
+      }
+      int moves = telemetry_.WriteCsv(out, telemetryDumpMoves_, g_real_to_device_units);
+      LogMessage("Wrote telemetry of " + std::to_string((long long)moves) + " moves to " + telemetryDumpFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnPublishStatus(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(publishStatus_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      publishStatus_ = (mode == g_On);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnConnectionMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_Server)
+         connectionMode_ = CONNECTION_SERVER;
+      else if (mode == g_Client)
+         connectionMode_ = CONNECTION_CLIENT;
+      else
+         connectionMode_ = CONNECTION_DIRECT;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnServerRequests(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(serverThread_->RequestsServed());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnKinesisTrace(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_Record)
+         traceMode_ = KINESIS_TRACE_RECORD;
+      else if (mode == g_Replay)
+         traceMode_ = KINESIS_TRACE_REPLAY;
+      else
+         traceMode_ = KINESIS_TRACE_OFF;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnKinesisTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(traceFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(traceFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnReplayTiming(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(replayFast_ ? g_Fast : g_Original);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string timing;
+      pProp->Get(timing);
+      replayFast_ = (timing == g_Fast);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSimulation(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(simulate_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      simulate_ = (mode == g_On);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnReplayCheck(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode != g_Run)
+         return DEVICE_OK;
+      pProp->Set(g_Idle);
+      if (continuous_)
+         return ERR_CONTINUOUS_ACTIVE;
+      if (sequenceThread_->IsActive())
+         return ERR_SEQUENCE_RUNNING;
+      if (soakThread_->IsActive())
+         return ERR_SOAK_RUNNING;
+
+      // on the virtual clock the whole trace plays back without real waits
+      moveThread_->Join();
+      int ret = RunReplayCheck();
+      OnPropertyChanged(MM::g_Keyword_State, CDeviceUtils::ConvertToString(position_.load()));
+      OnPropertyChanged(g_ReplayCheckResultProp, replayCheck_.c_str());
+      return ret;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnReplayCheckResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(replayCheck_.c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnClock(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(clock_ == &virtualClock_ ? g_Virtual : g_System);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string clock;
+      pProp->Get(clock);
+      clock_ = (clock == g_Virtual) ? (WheelClock*)&virtualClock_ : (WheelClock*)&systemClock_;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnFaultProfile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(faultProfile_.name);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string name;
+      pProp->Get(name);
+      // choosing Custom keeps the fields as they are
+      for (long profile = 0; profile < g_NumFaultProfiles; profile++)
+      {
+         if (name == g_FaultProfiles[profile].name)
+            faultProfile_ = g_FaultProfiles[profile];
+      }
+      if (name == g_Custom)
+         faultProfile_.name = g_Custom;
+      for (long param = 0; param < NUM_FAULT_PARAMS; param++)
+      {
+         char value[MM::MaxStrLength];
+         GetProperty(g_FaultParamProps[param], value);
+         OnPropertyChanged(g_FaultParamProps[param], value);
+      }
+      // reseeding on every change makes a profile's run repeatable
+      if (faults_ != 0)
+         faults_->SetProfile(faultProfile_, (unsigned long)faultSeed_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnFaultSeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(faultSeed_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(faultSeed_);
+      if (faults_ != 0)
+         faults_->SetProfile(faultProfile_, (unsigned long)faultSeed_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnFaultParam(MM::PropertyBase* pProp, MM::ActionType eAct, long param)
+{
+   FaultProfile& profile = faultProfile_;
+   double* field = 0;
+   switch (param)
+   {
+   case FAULT_CALL_LATENCY: field = &profile.callLatencyMs; break;
+   case FAULT_STALL_PROBABILITY: field = &profile.stallProbability; break;
+   case FAULT_STALL_MS: field = &profile.stallMs; break;
+   case FAULT_MESSAGE_DELAY: field = &profile.messageDelayMs; break;
+   case FAULT_DROP_PROBABILITY: field = &profile.dropProbability; break;
+   case FAULT_DUPLICATE_PROBABILITY: field = &profile.duplicateProbability; break;
+   case FAULT_FAIL_PROBABILITY: field = &profile.failProbability; break;
+   }
+
+   if (eAct == MM::BeforeGet)
+   {
+      if (field != 0)
+         pProp->Set(*field);
+      else
+         pProp->Set((long)profile.failError);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      if (field != 0)
+         pProp->Get(*field);
+      else
+      {
+         long error;
+         pProp->Get(error);
+         profile.failError = (short)error;
+      }
+      if (strcmp(profile.name, g_Custom) != 0)
+      {
+         profile.name = g_Custom;
+         OnPropertyChanged(g_FaultProfileProp, g_Custom);
+      }
+      if (faults_ != 0)
+         faults_->SetProfile(faultProfile_, (unsigned long)faultSeed_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnFaultStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      long count = 0;
+      if (faults_ != 0)
+      {
+         switch (stat)
+         {
+         case FAULT_STALLS: count = faults_->Stalls(); break;
+         case FAULT_DROPPED: count = faults_->Dropped(); break;
+         case FAULT_DUPLICATED: count = faults_->Duplicated(); break;
+         case FAULT_FAILED: count = faults_->Failed(); break;
+         }
+      }
+      pProp->Set(count);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnStressMoves(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stressMoves_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(stressMoves_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnStressP99Limit(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stressP99LimitMs_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(stressP99LimitMs_);
+   }
+
+   return DEVICE_OK;
+}
+
+// The run goes on the soak worker, so the checks that keep moves off the
+// wheel during a soak run cover it too
+int ThorlabsFilterWheel::OnStressTest(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   bool stressing = soakThread_->IsRunning(SOAK_JOB_STRESS);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stressing ? g_Run : g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_Idle)
+      {
+         // the move under way finishes and the moves so far are reported
+         if (!stressing)
+            return DEVICE_OK;
+         soakThread_->Stop();
+         return soakThread_->GetResult();
+      }
+      if (stressing)
+         return DEVICE_OK;
+      if (continuous_)
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      if (sequenceThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SEQUENCE_RUNNING;
+      }
+      if (soakThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SOAK_RUNNING;
+      }
+      soakThread_->Stop(); // reap the previous run
+      moveThread_->Join();
+      soakThread_->Start(SOAK_JOB_STRESS);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnStressReport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(stressReport_.c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnUsageFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(usageFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(usageFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTransitions(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(usage_.Transitions());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSlotPlacement(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      pProp->Set(g_Idle);
+      if (mode == g_Analyze)
+      {
+         AdviseSlotPlacement();
+         OnPropertyChanged(g_SlotPlacementReportProp, placementReport_.c_str());
+      }
+      else if (mode == g_Reset)
+      {
+         // after the filters have been moved the old counts describe other filters
+         usage_.Reset(numPos_);
+         SaveUsage();
+         placementReport_.clear();
+         OnPropertyChanged(g_TransitionsProp, "0");
+         OnPropertyChanged(g_SlotPlacementReportProp, "");
+      }
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSlotPlacementReport(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(placementReport_.c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoak(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(soakThread_->IsRunning(SOAK_JOB_SOAK) ? g_Running : g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      bool other = soakThread_->IsActive() && soakThread_->Job() != SOAK_JOB_SOAK;
+      if (mode == g_Idle)
+      {
+         // the move under way and the partial window are finished first
+         if (other)
+            return DEVICE_OK;
+         soakThread_->Stop();
+         return soakThread_->GetResult();
+      }
+      if (other)
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SOAK_RUNNING;
+      }
+      if (soakThread_->IsActive())
+         return DEVICE_OK;
+      if (continuous_)
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      if (sequenceThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SEQUENCE_RUNNING;
+      }
+      soakThread_->Stop(); // reap the previous run
+      moveThread_->Join();
+      soakThread_->Start(SOAK_JOB_SOAK);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoakDuration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(soakHours_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(soakHours_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoakWindow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(soakWindowMin_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(soakWindowMin_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoakReportFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(soakReportFile_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(soakReportFile_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoakWindows(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set((long)soak_.Windows());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSoakSummary(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(soak_.Summary().c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTraceStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      if (backend_ == 0)
+         pProp->Set(0L);
+      else if (stat == TRACE_STAT_RECORDS)
+         pProp->Set(backend_->TraceRecords());
+      else
+         pProp->Set(backend_->TraceDivergences());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnPollTime(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+	// int polltime = backend_->PollingDuration(); // <- implement soon?
+		pProp->Set(polltime_);
+	}
+   else if (eAct == MM::AfterSet)
+   {
+      if (initialized_)
+      {
+         pProp->Set(polltime_);
+         return ERR_POLL_CHANGE_FORBIDDEN;
+      }
+		// revert
+      pProp->Get(polltime_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnContinuous(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(continuous_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      bool enable = (mode == g_On);
+      if (enable == continuous_)
+         return DEVICE_OK;
+      if (sequenceThread_->IsActive())
+      {
+         pProp->Set(g_Off); // revert
+         return ERR_SEQUENCE_RUNNING;
+      }
+      if (soakThread_->IsActive())
+      {
+         pProp->Set(g_Off); // revert
+         return ERR_SOAK_RUNNING;
+      }
+      moveThread_->Join();
+
+      CommandGuard command(commandQueue_);
+      int ret = enable ? Kinesis_StartContinuous() : Kinesis_StopContinuous();
+      if (ret != DEVICE_OK)
+      {
+         LogMessage("Failed to change continuous rotation mode with error code " + std::to_string((long long)ret));
+         pProp->Set(continuous_ ? g_On : g_Off); // revert
+         return ret;
+      }
+      continuous_ = enable;
+      changedTime_ = GetClockTime().getUsec();
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnRotationRate(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(rotationRate_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double rate;
+      pProp->Get(rate);
+      if (rate <= 0 || rate > maxSpeed_)
+      {
+         pProp->Set(rotationRate_); // revert
+         return ERR_INVALID_SPEED;
+      }
+      // a running wheel picks up the new rate straight away
+      if (continuous_)
+      {
+         CommandGuard command(commandQueue_);
+         int ret = Kinesis_SetRotationRate(rate);
+         if (ret != DEVICE_OK)
+         {
+            pProp->Set(rotationRate_); // revert
+            return ret;
+         }
+      }
+      rotationRate_ = rate;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnDwellWindow(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(dwellWindow_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      pProp->Get(dwellWindow_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnTriggerLine(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(triggerLine_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      // switching lines mid-rotation could leave the old line stuck high
+      if (continuous_)
+      {
+         pProp->Set(triggerLine_); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      pProp->Get(triggerLine_);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnInPositionTrigger(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(inPositionTrigger_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      bool enable = (mode == g_On);
+      if (enable == inPositionTrigger_)
+         return DEVICE_OK;
+
+      CommandGuard command(commandQueue_);
+      int ret = Kinesis_SetInPositionTrigger(enable);
+      if (ret != DEVICE_OK)
+      {
+         LogMessage("Failed to configure in-position trigger with error code " + std::to_string((long long)ret));
+         pProp->Set(inPositionTrigger_ ? g_On : g_Off); // revert
+         return ret;
+      }
+      inPositionTrigger_ = enable;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceThread_->IsActive() ? g_Running : g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_Idle)
+      {
+         sequenceThread_->Stop();
+         if (sequenceThread_->GetResult() != DEVICE_OK)
+            return sequenceThread_->GetResult();
+         return DEVICE_OK;
+      }
+      if (sequenceThread_->IsActive())
+         return DEVICE_OK;
+      if (continuous_)
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      if (soakThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SOAK_RUNNING;
+      }
+
+      // resolve the schedule against the current timebase
+      std::vector<SequenceStep> steps;
+      int ret = ParseSequence(sequenceSchedule_, steps);
+      if (ret != DEVICE_OK || steps.empty())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_INVALID_SEQUENCE;
+      }
+      sequenceThread_->Stop(); // reap the previous run before replacing its schedule
+      moveThread_->Join();
+      sequence_ = steps;
+      sequenceStepsDone_ = 0;
+      sequenceThread_->Start();
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSequenceSchedule(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceSchedule_.c_str());
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string schedule;
+      pProp->Get(schedule);
+      // validate up front so errors show when the schedule is entered
+      std::vector<SequenceStep> steps;
+      if (ParseSequence(schedule, steps) != DEVICE_OK)
+      {
+         pProp->Set(sequenceSchedule_.c_str()); // revert
+         return ERR_INVALID_SEQUENCE;
+      }
+      sequenceSchedule_ = schedule;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSequenceTimebase(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceFrames_ ? g_TimebaseFrames : g_TimebaseMs);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string timebase;
+      pProp->Get(timebase);
+      sequenceFrames_ = (timebase == g_TimebaseFrames);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSequenceFrameInterval(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(sequenceFrameInterval_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double interval;
+      pProp->Get(interval);
+      if (interval <= 0)
+      {
+         pProp->Set(sequenceFrameInterval_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      sequenceFrameInterval_ = interval;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSequenceStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // jitter is the actual minus planned start of each completed step
+      // the worker publishes a step only once its times are written
+      long n = sequenceStepsDone_.load(std::memory_order_acquire);
+      double sum = 0.0, sumSq = 0.0, maxAbs = 0.0;
+      for (long i = 0; i < n; i++)
+      {
+         double jitter = sequence_[i].actualMs - sequence_[i].plannedMs;
+         sum += jitter;
+         sumSq += jitter*jitter;
+         if (fabs(jitter) > maxAbs)
+            maxAbs = fabs(jitter);
+      }
+      double mean = n > 0 ? sum/n : 0.0;
+      double var = n > 1 ? (sumSq - n*mean*mean)/(n - 1) : 0.0;
+      if (stat == SEQ_STEPS)
+         pProp->Set(n);
+      else if (stat == SEQ_JITTER_MEAN)
+         pProp->Set(mean);
+      else if (stat == SEQ_JITTER_STD)
+         pProp->Set(var > 0 ? sqrt(var) : 0.0);
+      else
+         pProp->Set(maxAbs);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSettleCalibration(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   bool calibrating = soakThread_->IsRunning(SOAK_JOB_SETTLE);
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(calibrating ? g_Run : g_Idle);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_Idle)
+      {
+         // the move under way finishes and the table is left as it was
+         if (!calibrating)
+            return DEVICE_OK;
+         soakThread_->Stop();
+         return soakThread_->GetResult();
+      }
+      if (calibrating)
+         return DEVICE_OK;
+      if (continuous_)
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_CONTINUOUS_ACTIVE;
+      }
+      if (sequenceThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SEQUENCE_RUNNING;
+      }
+      if (soakThread_->IsActive())
+      {
+         pProp->Set(g_Idle); // revert
+         return ERR_SOAK_RUNNING;
+      }
+      // the wheel steps through every transition distance on the worker
+      soakThread_->Stop(); // reap the previous run
+      moveThread_->Join();
+      soakThread_->Start(SOAK_JOB_SETTLE);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnAutoSettle(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(autoSettle_ ? g_On : g_Off);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      autoSettle_ = (mode == g_On);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSettleMargin(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      pProp->Set(settleMargin_);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      double margin;
+      pProp->Get(margin);
+      if (margin < 0)
+      {
+         pProp->Set(settleMargin_); // revert
+         return DEVICE_INVALID_PROPERTY_VALUE;
+      }
+      settleMargin_ = margin;
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnSettleTable(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // "speed S: 1=a 2=b ...; speed T: ..." with one entry per slot distance
+      std::ostringstream table;
+      MMThreadGuard guard(settleLock_);
+      for (std::map<long, std::vector<double> >::const_iterator it = settleTable_.begin(); it != settleTable_.end(); ++it)
+      {
+         if (it != settleTable_.begin())
+            table << "; ";
+         table << "speed " << it->first << ":";
+         for (size_t d = 1; d < it->second.size(); d++)
+            table << " " << d << "=" << Round(it->second[d]);
+      }
+      pProp->Set(table.str().c_str());
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnMotionState(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      // settling ends on the clock, not on an event, so let Busy() catch up first
+      if (motionState_ == MOTION_SETTLING)
+         Busy();
+      pProp->Set(g_MotionStateNames[motionState_]);
+   }
+
+   return DEVICE_OK;
+}
+
+// field -1 is the raw status word
+int ThorlabsFilterWheel::OnStatusField(MM::PropertyBase* pProp, MM::ActionType eAct, long field)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      MotorStatus status = GetMotorStatus();
+      if (field < 0)
+      {
+         char bits[11];
+         sprintf(bits, "0x%08lX", status.bits);
+         pProp->Set(bits);
+         return DEVICE_OK;
+      }
+      bool value = false;
+      switch (field)
+      {
+         case STATUS_MOVING_CW: value = status.movingCW; break;
+         case STATUS_MOVING_CCW: value = status.movingCCW; break;
+         case STATUS_HOMING: value = status.homing; break;
+         case STATUS_HOMED: value = status.homed; break;
+         case STATUS_LIMIT_CW: value = status.limitCW; break;
+         case STATUS_LIMIT_CCW: value = status.limitCCW; break;
+         case STATUS_CONNECTED: value = status.connected; break;
+         case STATUS_ENABLED: value = status.enabled; break;
+      }
+      pProp->Set(value ? 1L : 0L);
+   }
+
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::OnArrivalVerification(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+   if (eAct == MM::BeforeGet)
+   {
+      if (verifyMode_ == VERIFY_POLL)
+         pProp->Set(g_VerifyPoll);
+      else if (verifyMode_ == VERIFY_ENCODER)
+         pProp->Set(g_VerifyEncoder);
+      else
+         pProp->Set(g_VerifyStatus);
+   }
+   else if (eAct == MM::AfterSet)
+   {
+      std::string mode;
+      pProp->Get(mode);
+      if (mode == g_VerifyPoll)
+         verifyMode_ = VERIFY_POLL;
+      else if (mode == g_VerifyEncoder)
+         verifyMode_ = VERIFY_ENCODER;
+      else
+         verifyMode_ = VERIFY_STATUS;
+   }
+
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Moves
+///////////////////////////////////////////////////////////////////////////////
+
+// Moves to a slot and updates the cached position once the move is confirmed
+int ThorlabsFilterWheel::MoveToSlot(long pos){
+   if (connectionMode_ == CONNECTION_CLIENT)
+      return ClientMove(pos);
+   CommandGuard command(commandQueue_);
+   // continuous rotation may have started while this move was queued
+   if (continuous_)
+      return ERR_CONTINUOUS_ACTIVE;
+   MM::MMTime start = GetClockTime();
+   if (telemetryEnabled_)
+      telemetry_.BeginMove(position_, pos, start.getMsec());
+   int ret = Kinesis_SetPosition(pos * stepAngle_, g_move_timeout);
+   if (ret != DEVICE_OK)
+      ret = RecoverMove(pos, ret);
+   if (telemetryEnabled_)
+      telemetry_.EndMove(GetClockTime().getMsec(), ret, g_telemetry_tail_ms);
+   if (ret != DEVICE_OK)
+      return ret;
+   // includes any recovery, which is what the caller waited for
+   metrics_.RecordMove((GetClockTime() - start).getMsec());
+   RecordArrival(position_, pos);
+   position_ = pos;
+   SetMotionState(GetSettleDelayMs() > 0.0 ? MOTION_SETTLING : MOTION_IDLE);
+   PublishStatus();
+   return DEVICE_OK;
+}
+
+// A move requested by a client process through the device server
+int ThorlabsFilterWheel::ServeMove(long pos){
+   // the checks and the move are one command, nothing can start in between
+   CommandGuard command(commandQueue_);
+   // same checks as a local State change
+   if (continuous_)
+      return ERR_CONTINUOUS_ACTIVE;
+   if (sequenceThread_->IsActive())
+      return ERR_SEQUENCE_RUNNING;
+   if (soakThread_->IsActive())
+      return ERR_SOAK_RUNNING;
+   if (pos >= numPos_ || pos < 0)
+      return ERR_UNKNOWN_POSITION;
+   changedTime_ = GetClockTime().getUsec();
+   int ret = MoveToSlot(pos);
+   if (ret == DEVICE_OK)
+      OnPropertyChanged(MM::g_Keyword_State, CDeviceUtils::ConvertToString(pos));
+   return ret;
+}
+
+int ThorlabsFilterWheel::ClientMove(long pos){
+   CommandGuard command(commandQueue_);
+   MM::MMTime start = GetClockTime();
+   SetMotionState(MOTION_MOVING);
+   WheelResponse response;
+   if (client_.Move(pos, response) != DEVICE_OK)
+   {
+      SetMotionState(MOTION_DISCONNECTED);
+      return ERR_SERVER_UNAVAILABLE;
+   }
+   // the server's error codes are this adapter's own
+   if (response.result != DEVICE_OK)
+   {
+      position_ = response.position;
+      SetMotionState(MOTION_FAULT);
+      return response.result;
+   }
+   metrics_.RecordMove((GetClockTime() - start).getMsec());
+   RecordArrival(position_, pos);
+   position_ = response.position;
+   SetMotionState(GetSettleDelayMs() > 0.0 ? MOTION_SETTLING : MOTION_IDLE);
+   return DEVICE_OK;
+}
+
+static unsigned long FoldDigest(unsigned long digest, long value)
+{
+   // FNV-1a over the four bytes of value
+   for (int i = 0; i < 4; i++)
+   {
+      digest ^= (unsigned long)((value >> (8*i)) & 0xFF);
+      digest = (digest * 16777619UL) & 0xFFFFFFFFUL;
+   }
+   return digest;
+}
+
+// Makes every move still left in the replayed trace, in order, the way a user
+// would, and fingerprints the result, end position and virtual duration of
+// each. On the virtual clock a trace gives the same fingerprint on every run,
+// so a change in the adapter's timing or recovery logic shows up as a new
+// digest; the check passes when the adapter made exactly the recorded calls.
+int ThorlabsFilterWheel::RunReplayCheck(){
+   if (clock_ != &virtualClock_)
+   {
+      replayCheck_ = "Not run, the check needs the virtual clock";
+      return DEVICE_OK;
+   }
+   long divergences = backend_->TraceDivergences();
+   MM::MMTime start = GetClockTime();
+   unsigned long digest = 2166136261UL;
+   long moves = 0;
+   long failed = 0;
+   long target;
+   while (replay_->NextMoveTarget(target))
+   {
+      long slot = Round(target/g_real_to_device_units/stepAngle_) % numPos_;
+      if (slot < 0)
+         slot += numPos_;
+      MM::MMTime issued = GetClockTime();
+      int ret = MoveToSlot(slot);
+      if (ret == ERR_CONTINUOUS_ACTIVE)
+         return ret;
+      digest = FoldDigest(digest, ret);
+      digest = FoldDigest(digest, position_);
+      digest = FoldDigest(digest, (long)(GetClockTime() - issued).getUsec());
+      moves++;
+      if (ret != DEVICE_OK)
+         failed++;
+   }
+   divergences = backend_->TraceDivergences() - divergences;
+   std::ostringstream report;
+   report << moves << " moves, " << failed << " failed, " << divergences << " divergences, ";
+   report << std::fixed << std::setprecision(0) << (GetClockTime() - start).getMsec() << " ms";
+   report << ", digest " << std::hex << std::uppercase << std::setw(8) << std::setfill('0') << digest;
+   report << (divergences == 0 ? ": pass" : ": fail");
+   replayCheck_ = report.str();
+   LogMessage("Kinesis replay check " + replayCheck_);
+   return DEVICE_OK;
+}
+
+// Moves to random slots under the current fault profile, the same slots for
+// the same seed, and summarizes the move times and what recovery had to do.
+// Failed moves are counted and the run carries on from wherever the wheel is.
+// The run passes when recovery saved every move and the p99 move time is
+// within the limit.
+int ThorlabsFilterWheel::RunFaultStress(){
+   std::mt19937 random((unsigned long)faultSeed_);
+   std::uniform_int_distribution<long> other(0, numPos_ - 2);
+   long moves = stressMoves_;
+   double limitMs = stressP99LimitMs_;
+   std::vector<double> times;
+   times.reserve(moves);
+   long retries = metrics_.Retries();
+   long resyncs = metrics_.Resyncs();
+   long rehomes = metrics_.Rehomes();
+   long failed = 0;
+   for (long i = 0; i < moves && !soakThread_->StopRequested(); i++)
+   {
+      // never the slot we are on, that would not move
+      long target = other(random);
+      if (target >= position_)
+         target++;
+      MM::MMTime start = GetClockTime();
+      int ret = MoveToSlot(target);
+      if (ret == ERR_CONTINUOUS_ACTIVE)
+         return ret;
+      if (ret != DEVICE_OK)
+         failed++;
+      times.push_back((GetClockTime() - start).getMsec());
+      OnPropertyChanged(MM::g_Keyword_State, CDeviceUtils::ConvertToString(position_.load()));
+   }
+   std::ostringstream report;
+   report << std::fixed << std::setprecision(0);
+   report << faultProfile_.name << ": " << times.size() << " moves, " << failed << " failed";
+   if (times.empty())
+   {
+      stressReport_ = report.str() + ": stopped";
+      OnPropertyChanged(g_StressReportProp, stressReport_.c_str());
+      return DEVICE_OK;
+   }
+   std::sort(times.begin(), times.end());
+   size_t n = times.size();
+   double p99 = times[(size_t)ceil(0.99*n) - 1];
+   report << ", p50 " << times[(n - 1)/2] << " ms, p99 " << p99 << " ms, max " << times[n - 1] << " ms";
+   report << ", retries " << metrics_.Retries() - retries << ", resyncs " << metrics_.Resyncs() - resyncs << ", re-homes " << metrics_.Rehomes() - rehomes;
+   if ((long)n < moves)
+      report << ", stopped early";
+   if (failed == 0 && p99 <= limitMs)
+      report << ": pass";
+   else
+   {
+      report << ": fail (";
+      if (failed > 0)
+         report << failed << " unrecovered";
+      if (failed > 0 && p99 > limitMs)
+         report << ", ";
+      if (p99 > limitMs)
+         report << "p99 over " << limitMs << " ms";
+      report << ")";
+   }
+   stressReport_ = report.str();
+   LogMessage("Fault stress test " + stressReport_);
+   OnPropertyChanged(g_StressReportProp, stressReport_.c_str());
+   return DEVICE_OK;
+}
+
+// Moves to random slots back to back until the duration is up or the run is
+// stopped, timing each move and reading back how far from the slot it ended.
+// Every window is closed with the recovery counts and phase times it saw and
+// the report file rewritten, so a run cut short still leaves its data. On the
+// simulated controller with the virtual clock the hours pass without waiting
+// for them, with any fault profile still injected on top.
+int ThorlabsFilterWheel::RunSoak(){
+   std::mt19937 random((unsigned long)faultSeed_);
+   std::uniform_int_distribution<long> other(0, numPos_ - 2);
+   double durationMs = soakHours_ * 3600000.0;
+   double windowMs = soakWindowMin_ * 60000.0;
+   MM::MMTime start = GetClockTime();
+   double windowStartMs = 0.0;
+   soak_.Begin(ReadSoakCounters(metrics_));
+   while (!soakThread_->StopRequested())
+   {
+      double elapsedMs = (GetClockTime() - start).getMsec();
+      if (elapsedMs >= durationMs)
+         break;
+      if (elapsedMs - windowStartMs >= windowMs)
+      {
+         soak_.CloseWindow(windowStartMs / 3600000.0, ReadSoakCounters(metrics_));
+         WriteSoakReport();
+         windowStartMs = elapsedMs;
+      }
+
+      // never the slot we are on, that would not move
+      long target = other(random);
+      if (target >= position_)
+         target++;
+      // the error is read before any other command can move the wheel
+      CommandGuard command(commandQueue_);
+      MM::MMTime issued = GetClockTime();
+      int ret = MoveToSlot(target);
+      double ms = (GetClockTime() - issued).getMsec();
+      if (ret == ERR_CONTINUOUS_ACTIVE)
+         return ret;
+      soak_.AddMove(ms, ret == DEVICE_OK, ret == DEVICE_OK ? Kinesis_PositionError(target * stepAngle_) : 0.0);
+   }
+   if (soak_.WindowHasMoves())
+      soak_.CloseWindow(windowStartMs / 3600000.0, ReadSoakCounters(metrics_));
+   WriteSoakReport();
+   LogMessage("Soak test " + soak_.Summary());
+   return DEVICE_OK;
+}
+
+// Prices a move over each distance at the current speed plus the settle
+// delay the wheel would wait after it, then finds where each filter should go
+// for the recorded transitions to cost the least.
+void ThorlabsFilterWheel::AdviseSlotPlacement(){
+   std::vector<double> travelMs(numPos_, 0.0);
+   std::vector<double> settle;
+   {
+      MMThreadGuard guard(settleLock_);
+      std::map<long, std::vector<double> >::const_iterator it = settleTable_.find(speed_.load());
+      if (autoSettle_ && it != settleTable_.end())
+         settle = it->second;
+   }
+   double speed = (double)(std::max)(speed_.load(), 1L);
+   for (long distance = 1; distance < numPos_; distance++)
+   {
+      double settleMs = distance < (long)settle.size() ? settle[distance] + settleMargin_ : GetDelayMs();
+      travelMs[distance] = 1000.0*distance*stepAngle_/speed + settleMs;
+   }
+
+   long transitions = usage_.Transitions();
+   SlotPlacement placement = PlanSlotPlacement(usage_.Counts(), numPos_, travelMs);
+   std::ostringstream report;
+   report << std::fixed << std::setprecision(0);
+   report << transitions << " transitions";
+   if (transitions == 0)
+   {
+      placementReport_ = report.str() + ", nothing to advise yet";
+      return;
+   }
+   report << ": " << placement.currentMs << " ms/move as placed";
+   if (placement.bestMs >= placement.currentMs)
+   {
+      placementReport_ = report.str() + ", already the best placement";
+      LogMessage("Slot placement " + placementReport_);
+      return;
+   }
+   report << ", " << placement.bestMs << " ms/move rearranged (" << 100.0*(placement.currentMs - placement.bestMs)/placement.currentMs << "% less):";
+   char label[MM::MaxStrLength];
+   for (long slot = 0; slot < numPos_; slot++)
+   {
+      if (placement.slotOf[slot] == slot)
+         continue;
+      GetPositionLabel(slot, label);
+      report << " " << label << " " << slot << "->" << placement.slotOf[slot];
+   }
+   placementReport_ = report.str();
+   LogMessage("Slot placement " + placementReport_);
+}
+
+void ThorlabsFilterWheel::SaveUsage(){
+   if (usageFile_.empty() || usage_.Slots() == 0)
+      return;
+   if (!usage_.Save(usageFile_))
+      LogMessage("Could not write usage statistics to " + usageFile_);
+}
+
+void ThorlabsFilterWheel::WriteSoakReport(){
+   std::ofstream out(soakReportFile_.c_str(), std::ios::out | std::ios::trunc);
+   if (!out)
+   {
+      LogMessage("Could not write soak report to " + soakReportFile_);
+      return;
+   }
+   soak_.WriteReport(out);
+}
+
+// Recovery after a failed move. A lost message or a near miss is usually cured
+// by reading back where the wheel really is or by moving again; only when the
+// retries run out is the wheel stopped and re-homed for one last attempt.
+int ThorlabsFilterWheel::RecoverMove(long pos, int error){
+   if (error != ERR_MOVE_TIMEOUT && error != ERR_MOVE_MSG_TIMEOUT && error != ERR_MOTION_STOPPED && error != ERR_MOVE_REJECTED)
+      return error;
+
+   for (long attempt = 0; attempt <= moveRetries_; attempt++)
+   {
+      if (Kinesis_Resync(pos * stepAngle_))
+      {
+         metrics_.RecordResync();
+         LogMessage("Move to slot " + std::to_string((long long)pos) + " confirmed after resynchronizing the position");
+         return DEVICE_OK;
+      }
+      if (attempt == moveRetries_)
+         break;
+      metrics_.RecordRetry();
+      LogMessage("Retrying move to slot " + std::to_string((long long)pos) + " after error " + std::to_string((long long)error));
+      error = Kinesis_SetPosition(pos * stepAngle_, g_move_timeout);
+      if (error == DEVICE_OK)
+         return DEVICE_OK;
+   }
+
+   if (rehomeRecovery_)
+   {
+      metrics_.RecordRehome();
+      LogMessage("Re-homing after failed move to slot " + std::to_string((long long)pos));
+      error = Kinesis_Rehome();
+      if (error == DEVICE_OK)
+         error = Kinesis_SetPosition(pos * stepAngle_, g_move_timeout);
+      if (error == DEVICE_OK)
+         return DEVICE_OK;
+   }
+
+   metrics_.RecordFailedMove();
+   SetMotionState(MOTION_FAULT);
+   return error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Motion state
+///////////////////////////////////////////////////////////////////////////////
+
+void ThorlabsFilterWheel::SetMotionState(long state){
+   if (state == motionState_)
+      return;
+   LogMessage(std::string("Motion state ") + g_MotionStateNames[motionState_] + " -> " + g_MotionStateNames[state], true);
+   motionState_ = state;
+   if (initialized_)
+      OnPropertyChanged(g_MotionStateProp, g_MotionStateNames[state]);
+   PublishStatus();
+}
+
+// Only cached values go out, publishing never talks to the controller
+void ThorlabsFilterWheel::PublishStatus(){
+   if (!sharedStatus_.IsOpen())
+      return;
+   long state = motionState_;
+   bool moving = (state == MOTION_HOMING || state == MOTION_MOVING || state == MOTION_VERIFYING);
+   sharedStatus_.Publish(position_, state, moving, state == MOTION_FAULT, GetMotorStatus().bits, metrics_.LastMoveMs());
+}
+
+MotorStatus ThorlabsFilterWheel::GetMotorStatus(){
+   MotorStatus status;
+   status.bits = (backend_ != 0) ? backend_->GetStatusBits() : 0;
+   status.movingCW = (status.bits & g_status_moving_cw) != 0;
+   status.movingCCW = (status.bits & g_status_moving_ccw) != 0;
+   status.homing = (status.bits & g_status_homing) != 0;
+   status.homed = (status.bits & g_status_homed) != 0;
+   status.limitCW = (status.bits & g_status_limit_cw) != 0;
+   status.limitCCW = (status.bits & g_status_limit_ccw) != 0;
+   status.connected = (status.bits & g_status_connected) != 0;
+   status.enabled = (status.bits & g_status_enabled) != 0;
+   return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Settle delay
+///////////////////////////////////////////////////////////////////////////////
+
+void ThorlabsFilterWheel::RecordArrival(long from, long to){
+   arrivedTime_ = GetClockTime().getUsec();
+   lastDistance_ = labs(to - from);
+   // only moves made for the user count; soak, stress and calibration runs
+   // and anything on a replayed trace would skew the placement advice
+   if (replay_ != 0 || soakThread_->IsActive())
+      return;
+   // saved now and then so a crash loses little
+   long transitions = usage_.Record(from, to);
+   if (from != to && transitions % g_usage_save_interval == 0)
+      SaveUsage();
+}
+
+// Runs on the soak worker. The calibration is one command, so no other move
+// lands between its measurements.
+int ThorlabsFilterWheel::RunSettleCalibration(){
+   CommandGuard command(commandQueue_);
+   int ret = Kinesis_CalibrateSettle();
+   if (ret != DEVICE_OK)
+      LogMessage("Settle calibration failed with error code " + std::to_string((long long)ret));
+   OnPropertyChanged(MM::g_Keyword_State, CDeviceUtils::ConvertToString(position_.load()));
+   return ret;
+}
+
+double ThorlabsFilterWheel::GetSettleDelayMs(){
+   // fall back to the manual delay until this speed has been calibrated
+   if (autoSettle_)
+   {
+      MMThreadGuard guard(settleLock_);
+      std::map<long, std::vector<double> >::const_iterator it = settleTable_.find(speed_.load());
+      long distance = lastDistance_;
+      if (it != settleTable_.end() && distance < (long)it->second.size())
+         return it->second[distance] + settleMargin_;
+   }
+   return GetDelayMs();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sequence engine
+///////////////////////////////////////////////////////////////////////////////
+
+// Schedule format: "slot@time;slot@time;..." with time in ms or in frames
+// depending on the timebase, measured from the start of the sequence.
+int ThorlabsFilterWheel::ParseSequence(const std::string& schedule, std::vector<SequenceStep>& steps){
+   steps.clear();
+   std::istringstream entries(schedule);
+   std::string entry;
+   double last = 0.0;
+   while (std::getline(entries, entry, ';'))
+   {
+      if (entry.find_first_not_of(" \t") == std::string::npos)
+         continue;
+      SequenceStep step;
+      char at;
+      std::istringstream fields(entry);
+      if (!(fields >> step.slot >> at >> step.scheduled) || at != '@')
+         return ERR_INVALID_SEQUENCE;
+      if (step.slot < 0 || step.slot >= numPos_ || step.scheduled < last)
+         return ERR_INVALID_SEQUENCE;
+      last = step.scheduled;
+      step.plannedMs = sequenceFrames_ ? step.scheduled*sequenceFrameInterval_ : step.scheduled;
+      step.actualMs = 0.0;
+      step.doneMs = 0.0;
+      steps.push_back(step);
+   }
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::RunSequence(){
+   MM::MMTime start = GetClockTime();
+   for (size_t i = 0; i < sequence_.size(); i++)
+   {
+      SequenceStep& step = sequence_[i];
+      // sleep in chunks, then spin for the last few ms so the start is sharp
+      double remaining = step.plannedMs - (GetClockTime() - start).getMsec();
+      while (remaining > 0)
+      {
+         if (sequenceThread_->StopRequested())
+            return DEVICE_OK;
+         if (remaining > g_sequence_spin_ms)
+            clock_->SleepMs((DWORD)(std::min)(remaining - g_sequence_spin_ms, (double)g_sequence_max_sleep_ms));
+         else
+            clock_->SleepMs(0);
+         remaining = step.plannedMs - (GetClockTime() - start).getMsec();
+      }
+      if (sequenceThread_->StopRequested())
+         return DEVICE_OK;
+
+      MM::MMTime issued = GetClockTime();
+      changedTime_ = issued.getUsec();
+      step.actualMs = (issued - start).getMsec();
+      int ret = MoveToSlot(step.slot);
+      step.doneMs = (GetClockTime() - start).getMsec();
+      if (ret != DEVICE_OK)
+         return ret;
+      sequenceStepsDone_.store((long)i + 1, std::memory_order_release);
+   }
+   LogMessage("Finished sequence of " + std::to_string((long long)sequenceStepsDone_.load()) + " steps");
+   return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Kinesis API commands
+///////////////////////////////////////////////////////////////////////////////
+
+int ThorlabsFilterWheel::Kinesis_Initialize(int timeout){
+   int ret;
+   if (traceMode_ == KINESIS_TRACE_REPLAY){
+      // no controller: the trace answers every call on a channel of our own
+      KinesisReplayBackend* replay = new KinesisReplayBackend(replayFast_, clock_);
+      std::string tracedSerial;
+      long tracedChannel;
+      if (replay->Open(traceFile_, tracedSerial, tracedChannel) != DEVICE_OK){
+         LogMessage("Could not read trace " + traceFile_);
+         delete replay;
+         return ERR_TRACE_FILE;
+      }
+      LogMessage("Replaying " + tracedSerial + " channel " + std::to_string((long long)tracedChannel) + " from " + traceFile_);
+      Kinesis_OpenPrivateChannel();
+      backend_ = replay;
+      replay_ = replay;
+   }
+   else if (simulate_){
+      // no controller either, a motion model stands in for it
+      LogMessage("Simulating " + serialNumber_ + " channel " + std::to_string((long long)channelNumber_));
+      Kinesis_OpenPrivateChannel();
+      backend_ = new KinesisSimulatedBackend(clock_, g_real_to_device_units/g_real_to_device_speed_units,
+         (int)(speed_*g_real_to_device_speed_units), (unsigned int)(g_sim_homing_rate*g_real_to_device_speed_units), polltime_);
+   }
+   else {
+      // the device manager finds, opens and starts polling the controller,
+      // or hands back the existing connection if another device already has
+      ret = KinesisDeviceManager::Instance().Acquire(serialNumber_, (short)channelNumber_, polltime_, channel_);
+      if (ret == DEVICE_INVALID_INPUT_PARAM)
+         return ERR_INVALID_CHANNEL;
+      if (ret != DEVICE_OK){
+         LogMessage("Controller " + serialNumber_ + " not available");
+         return ret;
+      }
+      backend_ = new DirectKinesisBackend(channel_->Serial(), channel_->Channel());
+   }
+   // faults go in below the recorder, so a trace captures them for replay
+   faults_ = new FaultInjectionBackend(backend_, clock_);
+   faults_->SetProfile(faultProfile_, (unsigned long)faultSeed_);
+   backend_ = faults_;
+   if (traceMode_ == KINESIS_TRACE_RECORD){
+      KinesisTraceRecorder* recorder = new KinesisTraceRecorder(backend_, clock_);
+      if (recorder->Open(traceFile_, serialNumber_, channelNumber_) != DEVICE_OK)
+         LogMessage("Could not create trace file " + traceFile_ + ", not recording");
+      backend_ = recorder;
+   }
+
+   // the settings snapshot goes through the backend so a trace carries it; a
+   // recording takes its own even on a shared channel so the trace is complete.
+   // The answer arrives within a poll period.
+   KinesisSettingsCache& settings = channel_->Settings();
+   if (!namedSettings_.empty()){
+      ret = settings.LoadNamed(*backend_, clock_, namedSettings_.c_str(), polltime_);
+      if (ret != DEVICE_OK)
+         LogMessage("Could not load named settings " + namedSettings_ + ", keeping the controller's own");
+   }
+   if (!settings.Loaded() || (namedSettings_.empty() && traceMode_ != KINESIS_TRACE_OFF)){
+      if (settings.Load(*backend_, clock_, polltime_) != DEVICE_OK)
+         LogMessage("Channel did not report its settings");
+   }
+
+   // a connection kept alive by a previous instance is already homed
+   ChannelState& state = channel_->State();
+   if (state.homed){
+      LogMessage("Channel already homed, skipping home");
+      if (state.speed > 0)
+         speed_ = state.speed;
+      position_ = state.position;
+      SetMotionState(MOTION_IDLE);
+      return DEVICE_OK;
+   }
+
+   ret = Kinesis_WaitHomed(timeout);
+   if (ret != DEVICE_OK){
+      Kinesis_ReleaseChannel(0);
+      SetMotionState(MOTION_DISCONNECTED);
+      return ret;
+   }
+   state.homed = true;
+   SetMotionState(MOTION_IDLE);
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_WaitHomed(int timeout){
+   MMThreadGuard guard(channel_->IoLock());
+   int ret = Kinesis_SetHomingVelocity(homingVelocity_);
+   if (ret != DEVICE_OK)
+      LogMessage("Could not set the homing velocity, homing with the controller's setting");
+   // Home device
+   SetMotionState(MOTION_HOMING);
+   MM::MMTime start = GetClockTime();
+   Kinesis_Home();
+   ret = Kinesis_AwaitCompletion(g_msg_homed, timeout, ERR_HOME_TIMEOUT);
+   metrics_.RecordHoming((GetClockTime() - start).getMsec());
+   return ret;
+}
+
+// The one place that waits on the message queue. Only the motion notification
+// for the operation in progress completes the wait; a stop notification ends it
+// with a fault, everything else (settings, status updates) is skipped.
+int ThorlabsFilterWheel::Kinesis_AwaitCompletion(unsigned short completionId, int timeout, int timeoutError){
+   MM::MMTime start = GetClockTime();
+   while (true)
+   {
+      while (backend_->MessageQueueSize() > 0)
+      {
+         WORD messageType;
+         WORD messageId;
+         DWORD messageData;
+         backend_->GetNextMessage(&messageType, &messageId, &messageData);
+         metrics_.RecordMessage();
+         if (messageType != g_msg_generic_motor)
+            continue;
+         if (messageId == completionId)
+            return DEVICE_OK;
+         if (messageId == g_msg_stopped){
+            MotorStatus status = GetMotorStatus();
+            char msg[96];
+            sprintf(msg, "Stopped while %s (status 0x%08lX%s)", g_MotionStateNames[motionState_], status.bits, status.IsFaulted() ? ", fault" : "");
+            LogMessage(msg);
+            SetMotionState(MOTION_FAULT);
+            return ERR_MOTION_STOPPED;
+         }
+      }
+      if ((GetClockTime() - start).getMsec() > timeout){
+         char msg[96];
+         sprintf(msg, "Timed out while %s (status 0x%08lX)", g_MotionStateNames[motionState_], GetMotorStatus().bits);
+         LogMessage(msg);
+         SetMotionState(MOTION_FAULT);
+         metrics_.RecordTimeout();
+         return timeoutError;
+      }
+      clock_->SleepMs(g_message_wait_ms);
+   }
+}
+
+int ThorlabsFilterWheel::Kinesis_Home(){
+   // Home device
+   backend_->ClearMessageQueue();
+   backend_->Home();
+   LogMessage("Homing", true);
+   return 0;
+}
+
+int ThorlabsFilterWheel::Kinesis_SetPosition(double position, int timeout){
+   // keep other users of the channel off the message queue until we are done
+   MMThreadGuard guard(channel_->IoLock());
+   // move to position  (degrees) (channel 1)
+   double pos_start = backend_->GetPosition();
+   // estimate how long we should give the wheel to move to the correct pos
+   double move_dist = fabs(position - pos_start/g_real_to_device_units);
+   double expected_time_ms = 1000.0*move_dist/(double)(std::max)(speed_.load(), 1L);
+   int calculated_move_timeout = (int)(std::min)(2.0*expected_time_ms + polltime_, (double)g_general_timeout);  // a bit arbitrary
+   LogMessage("Move timeout " + std::to_string((long long)calculated_move_timeout) + " ms", true);
+   
+   backend_->ClearMessageQueue();
+
+   SetMotionState(MOTION_MOVING);
+   MM::MMTime moveStart = GetClockTime();
+   int move_ret = backend_->MoveToPosition(position*g_real_to_device_units);
+   if (move_ret != 0){
+	   // Kinesis error codes overlap the Micro-Manager ones, report our own
+	   LogMessage("Move command failed with Kinesis error " + std::to_string((long long)move_ret));
+	   SetMotionState(MOTION_FAULT);
+	   return ERR_MOVE_REJECTED;
+   }
+   metrics_.RecordPhase(PHASE_COMMAND, (GetClockTime() - moveStart).getMsec());
+
+   // wait for completion
+   MM::MMTime completionStart = GetClockTime();
+   int ret = Kinesis_AwaitCompletion(g_msg_moved, timeout, ERR_MOVE_MSG_TIMEOUT);
+   if (ret != DEVICE_OK)
+      return ret;
+   MM::MMTime verifyStart = GetClockTime();
+   metrics_.RecordPhase(PHASE_COMPLETION, (verifyStart - completionStart).getMsec());
+   SetMotionState(MOTION_VERIFYING);
+
+   // try to confirm arrival without the fixed poll wait below
+   if (verifyMode_ != VERIFY_POLL && Kinesis_QuickVerify(position) == DEVICE_OK){
+      char msg[96];
+      sprintf(msg, "Arrival confirmed from %s after %.0f ms", verifyMode_ == VERIFY_ENCODER ? "encoder" : "status bits", (GetClockTime() - moveStart).getMsec());
+      LogMessage(msg, true);
+      metrics_.RecordPhase(PHASE_VERIFY, (GetClockTime() - verifyStart).getMsec());
+      SetMotionState(MOTION_IDLE);
+      return DEVICE_OK;
+   }
+
+   backend_->RequestPosition();
+	clock_->SleepMs(polltime_); //
+   double pos = backend_->GetPosition();
+   while(Round((double)(pos/g_real_to_device_units)) != Round(position)){
+      backend_->RequestPosition();
+      clock_->SleepMs(polltime_);
+      pos = backend_->GetPosition();
+
+      // use calculated time as timeout, measured like the completion wait
+      if ((GetClockTime() - verifyStart).getMsec() > calculated_move_timeout){
+         LogMessage("Wheel did not reach the target in time");
+         SetMotionState(MOTION_FAULT);
+         metrics_.RecordTimeout();
+	      return ERR_MOVE_TIMEOUT;
+		}
+   }
+
+   if (verifyMode_ == VERIFY_ENCODER && encoderRatio_ == 0.0)
+      Kinesis_LearnEncoderRatio((int)pos);
+
+   char msg[96];
+   sprintf(msg, "Moved to %d deg in %.0f ms, polling every %ld ms", Round((double)(pos/g_real_to_device_units)), (GetClockTime() - moveStart).getMsec(), backend_->PollingDuration());
+   LogMessage(msg, true);
+
+   metrics_.RecordPhase(PHASE_VERIFY, (GetClockTime() - verifyStart).getMsec());
+   SetMotionState(MOTION_IDLE);
+   return DEVICE_OK;
+}
+
+// Confirms arrival in at most one round trip. Returns DEVICE_OK if the wheel is
+// known to be at position, otherwise the caller falls back to polling.
+int ThorlabsFilterWheel::Kinesis_QuickVerify(double position){
+   if (verifyMode_ == VERIFY_ENCODER && encoderAvailable_ && encoderRatio_ != 0.0){
+      double expected = Round(position*g_real_to_device_units)*encoderRatio_;
+      double tolerance = fabs(g_encoder_tolerance_deg*g_real_to_device_units*encoderRatio_);
+      if (backend_->RequestEncoderCounter() != 0){
+         encoderAvailable_ = false;
+         return ERR_MOVE_TIMEOUT;
+      }
+      // watch for the reply rather than sleeping a whole poll period
+      MM::MMTime start = GetClockTime();
+      while ((GetClockTime() - start).getMsec() < polltime_){
+         if (fabs(backend_->GetEncoderCounter() - expected) <= tolerance)
+            return DEVICE_OK;
+         clock_->SleepMs(1);
+      }
+      return ERR_MOVE_TIMEOUT;
+   }
+
+   // the completion message refreshes position and status bits, so both are already current
+   bool moving = IsMoving();
+   int pos = backend_->GetPosition();
+   if (!moving && Round(pos/g_real_to_device_units) == Round(position))
+      return DEVICE_OK;
+   return ERR_MOVE_TIMEOUT;
+}
+
+// Reads back the true position once the wheel has come to rest; true if it is
+// already where it was sent.
+bool ThorlabsFilterWheel::Kinesis_Resync(double position){
+   MMThreadGuard guard(channel_->IoLock());
+   for (int waited = 0; IsMoving() && waited < g_general_timeout; waited += polltime_)
+      clock_->SleepMs(polltime_);
+   backend_->RequestPosition();
+   clock_->SleepMs(polltime_);
+   int pos = backend_->GetPosition();
+   char msg[80];
+   sprintf(msg, "Resynchronized at %.2f deg, target %.2f deg", pos/g_real_to_device_units, position);
+   LogMessage(msg, true);
+   if (IsMoving() || Round(pos/g_real_to_device_units) != Round(position))
+      return false;
+   SetMotionState(MOTION_IDLE);
+   return true;
+}
+
+// Stops whatever the wheel is doing and homes it again
+int ThorlabsFilterWheel::Kinesis_Rehome(){
+   {
+      MMThreadGuard guard(channel_->IoLock());
+      backend_->StopImmediate();
+      for (int waited = 0; IsMoving() && waited < g_general_timeout; waited += polltime_)
+         clock_->SleepMs(polltime_);
+   }
+   int ret = Kinesis_WaitHomed(g_move_timeout);
+   if (ret != DEVICE_OK)
+      return ret;
+   channel_->State().homed = true;
+   SetMotionState(MOTION_IDLE);
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_SetHomingVelocity(double rate){
+   if (rate <= 0.0)
+      return DEVICE_OK;
+   MOT_HomingParameters params;
+   int ret = channel_->Settings().GetHomingParams(*backend_, clock_, params);
+   if (ret != DEVICE_OK)
+      return ret;
+   unsigned int velocity = (unsigned int)(rate*g_real_to_device_speed_units);
+   if (params.velocity == velocity)
+      return DEVICE_OK;
+   params.velocity = velocity;
+   return channel_->Settings().SetHomingParams(*backend_, params);
+}
+
+// Compares the position counter with the encoder once the wheel has been left
+// alone for a while and re-homes it if they disagree. Lost steps show up as
+// drift here long before a move misses its slot.
+void ThorlabsFilterWheel::Kinesis_CheckDrift(){
+   if (!idleRehome_ || continuous_ || sequenceThread_->IsActive() || moveThread_->IsActive())
+      return;
+   if (motionState_ != MOTION_IDLE && motionState_ != MOTION_SETTLING)
+      return;
+   if ((GetClockTime() - MM::MMTime(arrivedTime_.load())).getMsec() < idleQuietTime_*1000.0)
+      return;
+   if (!encoderAvailable_)
+      return;
+
+   // a move queued behind the drift check runs once it (or the re-home) is done
+   CommandGuard command(commandQueue_);
+   if (motionState_ != MOTION_IDLE && motionState_ != MOTION_SETTLING)
+      return;
+   double drift;
+   {
+      MMThreadGuard guard(channel_->IoLock());
+      if (IsMoving())
+         return;
+      backend_->RequestPosition();
+      clock_->SleepMs(polltime_);
+      int pos = backend_->GetPosition();
+      // the first check only learns the encoder scale
+      if (encoderRatio_ == 0.0){
+         Kinesis_LearnEncoderRatio(pos);
+         return;
+      }
+      if (backend_->RequestEncoderCounter() != 0){
+         encoderAvailable_ = false;
+         return;
+      }
+      clock_->SleepMs(polltime_);
+      long count = backend_->GetEncoderCounter();
+      drift = fabs(count/encoderRatio_ - pos)/g_real_to_device_units;
+   }
+   lastDrift_ = drift;
+   if (drift <= driftThreshold_)
+      return;
+
+   char msg[96];
+   sprintf(msg, "Drift of %.2f deg between position counter and encoder, re-homing", drift);
+   LogMessage(msg);
+   metrics_.RecordIdleRehome();
+   int ret = Kinesis_Rehome();
+   if (ret == DEVICE_OK)
+      ret = Kinesis_SetPosition(position_ * stepAngle_, g_move_timeout);
+   if (ret != DEVICE_OK)
+      LogMessage("Idle re-home failed with error code " + std::to_string((long long)ret));
+   // the old scale was learnt against the drifted counter
+   encoderRatio_ = 0.0;
+}
+
+// Requests fresh position and status from the controller and records what
+// the previous request brought back, so each sample lags by up to one interval.
+// Only requests go out here; the message queue is left to the move.
+void ThorlabsFilterWheel::Kinesis_TelemetryTick(){
+   if (backend_ == 0)
+      return;
+   double now = GetClockTime().getMsec();
+   if (!telemetry_.Recording(now))
+      return;
+   backend_->RequestPosition();
+   backend_->RequestStatusBits();
+   telemetry_.AddSample(now, backend_->GetPosition(), backend_->GetStatusBits());
+}
+
+// Degrees between where the wheel came to rest and the slot it was sent to. The
+// encoder is used once its scale is known, since the position counter of a
+// stepper only says where the steps were meant to take it.
+double ThorlabsFilterWheel::Kinesis_PositionError(double position){
+   CommandGuard command(commandQueue_);
+   MMThreadGuard guard(channel_->IoLock());
+   bool encoder = encoderAvailable_ && encoderRatio_ != 0.0;
+   backend_->RequestPosition();
+   if (encoder)
+      backend_->RequestEncoderCounter();
+   clock_->SleepMs(polltime_);
+   double pos = backend_->GetPosition();
+   if (encoder)
+      pos = backend_->GetEncoderCounter() / encoderRatio_;
+   return fabs(pos/g_real_to_device_units - position);
+}
+
+// Learns the encoder scale from a position confirmed by the poll loop. Controllers
+// without an encoder report no counts, in which case the encoder mode stays on the fallback.
+void ThorlabsFilterWheel::Kinesis_LearnEncoderRatio(int pos){
+   if (!encoderAvailable_ || pos == 0)
+      return;
+   if (backend_->RequestEncoderCounter() != 0){
+      encoderAvailable_ = false;
+      return;
+   }
+   clock_->SleepMs(polltime_);
+   long count = backend_->GetEncoderCounter();
+   if (count == 0){
+      encoderAvailable_ = false;
+      LogMessage("No encoder counts reported, arrival verification will use position polling");
+      return;
+   }
+   encoderRatio_ = (double)count/pos;
+}
+
+double ThorlabsFilterWheel::Kinesis_GetSpeed(){
+   int currentVelocity, currentAcceleration;
+   int ret;
+   ret = channel_->Settings().GetVelParams(*backend_, clock_, currentAcceleration, currentVelocity);
+   if (ret != 0){
+	   return ret;
+   }
+   //return currentVelocity;
+   return currentVelocity/g_real_to_device_speed_units;
+}
+
+int ThorlabsFilterWheel::Kinesis_SetSpeed(int speed){
+   // value handling done at higher level (Thorlabs State Device)
+   if(speed > 0)
+   {
+		speed *= g_real_to_device_speed_units;
+		// acceleration comes from the settings snapshot, only the write goes to the controller
+		int currentVelocity, currentAcceleration;
+		int ret, retset;
+		ret = channel_->Settings().GetVelParams(*backend_, clock_, currentAcceleration, currentVelocity);
+		if (ret){
+			return ret;
+		}
+		retset = channel_->Settings().SetVelParams(*backend_, currentAcceleration, speed);
+		if (retset != 0){
+			return retset;
+		}
+   }
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_SendCmd(){
+   return ERROR_CALL_NOT_IMPLEMENTED;
+}
+
+int ThorlabsFilterWheel::Kinesis_SetRotationRate(double rate){
+   // the continuous worker reads the rate under the same lock
+   MMThreadGuard guard(channel_->IoLock());
+   // rate in the same real units (deg/s) as the speed property
+   int currentVelocity, currentAcceleration;
+   int ret = channel_->Settings().GetVelParams(*backend_, clock_, currentAcceleration, currentVelocity);
+   if (ret != 0){
+      return ret;
+   }
+   ret = channel_->Settings().SetVelParams(*backend_, currentAcceleration, (int)(rate*g_real_to_device_speed_units));
+   if (ret != 0){
+      return ret;
+   }
+   // the controller only applies new velocity parameters to the next move command
+   ret = backend_->MoveAtVelocity(MOT_Forwards);
+   if (ret != 0){
+      return ret;
+   }
+   // carry the predicted angle across the change so the edges stay continuous
+   double now = GetClockTime().getMsec();
+   anchorAngle_ = ContinuousAngle(now);
+   anchorMs_ = now;
+   anchorRate_ = rate;
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_StartContinuous(){
+   // trigger line starts low, the worker raises it inside each dwell window
+   backend_->SetDigitalOutputs(0);
+   triggerHigh_ = false;
+
+   {
+      // never clear the queue under another wheel's wait on this channel
+      MMThreadGuard guard(channel_->IoLock());
+      backend_->ClearMessageQueue();
+      // the wheel is standing still, so its position is the first anchor
+      backend_->RequestPosition();
+      clock_->SleepMs(polltime_);
+      anchorAngle_ = backend_->GetPosition()/g_real_to_device_units;
+      anchorMs_ = GetClockTime().getMsec();
+      anchorRate_ = 0.0;
+      positionRequested_ = false;
+   }
+   int ret = Kinesis_SetRotationRate(rotationRate_);
+   if (ret != 0){
+      Kinesis_SetSpeed(speed_);
+      return ret;
+   }
+   SetMotionState(MOTION_MOVING);
+   continuousThread_->Start();
+   LogMessage("Rotating continuously at " + std::to_string((long double)rotationRate_) + " deg/s");
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_StopContinuous(){
+   continuousThread_->Stop();
+   backend_->StopProfiled();
+
+   // wait for the moving CW/CCW status bits to clear
+   int timeoutCounter = 0;
+   backend_->RequestStatusBits();
+   clock_->SleepMs(polltime_);
+   while(IsMoving()){
+      if (timeoutCounter * polltime_ > g_general_timeout){
+         LogMessage("Wheel did not stop in time");
+         return ERR_CONTINUOUS_FAILED;
+      }
+      backend_->RequestStatusBits();
+      clock_->SleepMs(polltime_);
+      timeoutCounter++;
+   }
+   backend_->SetDigitalOutputs(0);
+   triggerHigh_ = false;
+
+   // fold the position counter back into one turn, otherwise the next
+   // absolute move would unwind every revolution made while spinning
+   backend_->RequestPosition();
+   clock_->SleepMs(polltime_);
+   long turn = Round(360.0*g_real_to_device_units);
+   long count = backend_->GetPosition() % turn;
+   if (count < 0)
+      count += turn;
+   backend_->SetPositionCounter(count);
+
+   // restore the stepping speed and park on the nearest slot
+   Kinesis_SetSpeed(speed_);
+   position_ = Round(count/g_real_to_device_units/stepAngle_) % numPos_;
+   return Kinesis_SetPosition(position_ * stepAngle_, g_move_timeout);
+}
+
+// Edges are placed from the predicted angle rather than the polled position,
+// which lags the wheel by up to a poll period. Each position request is read
+// back a poll period later, by when the answer is in, and re-anchors the
+// prediction at the time it was asked for.
+int ThorlabsFilterWheel::Kinesis_ContinuousTick(){
+   // keeps the rate and anchor steady and the channel to ourselves
+   MMThreadGuard guard(channel_->IoLock());
+   double now = GetClockTime().getMsec();
+   if (positionRequested_ && now - positionRequestMs_ >= polltime_){
+      anchorAngle_ = backend_->GetPosition()/g_real_to_device_units;
+      anchorMs_ = positionRequestMs_;
+      positionRequested_ = false;
+   }
+   if (!positionRequested_){
+      backend_->RequestPosition();
+      positionRequestMs_ = now;
+      positionRequested_ = true;
+   }
+   double angle = fmod(ContinuousAngle(now), 360.0);
+   if (angle < 0)
+      angle += 360.0;
+   int nearest = Round(angle/stepAngle_);
+   bool inWindow = fabs(angle - nearest*stepAngle_) <= dwellWindow_/2.0;
+   // only talk to the controller on an edge
+   if (inWindow != triggerHigh_){
+      byte bits = inWindow ? (byte)(1 << (triggerLine_ - 1)) : 0;
+      int ret = backend_->SetDigitalOutputs(bits);
+      if (ret != 0){
+         LogMessage("Continuous rotation trigger update failed with error " + std::to_string((long long)ret));
+         return ret;
+      }
+      triggerHigh_ = inWindow;
+   }
+   if (inWindow && position_ != nearest % numPos_){
+      position_ = nearest % numPos_;
+      PublishStatus();
+   }
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_SetInPositionTrigger(bool enable){
+   if (enable){
+      // remember the user's trigger configuration so it can be restored
+      backend_->RequestTriggerSwitches();
+      clock_->SleepMs(polltime_);
+      savedTriggerSwitches_ = backend_->GetTriggerSwitches();
+      LogMessage("Trigger output high while moving");
+      return backend_->SetTriggerSwitches(g_in_position_trigger_bits);
+   }
+   return backend_->SetTriggerSwitches(savedTriggerSwitches_);
+}
+
+// Samples the wheel after a move until it has been quiet for a few samples in a row.
+// settleMs is the time of the last sample that still showed movement.
+int ThorlabsFilterWheel::Kinesis_MeasureSettle(bool useEncoder, double& settleMs){
+   MM::MMTime start = GetClockTime();
+   long last = 0;
+   int quiet = -1; // the first sample only sets the baseline
+   settleMs = 0.0;
+   while (quiet < g_settle_stable_samples)
+   {
+      if (useEncoder)
+         backend_->RequestEncoderCounter();
+      else
+         backend_->RequestPosition();
+      backend_->RequestStatusBits();
+      clock_->SleepMs(g_settle_sample_ms);
+
+      long count = useEncoder ? backend_->GetEncoderCounter() : backend_->GetPosition();
+      bool moving = IsMoving();
+      double elapsed = (GetClockTime() - start).getMsec();
+      if (quiet >= 0 && !moving && labs(count - last) <= g_settle_tolerance)
+      {
+         quiet++;
+      }
+      else
+      {
+         quiet = 0;
+         settleMs = elapsed;
+      }
+      last = count;
+      if (elapsed > g_general_timeout)
+         return ERR_SETTLE_TIMEOUT;
+   }
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_CalibrateSettle(){
+   // start from slot 0 so that a move to slot d spans exactly d slots
+   int ret = Kinesis_SetPosition(0.0, g_move_timeout);
+   if (ret != DEVICE_OK)
+      return ret;
+   position_ = 0;
+
+   // the encoder shows real vibration where fitted, the position counter only
+   // what was commanded; probe with one slot move to see if the encoder counts
+   bool useEncoder = false;
+   if (backend_->RequestEncoderCounter() == 0)
+   {
+      clock_->SleepMs(polltime_);
+      long encoderStart = backend_->GetEncoderCounter();
+      ret = Kinesis_SetPosition(stepAngle_, g_move_timeout);
+      if (ret != DEVICE_OK)
+         return ret;
+      backend_->RequestEncoderCounter();
+      clock_->SleepMs(polltime_);
+      useEncoder = (backend_->GetEncoderCounter() != encoderStart);
+      ret = Kinesis_SetPosition(0.0, g_move_timeout);
+      if (ret != DEVICE_OK)
+         return ret;
+   }
+
+   std::vector<double> table(numPos_, 0.0);
+   for (long d = 1; d < numPos_; d++)
+   {
+      for (int rep = 0; rep < g_settle_repeats; rep++)
+      {
+         // a stopped calibration leaves the table for this speed as it was
+         if (soakThread_->StopRequested())
+         {
+            LogMessage("Settle calibration stopped");
+            return DEVICE_OK;
+         }
+         // out and back, both legs span d slots
+         for (int leg = 0; leg < 2; leg++)
+         {
+            long target = (leg == 0) ? d : 0;
+            ret = Kinesis_SetPosition(target * stepAngle_, g_move_timeout);
+            if (ret != DEVICE_OK)
+               return ret;
+            position_ = target;
+            double settleMs;
+            ret = Kinesis_MeasureSettle(useEncoder, settleMs);
+            if (ret != DEVICE_OK)
+               return ret;
+            table[d] = (std::max)(table[d], settleMs);
+         }
+      }
+      char msg[80];
+      sprintf(msg, "Settle time for %ld slot move at speed %ld: %.1f ms", d, speed_.load(), table[d]);
+      LogMessage(msg);
+   }
+   {
+      MMThreadGuard guard(settleLock_);
+      settleTable_[speed_] = table;
+   }
+   LogMessage(std::string("Settle calibration used the ") + (useEncoder ? "encoder counter" : "position counter"));
+   return DEVICE_OK;
+}
+
+int ThorlabsFilterWheel::Kinesis_Shutdown(){
+   if (channel_ == 0)
+      return DEVICE_OK;
+   if (keepAlive_){
+      // leave the wheel as it is for the next Initialize
+      ChannelState& state = channel_->State();
+      state.speed = speed_;
+      state.position = position_;
+      Kinesis_ReleaseChannel((int)(keepAliveTimeout_*1000.0));
+      SetMotionState(MOTION_DISCONNECTED);
+      return DEVICE_OK;
+   }
+	// set back to max speed (default)
+   Kinesis_SetSpeed(maxSpeed_);
+	// stop polling and close the device once no other device uses it
+   Kinesis_ReleaseChannel(0);
+   SetMotionState(MOTION_DISCONNECTED);
+   return DEVICE_OK;
+}
+
+// Hands the channel back to the device manager and drops the backend; a
+// replayed or simulated channel was never the manager's and is simply deleted
+void ThorlabsFilterWheel::Kinesis_ReleaseChannel(int keepAliveMs){
+   if (backend_ != 0 && traceMode_ != KINESIS_TRACE_OFF)
+      LogMessage("Kinesis trace: " + std::to_string((long long)backend_->TraceRecords()) + " records, " + std::to_string((long long)backend_->TraceDivergences()) + " divergences");
+   delete backend_;
+   backend_ = 0;
+   faults_ = 0;
+   replay_ = 0;
+   if (traceMode_ == KINESIS_TRACE_REPLAY || simulate_){
+      ChannelState* state = &channel_->State();
+      delete channel_;
+      delete state;
+   }
+   else {
+      KinesisDeviceManager::Instance().Release(channel_, keepAliveMs);
+   }
+   channel_ = 0;
+}
+
+// A channel of our own for a backend without a controller behind it
+void ThorlabsFilterWheel::Kinesis_OpenPrivateChannel(){
+   ChannelState* state = new ChannelState();
+   state->refCount = 1;
+   state->open = true;
+   state->polltime = polltime_;
+   state->homed = false;
+   state->speed = 0;
+   state->position = 0;
+   state->idle = false;
+   state->idleSince = 0;
+   state->keepAliveMs = 0;
+   channel_ = new KinesisChannel(serialNumber_, (short)channelNumber_, state);
+}
+
+// Utils
+int ThorlabsFilterWheel::Round(double number){
+   return (int)floor(number + 0.5);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CommandQueue
+///////////////////////////////////////////////////////////////////////////////
+
+void CommandQueue::Lock()
+{
+   std::unique_lock<std::mutex> lock(mutex_);
+   if (depth_ > 0 && owner_ == std::this_thread::get_id())
+   {
+      depth_++;
+      return;
+   }
+   long ticket = next_++;
+   while (serving_ != ticket)
+      turn_.wait(lock);
+   owner_ = std::this_thread::get_id();
+   depth_ = 1;
+}
+
+void CommandQueue::Unlock()
+{
+   {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--depth_ > 0)
+         return;
+      owner_ = std::thread::id();
+      serving_++;
+   }
+   // every waiter checks its ticket, the one whose turn it is goes ahead
+   turn_.notify_all();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ContinuousRotationThread
+///////////////////////////////////////////////////////////////////////////////
+
+ContinuousRotationThread::ContinuousRotationThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   stop_(true),
+   running_(false)
+{
+}
+
+ContinuousRotationThread::~ContinuousRotationThread()
+{
+   Stop();
+}
+
+void ContinuousRotationThread::Start()
+{
+   if (running_)
+      return;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void ContinuousRotationThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int ContinuousRotationThread::svc()
+{
+   while (!stop_)
+   {
+      // the tick logs its own failure
+      if (wheel_->Kinesis_ContinuousTick() != DEVICE_OK)
+         break;
+      Sleep(g_continuous_sample_ms);
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SequenceThread
+///////////////////////////////////////////////////////////////////////////////
+
+SequenceThread::SequenceThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   stop_(true),
+   running_(false),
+   finished_(false),
+   result_(DEVICE_OK)
+{
+}
+
+SequenceThread::~SequenceThread()
+{
+   Stop();
+}
+
+void SequenceThread::Start()
+{
+   if (IsActive())
+      return;
+   // reap a previous run that ended on its own
+   Stop();
+   stop_ = false;
+   finished_ = false;
+   result_ = DEVICE_OK;
+   running_ = true;
+   activate();
+}
+
+void SequenceThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int SequenceThread::svc()
+{
+#ifdef WIN32
+   SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#endif
+   result_ = wheel_->RunSequence();
+   finished_ = true;
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SoakThread
+///////////////////////////////////////////////////////////////////////////////
+
+SoakThread::SoakThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   job_(SOAK_JOB_SOAK),
+   stop_(true),
+   running_(false),
+   finished_(false),
+   result_(DEVICE_OK)
+{
+}
+
+SoakThread::~SoakThread()
+{
+   Stop();
+}
+
+void SoakThread::Start(long job)
+{
+   if (IsActive())
+      return;
+   // reap a previous run that ended on its own
+   Stop();
+   job_ = job;
+   stop_ = false;
+   finished_ = false;
+   result_ = DEVICE_OK;
+   running_ = true;
+   activate();
+}
+
+void SoakThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int SoakThread::svc()
+{
+   switch (job_)
+   {
+   case SOAK_JOB_STRESS: result_ = wheel_->RunFaultStress(); break;
+   case SOAK_JOB_SETTLE: result_ = wheel_->RunSettleCalibration(); break;
+   default: result_ = wheel_->RunSoak(); break;
+   }
+   finished_ = true;
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MoveThread
+///////////////////////////////////////////////////////////////////////////////
+
+MoveThread::MoveThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   pos_(0),
+   running_(false),
+   finished_(false),
+   result_(DEVICE_OK)
+{
+}
+
+MoveThread::~MoveThread()
+{
+   Join();
+}
+
+void MoveThread::Start(long pos)
+{
+   Join();
+   pos_ = pos;
+   finished_ = false;
+   result_ = DEVICE_OK;
+   running_ = true;
+   activate();
+}
+
+void MoveThread::Join()
+{
+   if (!running_)
+      return;
+   wait();
+   running_ = false;
+}
+
+int MoveThread::svc()
+{
+   result_ = wheel_->MoveToSlot(pos_);
+   finished_ = true;
+   return 0;
+}
+///////////////////////////////////////////////////////////////////////////////
+// IdleRehomeThread
+///////////////////////////////////////////////////////////////////////////////
+
+IdleRehomeThread::IdleRehomeThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   stop_(true),
+   running_(false)
+{
+}
+
+IdleRehomeThread::~IdleRehomeThread()
+{
+   Stop();
+}
+
+void IdleRehomeThread::Start()
+{
+   if (running_)
+      return;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void IdleRehomeThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int IdleRehomeThread::svc()
+{
+   int waited = 0;
+   while (!stop_)
+   {
+      Sleep(g_drift_wait_ms);
+      waited += g_drift_wait_ms;
+      if (waited < g_drift_check_ms)
+         continue;
+      waited = 0;
+      wheel_->Kinesis_CheckDrift();
+   }
+   return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TelemetryThread
+///////////////////////////////////////////////////////////////////////////////
+
+TelemetryThread::TelemetryThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   intervalMs_(g_default_telemetry_interval),
+   stop_(true),
+   running_(false)
+{
+}
+
+TelemetryThread::~TelemetryThread()
+{
+   Stop();
+}
+
+void TelemetryThread::Start(int intervalMs)
+{
+   if (running_)
+      return;
+   intervalMs_ = intervalMs;
+   stop_ = false;
+   running_ = true;
+   activate();
+}
+
+void TelemetryThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   wait();
+   running_ = false;
+}
+
+int TelemetryThread::svc()
+{
+   while (!stop_)
+   {
+      wheel_->Kinesis_TelemetryTick();
+      Sleep(intervalMs_);
+   }
+   return 0;
+}
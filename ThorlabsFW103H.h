@@ -13,8 +13,22 @@
 #include "../../MMDevice/MMDevice.h"
 #include "../../MMDevice/DeviceBase.h"
 #include "../../MMDevice/ModuleInterface.h"
+#include "WheelMetrics.h"
+#include "MoveTelemetry.h"
+#include "SharedStatus.h"
+#include "WheelServer.h"
+#include "WheelClock.h"
+#include "SoakReport.h"
+#include "SlotUsage.h"
+#include "FaultInjection.h"
 
 #include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #define ERR_UNKNOWN_POSITION          100
 #define ERR_INVALID_SPEED             101
@@ -22,6 +36,90 @@
 #define ERR_HOME_TIMEOUT		        103
 #define ERR_MOVE_MSG_TIMEOUT          104
 #define ERR_POLL_CHANGE_FORBIDDEN     105
+#define ERR_CONTINUOUS_ACTIVE         106
+#define ERR_CONTINUOUS_FAILED         107
+#define ERR_INVALID_SEQUENCE          108
+#define ERR_SEQUENCE_RUNNING          109
+#define ERR_SETTLE_TIMEOUT            110
+#define ERR_INVALID_CHANNEL           111
+#define ERR_MOTION_STOPPED            112
+#define ERR_SERVER_UNAVAILABLE        113
+#define ERR_TRACE_FILE                114
+#define ERR_SOAK_RUNNING              115
+#define ERR_VIRTUAL_CLOCK             116
+#define ERR_MOVE_REJECTED             117
+
+class ContinuousRotationThread;
+class KinesisChannel;
+class KinesisBackend;
+class FaultInjectionBackend;
+class KinesisReplayBackend;
+class SequenceThread;
+class SoakThread;
+class MoveThread;
+class IdleRehomeThread;
+class MetricsExportThread;
+class TelemetryThread;
+
+// One entry of a software-timed sequence; times are relative to the sequence start
+struct SequenceStep
+{
+   long slot;
+   double scheduled;  // as entered, in ms or frames depending on the timebase
+   double plannedMs;
+   double actualMs;   // when the move command was issued
+   double doneMs;     // when the move was confirmed
+};
+
+// Ticket lock that admits device commands one at a time, in the order they
+// arrived, whichever thread (GUI, acquisition engine, scripts, workers) sent them.
+// Waiters sleep until their turn comes; the thread holding the queue may take
+// it again, so a command can be built from other commands.
+class CommandQueue
+{
+public:
+   CommandQueue() : next_(0), serving_(0), depth_(0) {}
+   void Lock();
+   void Unlock();
+
+private:
+   std::mutex mutex_;
+   std::condition_variable turn_;
+   long next_;
+   long serving_;
+   std::thread::id owner_;
+   int depth_;
+};
+
+class CommandGuard
+{
+public:
+   CommandGuard(CommandQueue& queue) : queue_(queue) {queue_.Lock();}
+   ~CommandGuard() {queue_.Unlock();}
+
+private:
+   CommandQueue& queue_;
+};
+
+// Decoded SBC_GetStatusBits word. The polling started at open keeps the word
+// current, so decoding it costs no USB traffic.
+struct MotorStatus
+{
+   unsigned long bits;
+   bool movingCW;
+   bool movingCCW;
+   bool homing;
+   bool homed;
+   bool limitCW;
+   bool limitCCW;
+   bool connected;
+   bool enabled;
+
+   bool IsMoving() const {return movingCW || movingCCW || homing;}
+   // the word has no error bit; the wheel homes onto its limit switch, so
+   // contact with it is normal rather than a fault
+   bool IsFaulted() const {return !connected || !enabled;}
+};
 
 // CRTP
 class ThorlabsFilterWheel : public CStateDeviceBase<ThorlabsFilterWheel>
@@ -41,33 +139,397 @@ public:
    
    // util
    int Round(double number);
+   MM::MMTime GetClockTime() {return MM::MMTime(clock_->NowMs()*1000.0);}
 
    // action interface
    // ----------------
    int OnState(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnSpeed(MM::PropertyBase* pProp, MM::ActionType eAct);
    int OnSerialNumber(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnChannel(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnKeepAlive(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnKeepAliveTimeout(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnNamedSettings(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPersistSettings(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAsyncMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnPollTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnContinuous(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRotationRate(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDwellWindow(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTriggerLine(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnInPositionTrigger(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequence(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequenceSchedule(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequenceTimebase(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequenceFrameInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSequenceStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnSettleCalibration(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnAutoSettle(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSettleMargin(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSettleTable(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnArrivalVerification(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMotionState(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStatusField(MM::PropertyBase* pProp, MM::ActionType eAct, long field);
+   int OnMoveRetries(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRehomeRecovery(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnRecoveryStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnHomingVelocity(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnIdleRehome(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDriftThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnIdleQuietTime(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnDriftStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnMetric(MM::PropertyBase* pProp, MM::ActionType eAct, long metric);
+   int OnMetricsReset(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMetricsExportFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnMetricsExportInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetry(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetryInterval(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetryDumpFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetryDumpMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTelemetryDump(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnPublishStatus(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnConnectionMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnServerRequests(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnKinesisTrace(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnKinesisTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnReplayTiming(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSimulation(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTraceStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnReplayCheck(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnReplayCheckResult(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnClock(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFaultProfile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFaultSeed(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnFaultStat(MM::PropertyBase* pProp, MM::ActionType eAct, long stat);
+   int OnFaultParam(MM::PropertyBase* pProp, MM::ActionType eAct, long param);
+   int OnStressMoves(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStressTest(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStressReport(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnStressP99Limit(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoak(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoakDuration(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoakWindow(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoakReportFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoakWindows(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSoakSummary(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnUsageFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnTransitions(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSlotPlacement(MM::PropertyBase* pProp, MM::ActionType eAct);
+   int OnSlotPlacementReport(MM::PropertyBase* pProp, MM::ActionType eAct);
+
+   // sequence engine
+   int ParseSequence(const std::string& schedule, std::vector<SequenceStep>& steps);
+   int RunSequence();
+
+   // moves
+   int MoveToSlot(long pos);
+   int RecoverMove(long pos, int error);
+   int RunFaultStress();
+   int RunReplayCheck();
+   int RunSoak();
+   int RunSettleCalibration();
+   void WriteSoakReport();
+   void AdviseSlotPlacement();
+   void SaveUsage();
+   long GetPosition() const {return position_;}
+   double ContinuousAngle(double nowMs) const {return anchorAngle_ + anchorRate_*(nowMs - anchorMs_)/1000.0;}
+
+   // device server: moves requested by other processes, and this instance as their client
+   int ServeMove(long pos);
+   int ClientMove(long pos);
+
+   // settle delay
+   void RecordArrival(long from, long to);
+   double GetSettleDelayMs();
+
+   // motion state machine
+   void SetMotionState(long state);
+   long GetMotionState() const {return motionState_;}
+   void PublishStatus();
+
+   // status queries, answered from the last polled status word
+   MotorStatus GetMotorStatus();
+   bool IsMoving() {return GetMotorStatus().IsMoving();}
+   bool IsFaulted() {return GetMotorStatus().IsFaulted();}
 
    // Kinesis API commands
    int Kinesis_Initialize(int timeout);
    int Kinesis_Home();
+   int Kinesis_WaitHomed(int timeout);
+   int Kinesis_AwaitCompletion(unsigned short completionId, int timeout, int timeoutError);
    int Kinesis_Shutdown();
+   void Kinesis_ReleaseChannel(int keepAliveMs);
+   void Kinesis_OpenPrivateChannel();
    int Kinesis_SetPosition(double position, int timeout);
    double Kinesis_GetSpeed();
    int Kinesis_SetSpeed(int speed);
    int Kinesis_SendCmd();
+   int Kinesis_SetRotationRate(double rate);
+   int Kinesis_StartContinuous();
+   int Kinesis_StopContinuous();
+   int Kinesis_ContinuousTick();
+   int Kinesis_SetInPositionTrigger(bool enable);
+   int Kinesis_MeasureSettle(bool useEncoder, double& settleMs);
+   int Kinesis_CalibrateSettle();
+   int Kinesis_QuickVerify(double position);
+   void Kinesis_LearnEncoderRatio(int pos);
+   bool Kinesis_Resync(double position);
+   int Kinesis_Rehome();
+   int Kinesis_SetHomingVelocity(double rate);
+   void Kinesis_CheckDrift();
+   void Kinesis_TelemetryTick();
+   double Kinesis_PositionError(double position);
 
 private:
    // char* serialNumber_ ;
    std::string serialNumber_;
    long numPos_;
    bool initialized_;
-   MM::MMTime changedTime_;
-   long position_;
+   // state read by Busy() and the property handlers without taking commandQueue_;
+   // times are in us of GetCurrentMMTime()
+   std::atomic<double> changedTime_;
+   std::atomic<long> position_;
    bool homed_;
    long maxSpeed_;
-   long speed_;
+   std::atomic<long> speed_;
    double stepAngle_;
 	long polltime_;
+   // continuous rotation
+   bool continuous_;
+   double rotationRate_;
+   double dwellWindow_;
+   long triggerLine_;
+   bool triggerHigh_;
+   // the wheel's angle while spinning is predicted from the last position read
+   // back, the time it was asked for and the commanded rate
+   double anchorAngle_;
+   double anchorMs_;
+   double anchorRate_;
+   double positionRequestMs_;
+   bool positionRequested_;
+   ContinuousRotationThread* continuousThread_;
+   // hardware in-position trigger
+   bool inPositionTrigger_;
+   unsigned char savedTriggerSwitches_;
+   // software-timed sequence
+   std::string sequenceSchedule_;
+   std::vector<SequenceStep> sequence_;
+   bool sequenceFrames_;
+   double sequenceFrameInterval_;
+   std::atomic<long> sequenceStepsDone_; // published after the step's times are written
+   SequenceThread* sequenceThread_;
+   // per-transition settle delays (ms), keyed by speed then indexed by slot distance
+   std::map<long, std::vector<double> > settleTable_;
+   MMThreadLock settleLock_;
+   bool autoSettle_;
+   double settleMargin_;
+   std::atomic<long> lastDistance_;
+   std::atomic<double> arrivedTime_;
+   // arrival verification
+   long verifyMode_;
+   double encoderRatio_; // encoder counts per device unit, 0 until learnt
+   bool encoderAvailable_;
+   // time source of every wait, timeout and duration in the wheel logic
+   SystemClock systemClock_;
+   VirtualClock virtualClock_;
+   WheelClock* clock_;
+   // connection handle from the process-wide device manager
+   KinesisChannel* channel_;
+   long channelNumber_;
+   // every call on the channel, possibly recorded to or replayed from a trace
+   KinesisBackend* backend_;
+   long traceMode_;
+   std::string traceFile_;
+   bool replayFast_;
+   bool simulate_; // a simulated controller in place of the real one
+   KinesisReplayBackend* replay_; // part of backend_ when replaying
+   std::string replayCheck_;
+   // injected latency and faults, part of backend_
+   FaultInjectionBackend* faults_;
+   FaultProfile faultProfile_; // a preset, or Custom once a field is edited
+   long faultSeed_;
+   long stressMoves_;
+   double stressP99LimitMs_;
+   std::string stressReport_;
+   // long-running move workload, windowed so drift over hours shows up
+   double soakHours_;
+   double soakWindowMin_;
+   std::string soakReportFile_;
+   SoakRecorder soak_;
+   SoakThread* soakThread_;
+   // transition counts over sessions, for advice on where to put the filters
+   SlotUsage usage_;
+   std::string usageFile_; // empty keeps the counts for this session only
+   std::string placementReport_;
+   // keep the connection open and homed across Shutdown/Initialize
+   bool keepAlive_;
+   double keepAliveTimeout_;
+   // what the wheel is doing, see MotionState
+   volatile long motionState_;
+   // named Kinesis settings applied at open, empty for the controller's own
+   std::string namedSettings_;
+   // move recovery policy, its outcomes are counted in metrics_
+   long moveRetries_;
+   bool rehomeRecovery_;
+   // homing profile and idle-time re-homing on detected drift
+   double homingVelocity_; // deg/s, 0 keeps the controller's setting
+   bool idleRehome_;
+   double driftThreshold_;
+   double idleQuietTime_;
+   double lastDrift_;
+   IdleRehomeThread* idleRehomeThread_;
+   // move, homing and message statistics
+   WheelMetrics metrics_;
+   std::string metricsExportFile_; // empty disables the export
+   double metricsExportInterval_;
+   MetricsExportThread* metricsExportThread_;
+   // trajectory capture during moves
+   TelemetryRecorder telemetry_;
+   bool telemetryEnabled_;
+   long telemetryInterval_;
+   std::string telemetryDumpFile_;
+   long telemetryDumpMoves_;
+   TelemetryThread* telemetryThread_;
+   // status for out-of-process readers
+   bool publishStatus_;
+   SharedStatusPublisher sharedStatus_;
+   // sharing the wheel with other processes, see ConnectionMode
+   long connectionMode_;
+   WheelServerThread* serverThread_;
+   WheelClient client_;
+   // everything that talks to the controller goes through here
+   CommandQueue commandQueue_;
+   // asynchronous moves
+   bool asyncMoves_;
+   MoveThread* moveThread_;
+};
+
+// Worker that follows the wheel during continuous rotation and toggles the
+// trigger output as each slot centre passes
+class ContinuousRotationThread : public MMDeviceThreadBase
+{
+public:
+   ContinuousRotationThread(ThorlabsFilterWheel* wheel);
+   ~ContinuousRotationThread();
+   int svc();
+   void Start();
+   void Stop();
+   bool IsRunning() const {return running_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   volatile bool stop_;
+   volatile bool running_;
+};
+
+// High-priority worker that plays a preloaded schedule of slot moves
+class SequenceThread : public MMDeviceThreadBase
+{
+public:
+   SequenceThread(ThorlabsFilterWheel* wheel);
+   ~SequenceThread();
+   int svc();
+   void Start();
+   void Stop();
+   bool IsActive() const {return running_ && !finished_;}
+   bool StopRequested() const {return stop_;}
+   int GetResult() const {return result_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   volatile bool stop_;
+   volatile bool running_;
+   volatile bool finished_;
+   int result_;
+};
+
+// What the soak worker is running
+enum SoakJob
+{
+   SOAK_JOB_SOAK,
+   SOAK_JOB_STRESS,
+   SOAK_JOB_SETTLE
+};
+
+// Worker that keeps the wheel moving for a soak run, a fault stress run or a
+// settle calibration
+class SoakThread : public MMDeviceThreadBase
+{
+public:
+   SoakThread(ThorlabsFilterWheel* wheel);
+   ~SoakThread();
+   int svc();
+   void Start(long job = SOAK_JOB_SOAK);
+   void Stop();
+   bool IsActive() const {return running_ && !finished_;}
+   bool IsRunning(long job) const {return IsActive() && job_ == job;}
+   long Job() const {return job_;}
+   bool StopRequested() const {return stop_;}
+   int GetResult() const {return result_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   volatile long job_;
+   volatile bool stop_;
+   volatile bool running_;
+   volatile bool finished_;
+   int result_;
+};
+
+// Runs a single move in the background so that wheels on different channels
+// of one controller can move at the same time; Busy() covers the move
+class MoveThread : public MMDeviceThreadBase
+{
+public:
+   MoveThread(ThorlabsFilterWheel* wheel);
+   ~MoveThread();
+   int svc();
+   void Start(long pos);
+   void Join();
+   bool IsActive() const {return running_ && !finished_;}
+   int GetResult() const {return result_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   long pos_;
+   volatile bool running_;
+   volatile bool finished_;
+   int result_;
+};
+
+// Checks for drift between the position counter and the encoder while the
+// wheel is idle and re-homes it then, rather than in the middle of a move
+class IdleRehomeThread : public MMDeviceThreadBase
+{
+public:
+   IdleRehomeThread(ThorlabsFilterWheel* wheel);
+   ~IdleRehomeThread();
+   int svc();
+   void Start();
+   void Stop();
+   bool IsRunning() const {return running_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   volatile bool stop_;
+   volatile bool running_;
+};
+
+// Samples the position counter and status bits while the telemetry recorder
+// is capturing a move
+class TelemetryThread : public MMDeviceThreadBase
+{
+public:
+   TelemetryThread(ThorlabsFilterWheel* wheel);
+   ~TelemetryThread();
+   int svc();
+   void Start(int intervalMs);
+   void Stop();
+   bool IsRunning() const {return running_;}
+
+private:
+   ThorlabsFilterWheel* wheel_;
+   int intervalMs_;
+   volatile bool stop_;
+   volatile bool running_;
 };
\ No newline at end of file
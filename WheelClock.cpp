@@ -0,0 +1,53 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelClock.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Monotonic clock and sleep used by the wheel's waits and timeouts
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "WheelClock.h"
+
+const long long g_virtual_min_sleep_us = 10; // a zero sleep still moves time, or spin-waits would never end
+
+SystemClock::SystemClock()
+{
+   LARGE_INTEGER frequency;
+   QueryPerformanceFrequency(&frequency);
+   msPerTick_ = 1000.0 / (double)frequency.QuadPart;
+}
+
+double SystemClock::NowMs()
+{
+   LARGE_INTEGER counter;
+   QueryPerformanceCounter(&counter);
+   return (double)counter.QuadPart * msPerTick_;
+}
+
+void SystemClock::SleepMs(double ms)
+{
+   Sleep(ms > 0.0 ? (DWORD)ms : 0);
+}
+
+VirtualClock::VirtualClock() :
+   nowUs_(0)
+{
+}
+
+double VirtualClock::NowMs()
+{
+   return nowUs_.load() / 1000.0;
+}
+
+void VirtualClock::SleepMs(double ms)
+{
+   long long us = (long long)(ms * 1000.0);
+   nowUs_ += (us > g_virtual_min_sleep_us) ? us : g_virtual_min_sleep_us;
+}
@@ -0,0 +1,51 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelClock.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Monotonic clock and sleep used by the wheel's waits and timeouts
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+
+// Every wait, timeout and duration in the wheel logic reads this clock, so a
+// virtual one makes them independent of the wall clock
+class WheelClock
+{
+public:
+   virtual ~WheelClock() {}
+   virtual double NowMs() = 0;
+   virtual void SleepMs(double ms) = 0;
+};
+
+// The performance counter and Sleep()
+class SystemClock : public WheelClock
+{
+public:
+   SystemClock();
+   double NowMs();
+   void SleepMs(double ms);
+
+private:
+   double msPerTick_;
+};
+
+// Time only moves when someone sleeps, and a sleep returns at once. Every
+// timeout then costs as many loop iterations as it would on hardware but no
+// real time, and the same calls give the same times on every run. Meant for
+// a single driving thread: concurrent sleepers all push the one clock on.
+class VirtualClock : public WheelClock
+{
+public:
+   VirtualClock();
+   double NowMs();
+   void SleepMs(double ms);
+
+private:
+   std::atomic<long long> nowUs_;
+};
@@ -0,0 +1,186 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelMetrics.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free move and homing statistics for the filter wheel
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "WheelMetrics.h"
+#include <math.h>
+
+const char* g_phase_names[] = {"command", "completion", "verify"};
+
+const double g_sketch_min_ms = 0.1; // lower edge of the first bucket
+const double g_sketch_growth = 1.1; // each bucket is 10% wider than the last
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencySketch
+///////////////////////////////////////////////////////////////////////////////
+
+LatencySketch::LatencySketch()
+{
+   Reset();
+}
+
+void LatencySketch::Record(double ms)
+{
+   int bucket = 0;
+   if (ms > g_sketch_min_ms)
+      bucket = (int)(log(ms/g_sketch_min_ms)/log(g_sketch_growth));
+   if (bucket >= NUM_BUCKETS)
+      bucket = NUM_BUCKETS - 1;
+   buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+// Returns the geometric centre of the bucket holding the q-th sample
+double LatencySketch::Quantile(double q) const
+{
+   long counts[NUM_BUCKETS];
+   long total = 0;
+   for (int i = 0; i < NUM_BUCKETS; i++)
+   {
+      counts[i] = buckets_[i].load(std::memory_order_relaxed);
+      total += counts[i];
+   }
+   if (total == 0)
+      return 0.0;
+   long rank = (long)ceil(q*total);
+   if (rank < 1)
+      rank = 1;
+   long seen = 0;
+   for (int i = 0; i < NUM_BUCKETS; i++)
+   {
+      seen += counts[i];
+      if (seen >= rank)
+         return g_sketch_min_ms*pow(g_sketch_growth, i + 0.5);
+   }
+   return g_sketch_min_ms*pow(g_sketch_growth, NUM_BUCKETS - 0.5);
+}
+
+double LatencySketch::BucketUpperMs(int bucket)
+{
+   return g_sketch_min_ms*pow(g_sketch_growth, bucket + 1);
+}
+
+void LatencySketch::Reset()
+{
+   for (int i = 0; i < NUM_BUCKETS; i++)
+      buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WheelMetrics
+///////////////////////////////////////////////////////////////////////////////
+
+WheelMetrics::WheelMetrics()
+{
+   Reset();
+}
+
+void WheelMetrics::RecordMove(double ms)
+{
+   long long us = (long long)(ms*1000.0);
+   moves_.fetch_add(1, std::memory_order_relaxed);
+   lastMoveUs_.store(us, std::memory_order_relaxed);
+   totalMoveUs_.fetch_add(us, std::memory_order_relaxed);
+   latency_.Record(ms);
+}
+
+void WheelMetrics::RecordPhase(MovePhase phase, double ms)
+{
+   phaseUs_[phase].fetch_add((long long)(ms*1000.0), std::memory_order_relaxed);
+   phaseCount_[phase].fetch_add(1, std::memory_order_relaxed);
+}
+
+void WheelMetrics::RecordHoming(double ms)
+{
+   homingUs_.fetch_add((long long)(ms*1000.0), std::memory_order_relaxed);
+}
+
+double WheelMetrics::MeanMoveMs() const
+{
+   long moves = moves_.load(std::memory_order_relaxed);
+   if (moves == 0)
+      return 0.0;
+   return totalMoveUs_.load(std::memory_order_relaxed)/1000.0/moves;
+}
+
+double WheelMetrics::MeanPhaseMs(MovePhase phase) const
+{
+   long count = phaseCount_[phase].load(std::memory_order_relaxed);
+   if (count == 0)
+      return 0.0;
+   return phaseUs_[phase].load(std::memory_order_relaxed)/1000.0/count;
+}
+
+// Not atomic as a whole; a move finishing during a reset may be half counted
+void WheelMetrics::Reset()
+{
+   moves_.store(0, std::memory_order_relaxed);
+   timeouts_.store(0, std::memory_order_relaxed);
+   messages_.store(0, std::memory_order_relaxed);
+   lastMoveUs_.store(0, std::memory_order_relaxed);
+   totalMoveUs_.store(0, std::memory_order_relaxed);
+   for (int i = 0; i < NUM_PHASES; i++)
+   {
+      phaseUs_[i].store(0, std::memory_order_relaxed);
+      phaseCount_[i].store(0, std::memory_order_relaxed);
+   }
+   homingUs_.store(0, std::memory_order_relaxed);
+   retries_.store(0, std::memory_order_relaxed);
+   resyncs_.store(0, std::memory_order_relaxed);
+   rehomes_.store(0, std::memory_order_relaxed);
+   failedMoves_.store(0, std::memory_order_relaxed);
+   idleRehomes_.store(0, std::memory_order_relaxed);
+   latency_.Reset();
+}
+
+// Times are exported in seconds as Prometheus expects. The histogram has a
+// bucket edge per sketch bucket, so it carries the full sketch resolution.
+void WheelMetrics::WriteExposition(std::ostream& out, const std::string& labels) const
+{
+   std::string sep = labels.empty() ? "" : ",";
+
+   out << "# TYPE fw103h_moves_total counter\n";
+   out << "fw103h_moves_total{" << labels << "} " << Moves() << "\n";
+   out << "# TYPE fw103h_timeouts_total counter\n";
+   out << "fw103h_timeouts_total{" << labels << "} " << Timeouts() << "\n";
+   out << "# TYPE fw103h_messages_total counter\n";
+   out << "fw103h_messages_total{" << labels << "} " << Messages() << "\n";
+   out << "# TYPE fw103h_recovery_total counter\n";
+   out << "fw103h_recovery_total{" << labels << sep << "action=\"retry\"} " << Retries() << "\n";
+   out << "fw103h_recovery_total{" << labels << sep << "action=\"resync\"} " << Resyncs() << "\n";
+   out << "fw103h_recovery_total{" << labels << sep << "action=\"rehome\"} " << Rehomes() << "\n";
+   out << "fw103h_recovery_total{" << labels << sep << "action=\"failed\"} " << FailedMoves() << "\n";
+   out << "fw103h_recovery_total{" << labels << sep << "action=\"idle_rehome\"} " << IdleRehomes() << "\n";
+   out << "# TYPE fw103h_homing_seconds_total counter\n";
+   out << "fw103h_homing_seconds_total{" << labels << "} " << HomingMs()/1000.0 << "\n";
+   out << "# TYPE fw103h_last_move_seconds gauge\n";
+   out << "fw103h_last_move_seconds{" << labels << "} " << LastMoveMs()/1000.0 << "\n";
+
+   out << "# TYPE fw103h_phase_seconds summary\n";
+   for (int i = 0; i < NUM_PHASES; i++)
+   {
+      out << "fw103h_phase_seconds_sum{" << labels << sep << "phase=\"" << g_phase_names[i] << "\"} "
+         << phaseUs_[i].load(std::memory_order_relaxed)/1e6 << "\n";
+      out << "fw103h_phase_seconds_count{" << labels << sep << "phase=\"" << g_phase_names[i] << "\"} "
+         << phaseCount_[i].load(std::memory_order_relaxed) << "\n";
+   }
+
+   // buckets are read one by one while moves may still be recorded, so the
+   // count is taken from the buckets themselves to keep the histogram consistent
+   out << "# TYPE fw103h_move_seconds histogram\n";
+   long cumulative = 0;
+   for (int i = 0; i < LatencySketch::NUM_BUCKETS; i++)
+   {
+      cumulative += latency_.BucketCount(i);
+      out << "fw103h_move_seconds_bucket{" << labels << sep << "le=\"" << LatencySketch::BucketUpperMs(i)/1000.0 << "\"} " << cumulative << "\n";
+   }
+   out << "fw103h_move_seconds_bucket{" << labels << sep << "le=\"+Inf\"} " << cumulative << "\n";
+   out << "fw103h_move_seconds_sum{" << labels << "} " << totalMoveUs_.load(std::memory_order_relaxed)/1e6 << "\n";
+   out << "fw103h_move_seconds_count{" << labels << "} " << cumulative << "\n";
+}
@@ -0,0 +1,101 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelMetrics.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Lock-free move and homing statistics for the filter wheel
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+// Streaming latency histogram with geometrically spaced buckets (10% wide,
+// 0.1 ms to about 18 s). Recording is one relaxed increment, so any thread can
+// record without locking; quantiles are read with about 5% relative error.
+class LatencySketch
+{
+public:
+   LatencySketch();
+   void Record(double ms);
+   double Quantile(double q) const;
+   void Reset();
+
+   long BucketCount(int bucket) const {return buckets_[bucket].load(std::memory_order_relaxed);}
+   static double BucketUpperMs(int bucket);
+
+   static const int NUM_BUCKETS = 128;
+
+private:
+   std::atomic<long> buckets_[NUM_BUCKETS];
+};
+
+// Where a move spends its time: issuing the command, waiting for the
+// completion message, and confirming the position
+enum MovePhase
+{
+   PHASE_COMMAND,
+   PHASE_COMPLETION,
+   PHASE_VERIFY,
+   NUM_PHASES
+};
+
+class WheelMetrics
+{
+public:
+   WheelMetrics();
+
+   void RecordMove(double ms);
+   void RecordPhase(MovePhase phase, double ms);
+   void RecordHoming(double ms);
+   void RecordTimeout() {timeouts_.fetch_add(1, std::memory_order_relaxed);}
+   void RecordMessage() {messages_.fetch_add(1, std::memory_order_relaxed);}
+   // recovery outcomes, see ThorlabsFilterWheel::RecoverMove
+   void RecordRetry() {retries_.fetch_add(1, std::memory_order_relaxed);}
+   void RecordResync() {resyncs_.fetch_add(1, std::memory_order_relaxed);}
+   void RecordRehome() {rehomes_.fetch_add(1, std::memory_order_relaxed);}
+   void RecordFailedMove() {failedMoves_.fetch_add(1, std::memory_order_relaxed);}
+   void RecordIdleRehome() {idleRehomes_.fetch_add(1, std::memory_order_relaxed);}
+   void Reset();
+
+   // Prometheus text exposition of everything above; labels go inside {} as is
+   void WriteExposition(std::ostream& out, const std::string& labels) const;
+
+   long Moves() const {return moves_.load(std::memory_order_relaxed);}
+   long Timeouts() const {return timeouts_.load(std::memory_order_relaxed);}
+   long Messages() const {return messages_.load(std::memory_order_relaxed);}
+   double LastMoveMs() const {return lastMoveUs_.load(std::memory_order_relaxed)/1000.0;}
+   double MeanMoveMs() const;
+   double MoveQuantileMs(double q) const {return latency_.Quantile(q);}
+   double MeanPhaseMs(MovePhase phase) const;
+   double PhaseTotalMs(MovePhase phase) const {return phaseUs_[phase].load(std::memory_order_relaxed)/1000.0;}
+   long PhaseCount(MovePhase phase) const {return phaseCount_[phase].load(std::memory_order_relaxed);}
+   double HomingMs() const {return homingUs_.load(std::memory_order_relaxed)/1000.0;}
+   long Retries() const {return retries_.load(std::memory_order_relaxed);}
+   long Resyncs() const {return resyncs_.load(std::memory_order_relaxed);}
+   long Rehomes() const {return rehomes_.load(std::memory_order_relaxed);}
+   long FailedMoves() const {return failedMoves_.load(std::memory_order_relaxed);}
+   long IdleRehomes() const {return idleRehomes_.load(std::memory_order_relaxed);}
+
+private:
+   // times are kept in whole microseconds so they fit integer atomics
+   std::atomic<long> moves_;
+   std::atomic<long> timeouts_;
+   std::atomic<long> messages_;
+   std::atomic<long long> lastMoveUs_;
+   std::atomic<long long> totalMoveUs_;
+   std::atomic<long long> phaseUs_[NUM_PHASES];
+   std::atomic<long> phaseCount_[NUM_PHASES];
+   std::atomic<long long> homingUs_;
+   std::atomic<long> retries_;
+   std::atomic<long> resyncs_;
+   std::atomic<long> rehomes_;
+   std::atomic<long> failedMoves_;
+   std::atomic<long> idleRehomes_;
+   LatencySketch latency_;
+};
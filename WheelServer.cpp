@@ -0,0 +1,338 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelServer.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Named pipe server and client sharing one wheel between processes
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#include "WheelServer.h"
+#include "ThorlabsFW103H.h"
+#include "../../MMDevice/MMDeviceConstants.h"
+#include <stdio.h>
+#include <string.h>
+
+const int g_session_batch = 64;         // requests taken in one read
+const DWORD g_pipe_buffer = g_session_batch * sizeof(WheelResponse);
+const size_t g_max_sessions = 16;
+const int g_server_retry_ms = 100;
+
+std::string WheelPipeName(const std::string& serial, long channel)
+{
+   char name[64];
+   sprintf(name, "\\\\.\\pipe\\FW103H_%s_%ld", serial.c_str(), channel);
+   return name;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WheelSessionThread
+///////////////////////////////////////////////////////////////////////////////
+
+WheelSessionThread::WheelSessionThread(ThorlabsFilterWheel* wheel, HANDLE pipe, std::atomic<long>* served) :
+   wheel_(wheel),
+   pipe_(pipe),
+   served_(served),
+   thread_(NULL),
+   stop_(true),
+   running_(false),
+   finished_(false)
+{
+}
+
+WheelSessionThread::~WheelSessionThread()
+{
+   Stop();
+   if (thread_ != NULL)
+      CloseHandle(thread_);
+   CloseHandle(pipe_);
+}
+
+void WheelSessionThread::Start()
+{
+   if (running_)
+      return;
+   stop_ = false;
+   finished_ = false;
+   running_ = true;
+   activate();
+}
+
+void WheelSessionThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   // disconnecting a synchronous pipe waits behind the blocked read, so cancel
+   // the read itself; repeat in case the thread had not reached it yet, and
+   // let a request being served finish first
+   while (!finished_)
+   {
+      if (thread_ != NULL)
+         CancelSynchronousIo(thread_);
+      Sleep(10);
+   }
+   wait();
+   DisconnectNamedPipe(pipe_);
+   running_ = false;
+}
+
+int WheelSessionThread::svc()
+{
+   char buffer[g_session_batch * sizeof(WheelRequest)];
+   WheelResponse responses[g_session_batch];
+   DWORD have = 0;
+   thread_ = OpenThread(THREAD_TERMINATE, FALSE, GetCurrentThreadId());
+   while (!stop_)
+   {
+      // blocks until the client writes, then returns everything it has queued
+      DWORD read = 0;
+      if (!ReadFile(pipe_, buffer + have, sizeof(buffer) - have, &read, NULL) || read == 0)
+         break;
+      have += read;
+      DWORD count = have / sizeof(WheelRequest);
+      DWORD served = 0;
+      for (; served < count && !stop_; served++)
+      {
+         WheelRequest request;
+         memcpy(&request, buffer + served*sizeof(WheelRequest), sizeof(request));
+         Serve(request, responses[served]);
+      }
+      // keep a request split across reads for the next one
+      have -= served*sizeof(WheelRequest);
+      memmove(buffer, buffer + served*sizeof(WheelRequest), have);
+      if (served == 0)
+         continue;
+      DWORD written = 0;
+      if (!WriteFile(pipe_, responses, served*sizeof(WheelResponse), &written, NULL))
+         break;
+   }
+   finished_ = true;
+   return 0;
+}
+
+void WheelSessionThread::Serve(const WheelRequest& request, WheelResponse& response)
+{
+   response.tag = request.tag;
+   switch (request.op)
+   {
+   case WHEEL_OP_MOVE:
+      response.result = wheel_->ServeMove(request.arg);
+      break;
+   case WHEEL_OP_STATUS:
+      response.result = DEVICE_OK;
+      break;
+   default:
+      response.result = DEVICE_NOT_SUPPORTED;
+   }
+   response.position = wheel_->GetPosition();
+   response.motionState = wheel_->GetMotionState();
+   response.statusBits = wheel_->GetMotorStatus().bits;
+   (*served_)++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WheelServerThread
+///////////////////////////////////////////////////////////////////////////////
+
+WheelServerThread::WheelServerThread(ThorlabsFilterWheel* wheel) :
+   wheel_(wheel),
+   served_(0),
+   stop_(true),
+   running_(false),
+   finished_(false)
+{
+}
+
+WheelServerThread::~WheelServerThread()
+{
+   Stop();
+}
+
+void WheelServerThread::Start(const std::string& pipeName)
+{
+   if (running_)
+      return;
+   pipeName_ = pipeName;
+   stop_ = false;
+   finished_ = false;
+   running_ = true;
+   activate();
+}
+
+void WheelServerThread::Stop()
+{
+   if (!running_)
+      return;
+   stop_ = true;
+   // the accept loop blocks in ConnectNamedPipe until someone connects
+   while (!finished_)
+   {
+      HANDLE poke = CreateFileA(pipeName_.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+      if (poke != INVALID_HANDLE_VALUE)
+         CloseHandle(poke);
+      Sleep(10);
+   }
+   wait();
+   running_ = false;
+}
+
+int WheelServerThread::svc()
+{
+   while (!stop_)
+   {
+      HANDLE pipe = CreateNamedPipeA(pipeName_.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+         PIPE_UNLIMITED_INSTANCES, g_pipe_buffer, g_pipe_buffer, 0, NULL);
+      if (pipe == INVALID_HANDLE_VALUE)
+      {
+         printf("Could not create pipe %s\n", pipeName_.c_str());
+         Sleep(g_server_retry_ms);
+         continue;
+      }
+      bool connected = ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+      ReapSessions(false);
+      if (stop_ || !connected || sessions_.size() >= g_max_sessions)
+      {
+         CloseHandle(pipe);
+         continue;
+      }
+      WheelSessionThread* session = new WheelSessionThread(wheel_, pipe, &served_);
+      session->Start();
+      sessions_.push_back(session);
+   }
+   ReapSessions(true);
+   finished_ = true;
+   return 0;
+}
+
+void WheelServerThread::ReapSessions(bool all)
+{
+   std::vector<WheelSessionThread*> live;
+   for (size_t i = 0; i < sessions_.size(); i++)
+   {
+      if (all || sessions_[i]->IsFinished())
+         delete sessions_[i];
+      else
+         live.push_back(sessions_[i]);
+   }
+   sessions_.swap(live);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WheelClient
+///////////////////////////////////////////////////////////////////////////////
+
+WheelClient::WheelClient() :
+   pipe_(INVALID_HANDLE_VALUE),
+   timeoutMs_(0),
+   nextTag_(0)
+{
+}
+
+WheelClient::~WheelClient()
+{
+   Close();
+}
+
+int WheelClient::Connect(const std::string& pipeName, int timeoutMs)
+{
+   MMThreadGuard guard(lock_);
+   Disconnect();
+   pipeName_ = pipeName;
+   timeoutMs_ = timeoutMs;
+   return Open();
+}
+
+void WheelClient::Close()
+{
+   MMThreadGuard guard(lock_);
+   Disconnect();
+}
+
+int WheelClient::Open()
+{
+   for (int attempt = 0; attempt < 2; attempt++)
+   {
+      pipe_ = CreateFileA(pipeName_.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+      if (pipe_ != INVALID_HANDLE_VALUE)
+         return DEVICE_OK;
+      // every instance is taken; wait for the server to create another
+      if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeA(pipeName_.c_str(), timeoutMs_))
+         break;
+   }
+   return DEVICE_ERR;
+}
+
+void WheelClient::Disconnect()
+{
+   if (pipe_ != INVALID_HANDLE_VALUE)
+      CloseHandle(pipe_);
+   pipe_ = INVALID_HANDLE_VALUE;
+}
+
+int WheelClient::Transact(const WheelRequest* requests, int count, WheelResponse* responses)
+{
+   MMThreadGuard guard(lock_);
+   std::vector<WheelRequest> tagged(requests, requests + count);
+   unsigned long firstTag = nextTag_;
+   for (int i = 0; i < count; i++)
+      tagged[i].tag = nextTag_++;
+
+   DWORD size = count * sizeof(WheelRequest);
+   DWORD written = 0;
+   bool sent = IsOpen() && WriteFile(pipe_, &tagged[0], size, &written, NULL) && written == size;
+   if (!sent)
+   {
+      // nothing was delivered, so it is safe to reconnect (server restarted) and resend
+      Disconnect();
+      if (Open() != DEVICE_OK)
+         return DEVICE_ERR;
+      if (!WriteFile(pipe_, &tagged[0], size, &written, NULL) || written != size)
+      {
+         Disconnect();
+         return DEVICE_ERR;
+      }
+   }
+
+   char* in = (char*)responses;
+   DWORD expected = count * sizeof(WheelResponse);
+   DWORD have = 0;
+   while (have < expected)
+   {
+      DWORD read = 0;
+      if (!ReadFile(pipe_, in + have, expected - have, &read, NULL) || read == 0)
+      {
+         Disconnect();
+         return DEVICE_ERR;
+      }
+      have += read;
+   }
+   for (int i = 0; i < count; i++)
+   {
+      if (responses[i].tag != firstTag + i)
+      {
+         Disconnect();
+         return DEVICE_ERR;
+      }
+   }
+   return DEVICE_OK;
+}
+
+int WheelClient::Move(long pos, WheelResponse& response)
+{
+   WheelRequest request;
+   memset(&request, 0, sizeof(request));
+   request.op = WHEEL_OP_MOVE;
+   request.arg = pos;
+   return Transact(&request, 1, &response);
+}
+
+int WheelClient::Status(WheelResponse& response)
+{
+   WheelRequest request;
+   memset(&request, 0, sizeof(request));
+   request.op = WHEEL_OP_STATUS;
+   return Transact(&request, 1, &response);
+}
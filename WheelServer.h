@@ -0,0 +1,133 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          WheelServer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Named pipe server and client sharing one wheel between processes
+// COPYRIGHT:     Imperial College London 2020
+// LICENSE:       GPL
+// AUTHOR:        Leo Rowe-Brown
+//-----------------------------------------------------------------------------
+
+#pragma once
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include "../../MMDevice/DeviceThreads.h"
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+class ThorlabsFilterWheel;
+
+enum WheelOp
+{
+   WHEEL_OP_STATUS = 0,
+   WHEEL_OP_MOVE = 1
+};
+
+// Wire format on "\\.\pipe\FW103H_<serial>_<channel>". Fixed-size records in
+// both directions; a client may write any number of requests before reading,
+// and gets one response per request, in order, carrying the request's tag.
+#pragma pack(push, 1)
+struct WheelRequest
+{
+   unsigned char op;       // WheelOp
+   unsigned char reserved[3];
+   unsigned long tag;      // echoed in the response
+   long arg;               // target slot for WHEEL_OP_MOVE
+};
+
+struct WheelResponse
+{
+   unsigned long tag;
+   long result;            // DEVICE_OK or the adapter's error code
+   long position;          // slot after the request, 0-based
+   long motionState;       // index into the "Motion state" names
+   unsigned long statusBits;
+};
+#pragma pack(pop)
+
+std::string WheelPipeName(const std::string& serial, long channel);
+
+// One connected client. Each read takes whatever the client has queued, so
+// pipelined requests are served as a batch and answered with a single write.
+class WheelSessionThread : public MMDeviceThreadBase
+{
+public:
+   WheelSessionThread(ThorlabsFilterWheel* wheel, HANDLE pipe, std::atomic<long>* served);
+   ~WheelSessionThread();
+   int svc();
+   void Start();
+   void Stop();
+   bool IsFinished() const {return finished_;}
+
+private:
+   void Serve(const WheelRequest& request, WheelResponse& response);
+
+   ThorlabsFilterWheel* wheel_;
+   HANDLE pipe_;
+   std::atomic<long>* served_;
+   HANDLE volatile thread_;      // for cancelling the blocking read
+   volatile bool stop_;
+   volatile bool running_;
+   volatile bool finished_;
+};
+
+// Accepts clients on the wheel's pipe, one session thread per client. Every
+// request goes through the wheel's command queue, so served moves interleave
+// with local ones exactly as two local callers would.
+class WheelServerThread : public MMDeviceThreadBase
+{
+public:
+   WheelServerThread(ThorlabsFilterWheel* wheel);
+   ~WheelServerThread();
+   int svc();
+   void Start(const std::string& pipeName);
+   void Stop();
+   bool IsRunning() const {return running_;}
+   const std::string& PipeName() const {return pipeName_;}
+   long RequestsServed() const {return served_;}
+
+private:
+   void ReapSessions(bool all);
+
+   ThorlabsFilterWheel* wheel_;
+   std::string pipeName_;
+   std::vector<WheelSessionThread*> sessions_;
+   std::atomic<long> served_;
+   volatile bool stop_;
+   volatile bool running_;
+   volatile bool finished_;
+};
+
+// Client end used when another process owns the controller. Calls from
+// several threads are serialized so their responses cannot interleave.
+class WheelClient
+{
+public:
+   WheelClient();
+   ~WheelClient();
+
+   int Connect(const std::string& pipeName, int timeoutMs);
+   void Close();
+   bool IsOpen() const {return pipe_ != INVALID_HANDLE_VALUE;}
+
+   // writes all requests at once, then reads all responses
+   int Transact(const WheelRequest* requests, int count, WheelResponse* responses);
+   int Move(long pos, WheelResponse& response);
+   int Status(WheelResponse& response);
+
+private:
+   int Open();
+   void Disconnect();
+
+   MMThreadLock lock_;
+   HANDLE pipe_;
+   std::string pipeName_;
+   int timeoutMs_;
+   unsigned long nextTag_;
+};